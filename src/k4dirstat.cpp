@@ -40,6 +40,8 @@
 #include "kdirtreecache.h"
 #include "kdirtreeview.h"
 #include "kexcluderules.h"
+#include "kfiletypeview.h"
+#include "klargestitemsview.h"
 #include "ktreemaptile.h"
 #include "ktreemapview.h"
 #include <KIO/ApplicationLauncherJob>
@@ -49,6 +51,8 @@
 #include <KIconEngine>
 #include <KIconLoader>
 #include <QClipboard>
+#include <QDockWidget>
+#include <QFile>
 #include <QIcon>
 #include <QList>
 #include <QMenu>
@@ -133,6 +137,22 @@ k4dirstat::k4dirstat()
   connect(_treeView, SIGNAL(finished()), this, SLOT(updateActions()));
   connect(_treeView, SIGNAL(aborted()), this, SLOT(updateActions()));
 
+  // The side panels are hidden until the user asks for them
+
+  _largestItemsDock = new QDockWidget(i18n("Largest Items"), this);
+  _largestItemsDock->setObjectName("largestItemsDock"); // for saveState()
+  _largestItemsView = new KLargestItemsView(_treeView->tree());
+  _largestItemsDock->setWidget(_largestItemsView);
+  addDockWidget(Qt::RightDockWidgetArea, _largestItemsDock);
+  _largestItemsDock->hide();
+
+  _fileTypeDock = new QDockWidget(i18n("File Types"), this);
+  _fileTypeDock->setObjectName("fileTypeDock"); // for saveState()
+  _fileTypeView = new KFileTypeView(_treeView->tree());
+  _fileTypeDock->setWidget(_fileTypeView);
+  addDockWidget(Qt::RightDockWidgetArea, _fileTypeDock);
+  _fileTypeDock->hide();
+
   // tell the KXmlGuiWindow that this is indeed the main widget
   // setCentralWidget(m_view);
 
@@ -224,6 +244,10 @@ void k4dirstat::setupActions() {
   _fileAskReadCache->setText(i18n("&Read Cache File..."));
   _fileAskReadCache->setIcon(icon("document-import"));
 
+  _fileResumeReading = actionCollection()->addAction(
+      "file_resume_reading", this, SLOT(resumeReading()));
+  _fileResumeReading->setText(i18n("Res&ume Interrupted Scan"));
+
   _fileQuit = KStandardAction::quit(QCoreApplication::instance(), SLOT(quit()),
                                     actionCollection());
   _editCopy = KStandardAction::copy(this, SLOT(editCopy()), actionCollection());
@@ -263,6 +287,21 @@ void k4dirstat::setupActions() {
           SLOT(toggleTreemapView()));
   actionCollection()->setDefaultShortcut(_showTreemapView, Qt::Key_F9);
 
+  QAction *showLargestItems = _largestItemsDock->toggleViewAction();
+  showLargestItems->setText(i18n("Show Largest Items"));
+  actionCollection()->addAction("options_show_largest_items",
+                                showLargestItems);
+  actionCollection()->setDefaultShortcut(showLargestItems, Qt::Key_F8);
+  showLargestItems->setStatusTip(
+      i18n("Shows the largest files and directories"));
+
+  QAction *showFileTypes = _fileTypeDock->toggleViewAction();
+  showFileTypes->setText(i18n("Show File Types"));
+  actionCollection()->addAction("options_show_file_types", showFileTypes);
+  actionCollection()->setDefaultShortcut(showFileTypes, Qt::Key_F7);
+  showFileTypes->setStatusTip(
+      i18n("Shows how much space the files of each type take up"));
+
   QAction *newAct =
       actionCollection()->addAction("treemap_help", this, SLOT(treemapHelp()));
   newAct->setText(i18n("Help about Treemaps"));
@@ -297,6 +336,9 @@ void k4dirstat::setupActions() {
            "loaded much faster"));
   _fileAskReadCache->setStatusTip(
       i18n("Reads a directory tree from a cache file"));
+  _fileResumeReading->setStatusTip(
+      i18n("Reads the last checkpoint of an interrupted scan and continues "
+           "reading from there"));
   _fileQuit->setStatusTip(i18n("Quits the application"));
   _editCopy->setStatusTip(
       i18n("Copies the URL of the selected item to the clipboard"));
@@ -387,7 +429,7 @@ void k4dirstat::readMainWinConfig() {
   for (QStringList::Iterator it = excludeRules.begin();
        it != excludeRules.end(); ++it) {
     QString ruleText = *it;
-    KExcludeRules::excludeRules()->add(new KExcludeRule(QRegExp(ruleText)));
+    KExcludeRules::excludeRules()->add(KExcludeRule::fromText(ruleText));
     qDebug() << "Adding exclude rule: " << ruleText << Qt::endl;
   }
 
@@ -518,6 +560,16 @@ void k4dirstat::askReadCache() {
   }
 }
 
+void k4dirstat::resumeReading() {
+  QString file_name = KDirTree::checkpointFileName();
+
+  if (QFile::exists(file_name) && _treeView) {
+    statusMsg(i18n("Resuming interrupted scan..."));
+    _fileRefreshAll->setEnabled(true);
+    _treeView->readCache(file_name);
+  }
+}
+
 void k4dirstat::editCopy() {
   if (_treeView->selection()) {
     QGuiApplication *app =
@@ -607,6 +659,10 @@ void k4dirstat::updateActions() {
     _fileStopReading->setEnabled(true);
   else
     _fileStopReading->setEnabled(false);
+
+  _fileResumeReading->setEnabled(
+      (!_treeView->tree() || !_treeView->tree()->isBusy()) &&
+      QFile::exists(KDirTree::checkpointFileName()));
 }
 
 void k4dirstat::treemapZoomIn() {
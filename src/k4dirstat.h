@@ -20,6 +20,7 @@ class KUrl;
 class QLabel;
 
 class QSplitter;
+class QDockWidget;
 class KActivityTracker;
 class KFeedbackDialog;
 class KPacMan;
@@ -33,6 +34,8 @@ class KDirTreeView;
 class KDirTreeViewItem;
 class KDirTree;
 class KFileInfo;
+class KFileTypeView;
+class KLargestItemsView;
 class KSettingsDialog;
 class KTreemapView;
 class KTreemapTile;
@@ -262,6 +265,11 @@ public slots:
    **/
   void askReadCache();
 
+  /**
+   * Continue the scan that was interrupted last from its checkpoint.
+   **/
+  void resumeReading();
+
 private slots:
   void triggerSaveConfig();
 
@@ -298,6 +306,10 @@ protected:
   QSplitter *_splitter;
   KDirTreeView *_treeView;
   KTreemapView *_treemapView;
+  QDockWidget *_largestItemsDock;
+  KLargestItemsView *_largestItemsView;
+  QDockWidget *_fileTypeDock;
+  KFileTypeView *_fileTypeView;
   KPacMan *_pacMan;
   QWidget *_pacManDelimiter;
   QMenu *_treeViewContextMenu;
@@ -318,6 +330,7 @@ protected:
   QAction *_fileStopReading;
   QAction *_fileAskWriteCache;
   QAction *_fileAskReadCache;
+  QAction *_fileResumeReading;
   QAction *_fileQuit;
   QAction *_editCopy;
   QAction *_cleanupOpenWith;
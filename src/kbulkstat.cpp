@@ -0,0 +1,290 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#ifdef HAVE_XFS_XFS_H
+#include <xfs/xfs.h>
+#endif
+
+#ifdef HAVE_LINUX_BTRFS_TREE_H
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#endif
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <algorithm>
+
+#include "kbulkstat.h"
+
+#define XFS_BATCH 4096              // inodes per ioctl()
+#define BTRFS_BUFFER_SIZE 262144    // bytes per ioctl()
+#define VERBOSE_BULKSTAT 0
+
+using namespace KDirStat;
+
+KBulkStat::KBulkStat(dev_t device) : _device(device) {}
+
+/**
+ * Returns 'true' if 'path' (with 'statInfo' from lstat()) is the root of
+ * its file system or, on Btrfs, of its subvolume.
+ **/
+static bool isFileSystemRoot(const QByteArray &path,
+                             const struct stat &statInfo, quint32 fsType) {
+  // The root directory of each Btrfs subvolume has this inode number
+  if (fsType == BTRFS_SUPER_MAGIC && statInfo.st_ino == 256)
+    return true;
+
+  struct stat parentInfo;
+
+  if (lstat(path + "/..", &parentInfo) != 0)
+    return false;
+
+  // "/.." is "/" itself
+  return parentInfo.st_dev != statInfo.st_dev ||
+         parentInfo.st_ino == statInfo.st_ino;
+}
+
+KBulkStat *KBulkStat::load(const QString &path,
+                           const std::atomic<bool> *canceled) {
+  QByteArray encodedPath = path.toLocal8Bit();
+  struct statfs fsInfo;
+  struct stat statInfo;
+
+  if (statfs(encodedPath, &fsInfo) != 0 || lstat(encodedPath, &statInfo) != 0)
+    return 0;
+
+  quint32 fsType = (quint32)fsInfo.f_type;
+
+  if (fsType != XFS_SUPER_MAGIC && fsType != BTRFS_SUPER_MAGIC)
+    return 0;
+
+  if (!isFileSystemRoot(encodedPath, statInfo, fsType))
+    return 0;
+
+  int fd = open(encodedPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd < 0)
+    return 0;
+
+  QElapsedTimer timer;
+  timer.start();
+
+  KBulkStat *bulkStat = new KBulkStat(statInfo.st_dev);
+  bool ok = fsType == XFS_SUPER_MAGIC
+                ? bulkStat->loadXfs(fd, canceled)
+                : bulkStat->loadBtrfs(fd, fsInfo.f_bsize, canceled);
+  int error = errno;
+  close(fd);
+
+  if (!ok) {
+    // Most likely no root privileges; lstat() will do.
+    qDebug() << "No bulk stat for" << path << "-" << strerror(error)
+             << Qt::endl;
+    delete bulkStat;
+    return 0;
+  }
+
+  // Both come in inode order, but don't rely on it for the lookups
+  auto byInode = [](const Inode &a, const Inode &b) {
+    return a.inode < b.inode;
+  };
+
+  if (!std::is_sorted(bulkStat->_inodes.begin(), bulkStat->_inodes.end(),
+                      byInode))
+    std::sort(bulkStat->_inodes.begin(), bulkStat->_inodes.end(), byInode);
+
+#if VERBOSE_BULKSTAT
+  qDebug() << "Bulk stat of" << bulkStat->count() << "inodes for" << path
+           << "in" << timer.elapsed() << "ms" << Qt::endl;
+#endif
+
+  return bulkStat;
+}
+
+void KBulkStat::add(ino_t inode, mode_t mode, nlink_t links, off_t size,
+                    blkcnt_t blocks, time_t mtime) {
+  Inode entry;
+  entry.inode = inode;
+  entry.size = size;
+  entry.blocks = blocks;
+  entry.mtime = mtime;
+  entry.mode = mode;
+  entry.links = links;
+
+  _inodes.push_back(entry);
+}
+
+bool KBulkStat::stat(ino_t inode, struct stat *statInfo) const {
+  auto it = std::lower_bound(
+      _inodes.begin(), _inodes.end(), inode,
+      [](const Inode &entry, ino_t inode) { return entry.inode < inode; });
+
+  if (it == _inodes.end() || it->inode != inode)
+    return false;
+
+  memset(statInfo, 0, sizeof(*statInfo));
+  statInfo->st_dev = _device;
+  statInfo->st_ino = it->inode;
+  statInfo->st_mode = it->mode;
+  statInfo->st_nlink = it->links;
+  statInfo->st_size = it->size;
+  statInfo->st_blocks = it->blocks;
+  statInfo->st_mtime = it->mtime;
+
+  return true;
+}
+
+bool KBulkStat::loadXfs(int fd, const std::atomic<bool> *canceled) {
+#ifdef HAVE_XFS_XFS_H
+  std::vector<struct xfs_bstat> buffer(XFS_BATCH);
+  __u64 lastInode = 0;
+  __s32 count = 0;
+
+  struct xfs_fsop_bulkreq request;
+  request.lastip = &lastInode;
+  request.icount = buffer.size();
+  request.ubuffer = buffer.data();
+  request.ocount = &count;
+
+  while (true) {
+    if (canceled && *canceled) {
+      errno = ECANCELED;
+      return false;
+    }
+
+    if (ioctl(fd, XFS_IOC_FSBULKSTAT, &request) != 0)
+      return false;
+
+    if (count == 0)
+      return true;
+
+    for (int i = 0; i < count; i++) {
+      const struct xfs_bstat &bstat = buffer[i];
+
+      // bs_blocks is in file system blocks
+      if (!S_ISDIR(bstat.bs_mode))
+        add(bstat.bs_ino, bstat.bs_mode, bstat.bs_nlink, bstat.bs_size,
+            bstat.bs_blocks * bstat.bs_blksize / 512, bstat.bs_mtime.tv_sec);
+    }
+  }
+#else
+  (void)fd;
+  (void)canceled;
+  errno = ENOTSUP;
+  return false;
+#endif
+}
+
+bool KBulkStat::loadBtrfs(int fd, long blockSize,
+                          const std::atomic<bool> *canceled) {
+#ifdef HAVE_LINUX_BTRFS_TREE_H
+  std::vector<quint64> storage(
+      (sizeof(struct btrfs_ioctl_search_args_v2) + BTRFS_BUFFER_SIZE) /
+      sizeof(quint64));
+  struct btrfs_ioctl_search_args_v2 *args =
+      (struct btrfs_ioctl_search_args_v2 *)storage.data();
+
+  // The search covers all keys between (min_objectid, min_type, min_offset)
+  // and (max_objectid, max_type, max_offset), so there will be other items
+  // in between. An inode item is the first item of its inode.
+
+  memset(&args->key, 0, sizeof(args->key));
+  args->key.tree_id = 0; // The subvolume of 'fd'
+  args->key.min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+  args->key.max_objectid = BTRFS_LAST_FREE_OBJECTID;
+  args->key.min_type = BTRFS_INODE_ITEM_KEY;
+  args->key.max_type = BTRFS_INODE_ITEM_KEY;
+  args->key.max_offset = (__u64)-1;
+  args->key.max_transid = (__u64)-1;
+
+  while (true) {
+    if (canceled && *canceled) {
+      errno = ECANCELED;
+      return false;
+    }
+
+    args->key.nr_items = (__u32)-1;
+    args->buf_size = BTRFS_BUFFER_SIZE;
+
+    if (ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args) != 0)
+      return false;
+
+    if (args->key.nr_items == 0)
+      return true;
+
+    const char *ptr = (const char *)args->buf;
+    __u64 lastInode = 0;
+
+    for (__u32 i = 0; i < args->key.nr_items; i++) {
+      struct btrfs_ioctl_search_header header;
+      memcpy(&header, ptr, sizeof(header));
+      ptr += sizeof(header);
+
+      if (header.type == BTRFS_INODE_ITEM_KEY &&
+          header.len >= sizeof(struct btrfs_inode_item)) {
+        struct btrfs_inode_item item;
+        memcpy(&item, ptr, sizeof(item));
+        mode_t mode = le32toh(item.mode);
+
+        // nbytes is what the extents take up, not rounded to blocks yet
+        if (!S_ISDIR(mode)) {
+          quint64 bytes = le64toh(item.nbytes);
+          bytes = (bytes + blockSize - 1) / blockSize * blockSize;
+
+          add(header.objectid, mode, le32toh(item.nlink),
+              le64toh(item.size), bytes / 512, le64toh(item.mtime.sec));
+        }
+      }
+
+      ptr += header.len;
+      lastInode = header.objectid;
+    }
+
+    if (lastInode >= args->key.max_objectid)
+      return true;
+
+    // Go on with the next inode; the rest of this one is of no interest
+
+    args->key.min_objectid = lastInode + 1;
+    args->key.min_type = BTRFS_INODE_ITEM_KEY;
+    args->key.min_offset = 0;
+  }
+#else
+  (void)fd;
+  (void)blockSize;
+  (void)canceled;
+  errno = ENOTSUP;
+  return false;
+#endif
+}
+
+KBulkStatLoader::KBulkStatLoader(const QString &path)
+    : _path(path), _result(0), _canceled(false), _done(false) {
+  setAutoDelete(false);
+}
+
+KBulkStatLoader::~KBulkStatLoader() { delete _result; }
+
+void KBulkStatLoader::run() {
+  _result = KBulkStat::load(_path, &_canceled);
+  _done = true;
+}
+
+KBulkStat *KBulkStatLoader::take() {
+  KBulkStat *result = _result;
+  _result = 0;
+
+  return result;
+}
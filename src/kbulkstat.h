@@ -0,0 +1,158 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QRunnable>
+#include <QString>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <vector>
+
+namespace KDirStat {
+/**
+ * The metadata of all inodes of one file system, read in bulk with the
+ * file system's own ioctl()s instead of with one lstat() per file: XFS
+ * hands them out with XFS_IOC_FSBULKSTAT in inode order, Btrfs with a
+ * tree search for the inode items of a subvolume. Both need root
+ * privileges.
+ *
+ * Directory reading then only needs readdir() for the names and looks up
+ * the rest here by the inode number readdir() returns. Only files are
+ * looked up this way; directories still need lstat() so mount points are
+ * noticed.
+ *
+ * This is a snapshot: Files that were created after loading are not
+ * found, and those that changed since then show the old values. On Btrfs,
+ * recent changes may not even be in the tree yet when loading.
+ *
+ * The values are converted to what lstat() reports: XFS counts blocks in
+ * file system blocks, Btrfs the bytes of all extents, which lstat()
+ * rounds up to whole sectors. VERIFY_BULKSTAT in kdirreadjob.cpp
+ * compares both while reading.
+ *
+ * @short Bulk loaded inode metadata of a file system
+ **/
+class KBulkStat {
+public:
+  /**
+   * Load the metadata of all inodes (except directories) of the file
+   * system (for Btrfs: the subvolume) whose root is 'path'. Returns 0 if
+   * 'path' is not the root of a file system or subvolume, if that file
+   * system is not supported, if the metadata can't be read, e.g. without
+   * root privileges, or if 'canceled' becomes 'true' while loading; the
+   * caller owns the result.
+   *
+   * Below the root, only a part of the file system is read: Loading all
+   * of it would often take longer than the lstat() calls it saves.
+   **/
+  static KBulkStat *load(const QString &path,
+                         const std::atomic<bool> *canceled = 0);
+
+  /**
+   * Fill 'statInfo' with what is known about inode 'inode' like lstat()
+   * would. Returns 'false' if that inode is unknown.
+   **/
+  bool stat(ino_t inode, struct stat *statInfo) const;
+
+  /**
+   * Returns the device of the loaded file system. Inode numbers are
+   * meaningless on other devices.
+   **/
+  dev_t device() const { return _device; }
+
+  /**
+   * Returns the number of inodes loaded.
+   **/
+  size_t count() const { return _inodes.size(); }
+
+protected:
+  /**
+   * Constructor. Use @ref load() to create objects of this class.
+   **/
+  KBulkStat(dev_t device);
+
+  /**
+   * Load with XFS_IOC_FSBULKSTAT. Returns 'false' on failure.
+   **/
+  bool loadXfs(int fd, const std::atomic<bool> *canceled);
+
+  /**
+   * Load with BTRFS_IOC_TREE_SEARCH_V2. Returns 'false' on failure.
+   **/
+  bool loadBtrfs(int fd, long blockSize, const std::atomic<bool> *canceled);
+
+  /**
+   * Add an inode. Inodes have to be added in ascending order.
+   **/
+  void add(ino_t inode, mode_t mode, nlink_t links, off_t size,
+           blkcnt_t blocks, time_t mtime);
+
+  struct Inode {
+    ino_t inode;
+    off_t size;
+    blkcnt_t blocks; // 512 byte blocks
+    time_t mtime;
+    mode_t mode;
+    unsigned int links;
+  };
+
+  dev_t _device;
+  std::vector<Inode> _inodes; // sorted by inode number
+};
+
+/**
+ * Loads a @ref KBulkStat in a thread pool, so the user interface goes on
+ * while it takes its time. Start it with QThreadPool::start(); it is not
+ * deleted automatically when it is done.
+ *
+ * @short Bulk stat loading in the background
+ **/
+class KBulkStatLoader : public QRunnable {
+public:
+  /**
+   * Constructor. 'path' is the root of the file system to load.
+   **/
+  KBulkStatLoader(const QString &path);
+
+  /**
+   * Destructor. Deletes the result unless it was taken. The thread pool
+   * has to be done with this object.
+   **/
+  virtual ~KBulkStatLoader();
+
+  /**
+   * Load. Called in one of the pool's threads.
+   **/
+  void run() override;
+
+  /**
+   * Stop loading as soon as possible. The result will be 0.
+   **/
+  void cancel() { _canceled = true; }
+
+  /**
+   * Returns 'true' when loading is done; only then @ref take() may be
+   * called.
+   **/
+  bool isDone() const { return _done; }
+
+  /**
+   * Returns the result (0 if the file system couldn't be loaded) and
+   * hands it over to the caller.
+   **/
+  KBulkStat *take();
+
+protected:
+  QString _path;
+  KBulkStat *_result;
+  std::atomic<bool> _canceled;
+  std::atomic<bool> _done;
+};
+
+} // namespace KDirStat
@@ -15,9 +15,11 @@
 #include <kmessagebox.h>
 
 #include "kcleanup.h"
+#include "kcleanuprunner.h"
 #include <KLocalizedString>
+#include <QDebug>
 
-#define VERBOSE_RUN_COMMAND 1
+#define VERBOSE_RUN_COMMAND 0
 #define SIMULATE_COMMAND 0
 
 using namespace KDirStat;
@@ -131,43 +133,54 @@ void KCleanup::execute(KDirTree * tree) {
     return;
 
   std::vector<KFileInfo *> selection = tree->selection();
-  for(auto it = selection.begin(); it != selection.end(); ++it) {
-    KFileInfo * item = *it;
-    executeRecursive(item, tree);
 
-    switch (_refreshPolicy) {
-    case noRefresh:
-      // Do nothing.
-      break;
+  if (_refreshPolicy == noRefresh && !isNativeDelete()) {
+    // Nothing to wait for: Simply start the commands in the background.
+
+    for(auto it = selection.begin(); it != selection.end(); ++it) {
+      QStringList commands;
+      executeRecursive(*it, tree, commands);
 
-    case refreshThis:
-      tree->refresh(item);
-      break;
+      foreach (const QString &command, commands)
+        runCommand(command);
+    }
 
-    case refreshParent:
-      tree->refresh(item->parent());
-      break;
+    return;
+  }
 
-    case assumeDeleted:
+  // Run the commands in parallel without blocking the user interface;
+  // the runner updates the tree according to the refresh policy when
+  // everything is done. Don't try to figure out a reasonable next
+  // selection - the views have to do that while handling the subtree
+  // deletion. Only the views have any knowledge about a reasonable
+  // strategy for choosing a next selection. Unlike the view items, the
+  // KFileInfo items don't have an order that makes any sense to the user.
 
-      // Assume the cleanup action has deleted the item.
-      // Modify the KDirTree accordingly.
+  KCleanupRunner *runner = new KCleanupRunner(tree, cleanTitle(),
+                                              _refreshPolicy);
+  Q_CHECK_PTR(runner);
 
-      tree->deleteSubtree(item);
+  for(auto it = selection.begin(); it != selection.end(); ++it) {
+    if (isNativeDelete()) {
+      // Removes the complete subtree anyway, so no recursion. Dot entries
+      // are not real directories and can't be removed like this.
 
-      // Don't try to figure out a reasonable next selection - the
-      // views have to do that while handling the subtree
-      // deletion. Only the views have any knowledge about a
-      // reasonable strategy for choosing a next selection. Unlike
-      // the view items, the KFileInfo items don't have an order that
-      // makes any sense to the user.
+      if (worksFor(*it, tree) && !(*it)->isDotEntry())
+        runner->addItem(*it, QStringList() << nativeDeleteCommand());
 
-      break;
+      continue;
     }
+
+    QStringList commands;
+    executeRecursive(*it, tree, commands);
+    runner->addItem(*it, commands);
   }
+
+  runner->start();
 }
 
-void KCleanup::executeRecursive(KFileInfo *item, KDirTree* tree) {
+void KCleanup::executeRecursive(KFileInfo *item, KDirTree* tree,
+                                QStringList &commands) {
   if (worksFor(item, tree)) {
     if (_recurse) {
       // Recurse into all subdirectories.
@@ -181,14 +194,14 @@ void KCleanup::executeRecursive(KFileInfo *item, KDirTree* tree) {
            * the dot entry) if there are no real subdirectories on
            * this directory level.
            **/
-          executeRecursive(subdir, tree);
+          executeRecursive(subdir, tree, commands);
         }
       }
     }
 
     // Perform cleanup for this directory.
 
-    runCommand(item, _command);
+    commands << expandVariables(item, _command);
   }
 }
 
@@ -234,39 +247,13 @@ QString KCleanup::expandVariables(const KFileInfo *item,
   return expanded;
 }
 
-#include <qtextcodec.h>
-void KCleanup::runCommand(const KFileInfo *item, const QString &command) const {
-  QProcess *proc = new QProcess();
-  QStringList args;
-  args << "-c" << expandVariables(item, command);
+void KCleanup::runCommand(const QString &command) const {
+#if VERBOSE_RUN_COMMAND
+  qDebug() << "Running" << command << "in the background" << Qt::endl;
+#endif
 
 #if !SIMULATE_COMMAND
-  switch (_refreshPolicy) {
-  case noRefresh:
-  case assumeDeleted:
-
-    // In either case it is no use waiting for the command to
-    // finish, so we are starting the command as a pure
-    // background process.
-
-    proc->start("sh", args);
-    break;
-
-  case refreshThis:
-  case refreshParent:
-
-    // If a display refresh is due after the command, we need to
-    // wait for the command to be finished in order to avoid
-    // performing the update prematurely, so we are starting this
-    // process in blocking mode.
-
-    QApplication::setOverrideCursor(Qt::WaitCursor);
-    proc->start("sh", args);
-    proc->waitForFinished();
-    QApplication::restoreOverrideCursor();
-    break;
-  }
-
+  QProcess::startDetached("sh", QStringList() << "-c" << command);
 #endif
 }
 
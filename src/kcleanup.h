@@ -67,9 +67,24 @@ public:
    * KCleanup::execute(). This command line may contain %p for the
    * complete path of the directory or file concerned or %n for the pure
    * file or directory name without path.
+   *
+   * See also @ref nativeDeleteCommand().
    **/
   const QString &command() const { return _command; }
 
+  /**
+   * The command that removes the items in-process instead of running
+   * "rm -rf": See @ref KDirDeleter.
+   **/
+  static QString nativeDeleteCommand() { return "@delete"; }
+
+  /**
+   * Return whether or not this cleanup uses @ref nativeDeleteCommand().
+   **/
+  bool isNativeDelete() const {
+    return _command.trimmed() == nativeDeleteCommand();
+  }
+
   /**
    * Return the user title of this command as displayed in menus.
    * This may include '&' characters for keyboard shortcuts.
@@ -184,8 +199,11 @@ public:
   }
 
   /**
-   * The heart of the matter: Perform the cleanup with the KFileInfo
-   * specified.
+   * The heart of the matter: Perform the cleanup with the selected
+   * KFileInfo items.
+   *
+   * Unless the refresh policy is noRefresh, the commands run through a
+   * @ref KCleanupRunner, i.e. this returns before they are done.
    **/
   virtual void execute(KDirTree *);
 
@@ -203,9 +221,9 @@ public:
 
 protected:
   /**
-   * Recursively perform the cleanup.
+   * Recursively collect the commands to run for 'item' in 'commands'.
    **/
-  void executeRecursive(KFileInfo *item, KDirTree*);
+  void executeRecursive(KFileInfo *item, KDirTree *, QStringList &commands);
 
   /**
    * Ask user for confirmation to execute this cleanup action for
@@ -245,9 +263,9 @@ protected:
                           const QString &unexpanded) const;
 
   /**
-   * Run a command with 'item' as base to expand variables.
+   * Run an expanded command in the background without waiting for it.
    **/
-  void runCommand(const KFileInfo *item, const QString &command) const;
+  void runCommand(const QString &command) const;
 
   /**
    * Internal implementation of the copy constructor and assignment
@@ -0,0 +1,453 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QDebug>
+#include <QProgressDialog>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+
+#include <KLocalizedString>
+
+#include "kcleanuprunner.h"
+#include "kdirdeleter.h"
+
+#define VERBOSE_RUN_COMMAND 0
+#define SIMULATE_COMMAND 0
+
+using namespace KDirStat;
+
+KCleanupRunner::KCleanupRunner(KDirTree *tree, const QString &title,
+                               KCleanup::RefreshPolicy refreshPolicy)
+    : QObject(tree), _tree(tree), _title(title),
+      _refreshPolicy(refreshPolicy), _nextItem(0), _commandCount(0),
+      _commandsDone(0), _canceled(false), _progressDialog(0), _threadPool(0),
+      _bytesFreed(0) {
+  connect(&_rateTimer, SIGNAL(timeout()), this, SLOT(updateRate()));
+
+  connect(_tree, SIGNAL(deletingChild(KFileInfo *)), this,
+          SLOT(deletingChild(KFileInfo *)));
+  connect(_tree, SIGNAL(startingReading()), this, SLOT(startingReading()));
+}
+
+KCleanupRunner::~KCleanupRunner() {
+  // The processes and deleters are deleted as child objects; make sure
+  // they can't call back into this half-destroyed object while they are
+  // killed.
+
+  foreach (QObject *job, _running.keys()) {
+    disconnect(job, 0, this, 0);
+    KDirDeleter *deleter = qobject_cast<KDirDeleter *>(job);
+
+    if (deleter)
+      deleter->cancel();
+  }
+
+  // The deleters' tasks must be done before the deleters go away.
+  if (_threadPool)
+    _threadPool->waitForDone();
+
+  delete _progressDialog;
+}
+
+int KCleanupRunner::maxParallelCommands() {
+  return qMax(1, QThread::idealThreadCount());
+}
+
+void KCleanupRunner::addItem(KFileInfo *item, const QStringList &commands) {
+  // Remember the items themselves: Looking them up by URL when their
+  // commands are done would search the whole tree for each one of them.
+
+  int itemNo = _items.size();
+
+  Item newItem;
+  newItem.node = item;
+  newItem.parent = item->parent();
+  newItem.toplevel = !item->parent();
+  newItem.url = item->debugUrl(); // Dot entries, too
+  newItem.path = item->url();
+  newItem.commands = commands;
+  newItem.nextCommand = 0;
+  newItem.done = false;
+  newItem.failed = false;
+
+  _items.append(newItem);
+  _commandCount += commands.size();
+
+  _nodes.insert(newItem.node, itemNo);
+
+  if (newItem.parent)
+    _nodes.insert(newItem.parent, itemNo);
+}
+
+void KCleanupRunner::start() {
+  if (_commandCount > 0) {
+    // QProgressDialog only shows up if this takes a while
+    _progressDialog =
+        new QProgressDialog(_title, i18n("&Cancel"), 0, _commandCount);
+    _progressDialog->setWindowTitle(i18n("Cleanup"));
+    _progressDialog->setMinimumDuration(500);
+    _progressDialog->setAutoClose(false);
+    _progressDialog->setAutoReset(false);
+
+    connect(_progressDialog, SIGNAL(canceled()), this, SLOT(cancel()));
+  }
+
+  startCommands();
+
+  if (_running.isEmpty())
+    finish();
+}
+
+void KCleanupRunner::startCommands() {
+  while (!_canceled && _running.size() < maxParallelCommands() &&
+         _nextItem < _items.size()) {
+    int itemNo = _nextItem++;
+
+    if (_items[itemNo].commands.isEmpty())
+      _items[itemNo].done = true; // Nothing to do for this one
+    else
+      startCommand(itemNo);
+  }
+}
+
+void KCleanupRunner::startCommand(int itemNo) {
+  Item &item = _items[itemNo];
+  QString command = item.commands[item.nextCommand++];
+
+  if (command == KCleanup::nativeDeleteCommand() && !SIMULATE_COMMAND) {
+    startDelete(itemNo);
+    return;
+  }
+
+#if VERBOSE_RUN_COMMAND
+  qDebug() << "Running" << command << Qt::endl;
+#endif
+
+  QProcess *process = new QProcess(this);
+  connect(process, SIGNAL(finished(int, QProcess::ExitStatus)), this,
+          SLOT(processFinished(int, QProcess::ExitStatus)));
+  connect(process, SIGNAL(errorOccurred(QProcess::ProcessError)), this,
+          SLOT(processError(QProcess::ProcessError)));
+
+  QStringList args;
+
+#if SIMULATE_COMMAND
+  // Only check the command's syntax without running it
+  args << "-n";
+#endif
+
+  args << "-c" << command;
+
+  _running.insert(process, itemNo);
+  process->start("sh", args);
+}
+
+void KCleanupRunner::startDelete(int itemNo) {
+  if (!_threadPool) {
+    _threadPool = new QThreadPool(this);
+    _threadPool->setMaxThreadCount(maxParallelCommands());
+    _deleteTimer.start();
+    _rateTimer.start(250);
+  }
+
+#if VERBOSE_RUN_COMMAND
+  qDebug() << "Deleting" << _items[itemNo].path << Qt::endl;
+#endif
+
+  KDirDeleter *deleter =
+      new KDirDeleter(_items[itemNo].path, _threadPool, &_bytesFreed, this);
+  connect(deleter, SIGNAL(finished(bool)), this, SLOT(deleteFinished(bool)));
+
+  _running.insert(deleter, itemNo);
+  deleter->start();
+}
+
+void KCleanupRunner::processFinished(int exitCode,
+                                     QProcess::ExitStatus exitStatus) {
+  QProcess *process = qobject_cast<QProcess *>(sender());
+
+  if (!_canceled && (exitStatus != QProcess::NormalExit || exitCode != 0)) {
+    Item &item = _items[_running.value(process)];
+    qWarning() << _title << "failed for" << item.url << Qt::endl;
+    item.failed = true;
+  }
+
+  commandDone(process);
+}
+
+void KCleanupRunner::deleteFinished(bool success) {
+  QObject *deleter = sender();
+
+  if (!_running.contains(deleter))
+    return;
+
+  Item &item = _items[_running.value(deleter)];
+
+  if (success) {
+    // We know exactly what is gone: No need to read anything again.
+
+    if (item.node && item.node->isFinished())
+      _tree->deleteSubtree(item.node);
+  } else {
+    item.failed = true;
+  }
+
+  commandDone(deleter);
+}
+
+void KCleanupRunner::updateRate() {
+  qint64 elapsed = _deleteTimer.elapsed();
+  KFileSize bytes = _bytesFreed;
+  KFileSize rate = elapsed > 0 ? bytes * 1000 / elapsed : 0;
+
+  if (_progressDialog)
+    _progressDialog->setLabelText(
+        i18n("%1\nFreed %2 (%3/s)", _title, formatSize(bytes),
+             formatSize(rate)));
+}
+
+void KCleanupRunner::processError(QProcess::ProcessError error) {
+  // Only a process that could not be started at all doesn't get a
+  // finished() signal.
+
+  if (error == QProcess::FailedToStart) {
+    QProcess *process = qobject_cast<QProcess *>(sender());
+    Item &item = _items[_running.value(process)];
+    qWarning() << "Could not start" << _title << "for" << item.url
+               << Qt::endl;
+    item.failed = true;
+
+    commandDone(process);
+  }
+}
+
+void KCleanupRunner::commandDone(QObject *job) {
+  if (!_running.contains(job))
+    return;
+
+  int itemNo = _running.take(job);
+
+  // A deleter may still be returning from emitting finished() in one of
+  // the pool's threads; deleters go away with this object after the pool
+  // is done.
+
+  if (qobject_cast<QProcess *>(job))
+    job->deleteLater();
+
+  _commandsDone++;
+
+  if (_progressDialog)
+    _progressDialog->setValue(_commandsDone);
+
+  Item &item = _items[itemNo];
+
+  if (!_canceled) {
+    if (item.nextCommand < item.commands.size()) {
+      startCommand(itemNo);
+      return;
+    }
+
+    item.done = true;
+    startCommands();
+  }
+
+  if (_running.isEmpty())
+    finish();
+}
+
+void KCleanupRunner::cancel() {
+  if (_canceled)
+    return;
+
+  _canceled = true;
+
+  if (_running.isEmpty()) {
+    finish();
+    return;
+  }
+
+  // The finished() signals of the killed processes and the stopped
+  // deleters will get us to finish().
+
+  foreach (QObject *job, _running.keys()) {
+    QProcess *process = qobject_cast<QProcess *>(job);
+    KDirDeleter *deleter = qobject_cast<KDirDeleter *>(job);
+
+    if (process)
+      process->kill();
+    else if (deleter)
+      deleter->cancel();
+  }
+}
+
+void KCleanupRunner::deletingChild(KFileInfo *deletedChild) {
+  if (_nodes.isEmpty())
+    return;
+
+  if ((int)deletedChild->totalItems() < _nodes.size()) {
+    forgetSubtree(deletedChild);
+    return;
+  }
+
+  // Fewer items remembered than in the subtree: Checking their ancestors
+  // is cheaper.
+
+  QMultiHash<KFileInfo *, int>::iterator it = _nodes.begin();
+
+  while (it != _nodes.end()) {
+    if (it.key()->isInSubtree(deletedChild)) {
+      forget(it.key(), it.value());
+      it = _nodes.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void KCleanupRunner::forgetSubtree(KFileInfo *subtree) {
+  if (_nodes.contains(subtree)) {
+    foreach (int itemNo, _nodes.values(subtree))
+      forget(subtree, itemNo);
+
+    _nodes.remove(subtree);
+  }
+
+  for (size_t i = 0; i < subtree->numChildren(); i++)
+    forgetSubtree(subtree->child(i));
+
+  if (subtree->dotEntry())
+    forgetSubtree(subtree->dotEntry());
+}
+
+void KCleanupRunner::startingReading() {
+  // The tree doesn't send any signals while it is cleared before it
+  // starts reading something new.
+
+  if (_tree->root())
+    return;
+
+  QMultiHash<KFileInfo *, int>::iterator it = _nodes.begin();
+
+  for (; it != _nodes.end(); ++it)
+    forget(it.key(), it.value());
+
+  _nodes.clear();
+}
+
+void KCleanupRunner::forget(KFileInfo *node, int itemNo) {
+  Item &item = _items[itemNo];
+
+  if (item.node == node)
+    item.node = 0;
+
+  if (item.parent == node)
+    item.parent = 0;
+}
+
+void KCleanupRunner::finish() {
+  if (_progressDialog) {
+    disconnect(_progressDialog, 0, this, 0);
+    _progressDialog->hide();
+    _progressDialog->deleteLater();
+    _progressDialog = 0;
+  }
+
+  if (_threadPool) {
+    _rateTimer.stop();
+    qDebug() << "Freed" << formatSize(_bytesFreed) << "in"
+             << _deleteTimer.elapsed() << "ms" << Qt::endl;
+  }
+
+  // Only remember what to refresh for now: Items that are deleted below
+  // are forgotten, so they are not refreshed any more.
+
+  QList<int> refreshThis;
+  QList<int> refreshParent;
+  bool refreshAll = false;
+
+  for (int itemNo = 0; itemNo < _items.size(); itemNo++) {
+    const Item &item = _items[itemNo];
+    bool started = item.done || item.nextCommand > 0;
+
+    if (item.failed) {
+      // Whatever the refresh policy says, it's not clear what this
+      // command left behind.
+
+      refreshThis << itemNo;
+      continue;
+    }
+
+    switch (_refreshPolicy) {
+    case KCleanup::noRefresh:
+      break;
+
+    case KCleanup::refreshThis:
+      if (started)
+        refreshThis << itemNo;
+      break;
+
+    case KCleanup::refreshParent:
+      if (started) {
+        if (item.toplevel)
+          refreshAll = true;
+        else
+          refreshParent << itemNo;
+      }
+      break;
+
+    case KCleanup::assumeDeleted:
+      // Assume the cleanup action has deleted the item. Anything that is
+      // already gone with an ancestor has been forgotten.
+
+      if (item.done && item.node && item.node->isFinished())
+        _tree->deleteSubtree(item.node);
+      break;
+    }
+  }
+
+  if (refreshAll) {
+    _tree->refresh(0);
+  } else if (!refreshThis.isEmpty() || !refreshParent.isEmpty()) {
+    // Refresh each subtree only once and skip those that are inside
+    // another one that is refreshed anyway. Collect them all before
+    // refreshing anything: Refreshing deletes the old subtree.
+
+    QSet<KFileInfo *> nodes;
+
+    foreach (int itemNo, refreshThis) {
+      KFileInfo *node = _items[itemNo].node;
+
+      if (node && node->isFinished())
+        nodes.insert(node);
+    }
+
+    foreach (int itemNo, refreshParent) {
+      KFileInfo *node = _items[itemNo].parent;
+
+      if (node && node->isFinished())
+        nodes.insert(node);
+    }
+
+    QList<KFileInfo *> toRefresh;
+
+    foreach (KFileInfo *node, nodes) {
+      KFileInfo *ancestor = node->parent();
+
+      while (ancestor && !nodes.contains(ancestor))
+        ancestor = ancestor->parent();
+
+      if (!ancestor)
+        toRefresh << node;
+    }
+
+    foreach (KFileInfo *node, toRefresh)
+      _tree->refresh(node);
+  }
+
+  emit finished();
+  deleteLater();
+}
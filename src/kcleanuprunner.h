@@ -0,0 +1,194 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QProcess>
+#include <QStringList>
+#include <QTimer>
+
+#include <atomic>
+
+#include "kcleanup.h"
+
+class QProgressDialog;
+class QThreadPool;
+
+namespace KDirStat {
+/**
+ * Runs the shell commands of one cleanup action for a number of items in
+ * the background, several items in parallel, while showing progress in a
+ * dialog that also allows to cancel the whole thing.
+ *
+ * The commands for one item are run one after another in the order they
+ * were added (the commands for subdirectories of a recursive cleanup
+ * first); only commands for different items run in parallel.
+ *
+ * When everything is done, the tree is brought back into sync according
+ * to the cleanup's refresh policy: Each affected subtree is refreshed
+ * only once, and not at all if an ancestor is refreshed anyway.
+ *
+ * The command @ref KCleanup::nativeDeleteCommand() is not run as a shell
+ * command: The item is removed in-process by a @ref KDirDeleter, and it
+ * is removed from the tree as soon as that is done. The progress dialog
+ * then also shows how many bytes per second are freed.
+ *
+ * The tree may well change while the commands run: Items (and their
+ * parents) that are deleted from the tree in the meantime are forgotten,
+ * so they are neither refreshed nor deleted again. Items whose commands
+ * fail are refreshed from disk instead of being assumed deleted.
+ *
+ * The runner deletes itself when it is done.
+ *
+ * @short Background runner for cleanup commands
+ **/
+class KCleanupRunner : public QObject {
+  Q_OBJECT
+
+public:
+  /**
+   * Constructor. 'title' is shown in the progress dialog.
+   **/
+  KCleanupRunner(KDirTree *tree, const QString &title,
+                 KCleanup::RefreshPolicy refreshPolicy);
+
+  /**
+   * Destructor. Kills any command that is still running.
+   **/
+  virtual ~KCleanupRunner();
+
+  /**
+   * Add 'item' with the (already expanded) shell commands to run for it.
+   **/
+  void addItem(KFileInfo *item, const QStringList &commands);
+
+  /**
+   * Start running the commands.
+   **/
+  void start();
+
+  /**
+   * Returns the maximum number of commands that run at the same time.
+   **/
+  static int maxParallelCommands();
+
+signals:
+  /**
+   * Emitted when all commands are done (or canceled) and the tree has
+   * been updated, just before this object deletes itself.
+   **/
+  void finished();
+
+protected slots:
+  /**
+   * A command finished.
+   **/
+  void processFinished(int exitCode, QProcess::ExitStatus exitStatus);
+
+  /**
+   * A command could not be started or crashed.
+   **/
+  void processError(QProcess::ProcessError error);
+
+  /**
+   * A @ref KDirDeleter is done.
+   **/
+  void deleteFinished(bool success);
+
+  /**
+   * Show how fast the native deletes free space.
+   **/
+  void updateRate();
+
+  /**
+   * Don't start any more commands and kill those that are running.
+   **/
+  void cancel();
+
+  /**
+   * Forget all items and parents in the subtree that is about to be
+   * deleted from the tree.
+   **/
+  void deletingChild(KFileInfo *deletedChild);
+
+  /**
+   * The tree starts reading. Forget all items if it was cleared without
+   * any deletingChild() signal.
+   **/
+  void startingReading();
+
+protected:
+  /**
+   * Start commands until the maximum number of parallel commands is
+   * reached or nothing is left to start.
+   **/
+  void startCommands();
+
+  /**
+   * Start the next command of item number 'itemNo'.
+   **/
+  void startCommand(int itemNo);
+
+  /**
+   * Start removing item number 'itemNo' with a @ref KDirDeleter.
+   **/
+  void startDelete(int itemNo);
+
+  /**
+   * Bookkeeping after 'job' (a QProcess or a KDirDeleter) is done.
+   **/
+  void commandDone(QObject *job);
+
+  /**
+   * Update the tree according to the refresh policy and delete this
+   * object.
+   **/
+  void finish();
+
+  /**
+   * Forget the item or parent 'node' of item number 'itemNo'.
+   **/
+  void forget(KFileInfo *node, int itemNo);
+
+  /**
+   * Forget all items and parents in 'subtree', looking up each of its
+   * nodes. Cheaper than checking all items if the subtree is small.
+   **/
+  void forgetSubtree(KFileInfo *subtree);
+
+  struct Item {
+    KFileInfo *node;   // 0 if it is gone from the tree
+    KFileInfo *parent; // 0 if it is gone from the tree
+    bool toplevel;     // no parent: refreshing the parent refreshes all
+    QString url;
+    QString path;
+    QStringList commands;
+    int nextCommand;
+    bool done;   // all commands ran
+    bool failed; // a command failed
+  };
+
+  KDirTree *_tree;
+  QString _title;
+  KCleanup::RefreshPolicy _refreshPolicy;
+  QList<Item> _items;
+  int _nextItem;
+  int _commandCount;
+  int _commandsDone;
+  bool _canceled;
+  QHash<QObject *, int> _running; // process or deleter -> item number
+  QMultiHash<KFileInfo *, int> _nodes; // item or parent -> item number
+  QProgressDialog *_progressDialog;
+  QThreadPool *_threadPool;
+  std::atomic<KFileSize> _bytesFreed;
+  QElapsedTimer _deleteTimer;
+  QTimer _rateTimer;
+};
+
+} // namespace KDirStat
@@ -0,0 +1,207 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include "kdirdeleter.h"
+
+using namespace KDirStat;
+
+static const size_t LSTAT_BLOCK_SIZE = 512;
+
+/**
+ * Returns the disk space that is freed by removing an entry, the same as
+ * KFileInfo::allocatedSize().
+ **/
+static KFileSize allocatedSize(const struct stat &statInfo) {
+  return (KFileSize)statInfo.st_blocks * LSTAT_BLOCK_SIZE;
+}
+
+/**
+ * A directory whose contents are being removed.
+ **/
+struct KDirDeleter::Dir {
+  QByteArray name; // relative to the parent's fd
+  QByteArray path; // only for messages
+  Dir *parent;
+  KFileSize size;
+  int fd; // open until the directory itself is removed
+
+  // The task reading this directory plus one for each subdirectory that
+  // is not removed yet
+  std::atomic<int> pending;
+
+  Dir(const QByteArray &name, const QByteArray &path, Dir *parent,
+      KFileSize size)
+      : name(name), path(path), parent(parent), size(size), fd(-1),
+        pending(1) {}
+
+  int depth() const { return parent ? parent->depth() + 1 : 0; }
+};
+
+class KDirDeleter::Task : public QRunnable {
+public:
+  Task(KDirDeleter *deleter, Dir *dir) : _deleter(deleter), _dir(dir) {}
+
+  void run() override { _deleter->scan(_dir); }
+
+private:
+  KDirDeleter *_deleter;
+  Dir *_dir;
+};
+
+KDirDeleter::KDirDeleter(const QString &path, QThreadPool *threadPool,
+                         std::atomic<KFileSize> *bytesFreed, QObject *parent)
+    : QObject(parent), _path(path.toLocal8Bit()), _threadPool(threadPool),
+      _bytesFreed(bytesFreed), _canceled(false), _errors(0), _topFd(-1) {}
+
+KDirDeleter::~KDirDeleter() {}
+
+void KDirDeleter::start() {
+  // Even the first lstat() is done in the thread pool so finished() is
+  // never emitted from within start().
+
+  _threadPool->start(new Task(this, 0));
+}
+
+void KDirDeleter::scan(Dir *dir) {
+  if (!dir) {
+    // Everything below is opened and removed relative to the directory
+    // that contains the top level path, so nothing below it can be
+    // redirected somewhere else by replacing a directory with a symlink
+    // while the deletion is going on.
+
+    int slash = _path.lastIndexOf('/');
+    QByteArray topDir = slash > 0 ? _path.left(slash) : QByteArray("/");
+    QByteArray name = _path.mid(slash + 1);
+
+    _topFd = open(topDir.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (_topFd < 0) {
+      error(topDir, "open");
+      emit finished(false);
+      return;
+    }
+
+    struct stat statInfo;
+
+    if (fstatat(_topFd, name.constData(), &statInfo, AT_SYMLINK_NOFOLLOW) !=
+        0) {
+      error(_path, "lstat");
+      close(_topFd);
+      emit finished(false);
+      return;
+    }
+
+    if (!S_ISDIR(statInfo.st_mode)) {
+      if (unlinkat(_topFd, name.constData(), 0) == 0)
+        *_bytesFreed += allocatedSize(statInfo);
+      else
+        error(_path, "unlink");
+
+      close(_topFd);
+      emit finished(_errors == 0);
+      return;
+    }
+
+    dir = new Dir(name, _path, 0, allocatedSize(statInfo));
+  }
+
+  if (!_canceled) {
+    int parentFd = dir->parent ? dir->parent->fd : _topFd;
+    dir->fd = openat(parentFd, dir->name.constData(),
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    // readdir() gets its own fd: closedir() closes that, and the
+    // subdirectories still need this directory's fd.
+
+    int readFd = dir->fd >= 0 ? dup(dir->fd) : -1;
+    DIR *diskDir = readFd >= 0 ? fdopendir(readFd) : 0;
+
+    if (!diskDir) {
+      error(dir->path, "open");
+
+      if (readFd >= 0)
+        close(readFd);
+    } else {
+      struct dirent *entry;
+
+      while (!_canceled && (entry = readdir(diskDir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+          continue;
+
+        struct stat statInfo;
+
+        if (fstatat(dir->fd, entry->d_name, &statInfo, AT_SYMLINK_NOFOLLOW) !=
+            0) {
+          error(dir->path + '/' + entry->d_name, "lstat");
+          continue;
+        }
+
+        if (S_ISDIR(statInfo.st_mode)) {
+          Dir *subDir = new Dir(entry->d_name, dir->path + '/' + entry->d_name,
+                                dir, allocatedSize(statInfo));
+          dir->pending++;
+
+          // Deeper directories first: Each directory keeps its fd open
+          // until it is removed, so finish one branch before starting
+          // too many others.
+
+          _threadPool->start(new Task(this, subDir), subDir->depth());
+        } else if (unlinkat(dir->fd, entry->d_name, 0) == 0) {
+          *_bytesFreed += allocatedSize(statInfo);
+        } else {
+          error(dir->path + '/' + entry->d_name, "unlink");
+        }
+      }
+
+      closedir(diskDir); // This closes 'readFd', too
+    }
+  }
+
+  dirDone(dir);
+}
+
+void KDirDeleter::dirDone(Dir *dir) {
+  while (--dir->pending == 0) {
+    int parentFd = dir->parent ? dir->parent->fd : _topFd;
+
+    if (dir->fd >= 0)
+      close(dir->fd);
+
+    if (unlinkat(parentFd, dir->name.constData(), AT_REMOVEDIR) == 0)
+      *_bytesFreed += dir->size;
+    else if (!_canceled)
+      error(dir->path, "rmdir");
+
+    Dir *parent = dir->parent;
+    delete dir;
+
+    if (!parent) {
+      close(_topFd);
+      emit finished(_errors == 0 && !_canceled);
+      return; // This object may be gone from here on
+    }
+
+    dir = parent;
+  }
+}
+
+void KDirDeleter::error(const QByteArray &path, const char *operation) {
+  _errors++;
+  qWarning() << operation << "(" << path << ") failed:" << strerror(errno)
+             << Qt::endl;
+}
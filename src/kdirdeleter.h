@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QByteArray>
+#include <QObject>
+
+#include <atomic>
+
+#include "kfileinfo.h"
+
+class QThreadPool;
+
+namespace KDirStat {
+/**
+ * Removes a local file or a complete directory tree without starting any
+ * external process, using the threads of a thread pool: Each directory is
+ * read by one task that removes the non-directory entries right away
+ * with unlinkat() and starts another task for each subdirectory. A
+ * directory itself is removed as soon as the last task below it is done.
+ *
+ * Everything is opened and removed relative to the fd of its parent
+ * directory (openat(), unlinkat()), never by its full path, so a
+ * directory that is replaced by a symlink during the deletion doesn't
+ * lead anywhere else. The bytes freed are the allocated disk space,
+ * just like @ref KFileInfo::allocatedSize().
+ *
+ * finished() is emitted from one of the pool's threads, so connections
+ * to objects in the GUI thread are queued.
+ *
+ * @short In-process recursive delete
+ **/
+class KDirDeleter : public QObject {
+  Q_OBJECT
+
+public:
+  /**
+   * Constructor. 'path' is the local path to remove. The number of bytes
+   * removed is added to 'bytesFreed' as the deletion goes on.
+   *
+   * Whoever owns 'threadPool' has to wait for it to be done before this
+   * object is deleted.
+   **/
+  KDirDeleter(const QString &path, QThreadPool *threadPool,
+              std::atomic<KFileSize> *bytesFreed, QObject *parent = 0);
+
+  /**
+   * Destructor.
+   **/
+  virtual ~KDirDeleter();
+
+  /**
+   * Start deleting.
+   **/
+  void start();
+
+  /**
+   * Stop deleting as soon as possible. What is removed so far stays
+   * removed, of course.
+   **/
+  void cancel() { _canceled = true; }
+
+  /**
+   * Returns the path this deleter removes.
+   **/
+  QString path() const { return QString::fromLocal8Bit(_path); }
+
+signals:
+  /**
+   * Emitted when the deletion is done. 'success' is 'false' if anything
+   * could not be removed or the deletion was canceled.
+   **/
+  void finished(bool success);
+
+protected:
+  struct Dir;
+  class Task;
+
+  /**
+   * Remove the contents of 'dir' (or start with the top level path if
+   * 'dir' is 0). Called in one of the pool's threads.
+   **/
+  void scan(Dir *dir);
+
+  /**
+   * One task below 'dir' is done. Removes 'dir' and walks up when that
+   * was the last one.
+   **/
+  void dirDone(Dir *dir);
+
+  /**
+   * Report an error for 'path'.
+   **/
+  void error(const QByteArray &path, const char *operation);
+
+  QByteArray _path;
+  QThreadPool *_threadPool;
+  std::atomic<KFileSize> *_bytesFreed;
+  std::atomic<bool> _canceled;
+  std::atomic<int> _errors;
+  int _topFd; // the directory that contains '_path'
+};
+
+} // namespace KDirStat
@@ -7,20 +7,28 @@
 #include "kdirinfo.h"
 #include "kdirtree.h"
 #include <QDebug>
+#include <algorithm>
 
 using namespace KDirStat;
 
+/**
+ * Set 'latest' to 'mtime' if that is later. Safe against other threads
+ * doing the same.
+ **/
+static void raiseMtime(std::atomic<time_t> &latest, time_t mtime) {
+  time_t current = latest;
+
+  while (mtime > current && !latest.compare_exchange_weak(current, mtime)) {
+  }
+}
+
 KDirInfo::KDirInfo(KDirInfo *parent, bool asDotEntry)
     : KFileInfo(parent) {
   init();
 
   if (asDotEntry) {
     _isDotEntry = true;
-    _dotEntry = 0;
     _name = ".";
-  } else {
-    _isDotEntry = false;
-    _dotEntry = new KDirInfo(this, true);
   }
 }
 
@@ -28,13 +36,11 @@ KDirInfo::KDirInfo(const QString &filenameWithoutPath, struct stat *statInfo,
                    KDirInfo *parent)
     : KFileInfo(filenameWithoutPath, statInfo, parent) {
   init();
-  _dotEntry = new KDirInfo(this, true);
 }
 
 KDirInfo::KDirInfo(const KFileItem *fileItem, KDirInfo *parent)
     : KFileInfo(fileItem, parent) {
   init();
-  _dotEntry = new KDirInfo(this, true);
 }
 
 KDirInfo::KDirInfo(KDirInfo *parent,
@@ -42,22 +48,29 @@ KDirInfo::KDirInfo(KDirInfo *parent,
                    KFileSize size, time_t mtime)
     : KFileInfo(parent, filenameWithoutPath, mode, size, mtime) {
   init();
-  _dotEntry = new KDirInfo(this, true);
 }
 
 void KDirInfo::init() {
   _isDotEntry = false;
   _pendingReadJobs = 0;
   _dotEntry = 0;
+  _folded = 0;
   _totalSize = _size;
+  _totalSharedSize = 0;
   _totalItems = 0;
   _totalSubDirs = 0;
   _totalFiles = 0;
   _latestMtime = _mtime;
+  _pendingSize = 0;
+  _pendingSharedSize = 0;
+  _pendingItems = 0;
+  _pendingSubDirs = 0;
+  _pendingFiles = 0;
   _isMountPoint = false;
   _isExcluded = false;
   _summaryDirty = false;
   _beingDestroyed = false;
+  _hasFileChildren = false;
   _readState = KDirQueued;
 }
 
@@ -71,10 +84,13 @@ KDirInfo::~KDirInfo() {
   if (_dotEntry) {
     delete _dotEntry;
   }
+
+  delete _folded;
 }
 
 void KDirInfo::recalcOneChild(KFileInfo * child) {
   _totalSize += child->totalSize();
+  _totalSharedSize += child->sharedSize();
   _totalItems += child->totalItems() + 1;
   _totalSubDirs += child->totalSubDirs();
   _totalFiles += child->totalFiles();
@@ -85,16 +101,26 @@ void KDirInfo::recalcOneChild(KFileInfo * child) {
   if (child->isFile())
     _totalFiles++;
 
-  time_t childLatestMtime = child->latestMtime();
+  raiseMtime(_latestMtime, child->latestMtime());
+
+  if (child->isDirInfo()) {
+    // The complete totals of the child are in now; don't add what it
+    // didn't propagate yet a second time later.
 
-  if (childLatestMtime > _latestMtime)
-    _latestMtime = childLatestMtime;
+    KDirInfo *dir = static_cast<KDirInfo *>(child);
+    dir->_pendingSize = 0;
+    dir->_pendingSharedSize = 0;
+    dir->_pendingItems = 0;
+    dir->_pendingSubDirs = 0;
+    dir->_pendingFiles = 0;
+  }
 }
 
 void KDirInfo::recalc() {
   // qDebug() << Q_FUNC_INFO << this << endl;
 
   _totalSize = _size;
+  _totalSharedSize = 0;
   _totalItems = 0;
   _totalSubDirs = 0;
   _totalFiles = 0;
@@ -104,6 +130,15 @@ void KDirInfo::recalc() {
   }
   if(dotEntry())
     recalcOneChild(dotEntry());
+
+  if (_folded) {
+    _totalSize += _folded->size;
+    _totalSharedSize += _folded->sharedSize;
+    _totalItems += _folded->items;
+    _totalSubDirs += _folded->subDirs;
+    _totalFiles += _folded->files;
+    raiseMtime(_latestMtime, _folded->latestMtime);
+  }
   _summaryDirty = false;
 }
 
@@ -121,21 +156,31 @@ KFileSize KDirInfo::totalSize() {
   return _totalSize;
 }
 
-int KDirInfo::totalItems() {
+KFileSize KDirInfo::sharedSize() {
+  if (_readState == KDirOnRequestOnly)
+      return 0;
+
+  if (_summaryDirty)
+    recalc();
+
+  return _totalSharedSize;
+}
+
+KFileCount KDirInfo::totalItems() {
   if (_summaryDirty)
     recalc();
 
   return _totalItems;
 }
 
-int KDirInfo::totalSubDirs() {
+KFileCount KDirInfo::totalSubDirs() {
   if (_summaryDirty)
     recalc();
 
   return _totalSubDirs;
 }
 
-int KDirInfo::totalFiles() {
+KFileCount KDirInfo::totalFiles() {
   if (_summaryDirty)
     recalc();
 
@@ -173,38 +218,80 @@ bool KDirInfo::isBusy() {
 void KDirInfo::insertChild(KFileInfo *newChild) {
   Q_CHECK_PTR(newChild);
 
-  if (newChild->isDir() || _dotEntry == 0 || _isDotEntry) {
-    /**
-     * Only directories are stored directly in pure directory nodes -
-     * unless something went terribly wrong, e.g. there is no dot entry to use.
-     * If this is a dot entry, store everything it gets directly within it.
-     *
-     * In any of those cases, insert the new child in the children list.
-     *
-     * We don't bother with this list's order - it's explicitly declared to
-     * be unordered, so be warned! We simply insert this new child at the
-     * list head since this operation can be performed in constant time
-     * without the need for any additional lastChild etc. pointers or -
-     * even worse - seeking the correct place for insertion first. This is
-     * none of our business; the corresponding "view" object for this tree
-     * will take care of such niceties.
-     **/
-    children_.push_back(newChild);
-    newChild->setParent(this); // make sure the parent pointer is correct
-
-    childAdded(newChild); // update summaries
-  } else {
+  if (_dotEntry && !newChild->isDir()) {
     /*
-     * If the child is not a directory, don't store it directly here - use
-     * this entry's dot entry instead.
+     * If there is a dot entry, non-directory children are stored there,
+     * not directly here.
      */
     _dotEntry->insertChild(newChild);
+    return;
+  }
+
+  /**
+   * Only directories are stored directly in pure directory nodes - unless
+   * there are no subdirectories (yet): Then there is no dot entry, and
+   * files are stored here, too. If this is a dot entry, store everything
+   * it gets directly within it.
+   *
+   * We don't bother with this list's order - it's explicitly declared to
+   * be unordered, so be warned! We simply append this new child since
+   * this operation can be performed in constant time without seeking the
+   * correct place for insertion first. This is none of our business; the
+   * corresponding "view" object for this tree will take care of such
+   * niceties.
+   **/
+
+  if (!_isDotEntry) {
+    if (newChild->isDir() && _hasFileChildren) {
+      createDotEntry(); // The files now need to be separated
+    } else if (!newChild->isDir() && !_hasFileChildren && numChildren() > 0) {
+      // Only subdirectories so far: The first file starts the dot entry
+      createDotEntry();
+      _dotEntry->insertChild(newChild);
+      return;
+    }
   }
+
+  newChild->setIndexInParent(children_.size());
+  children_.push_back(newChild);
+  newChild->setParent(this); // make sure the parent pointer is correct
+
+  if (!newChild->isDir())
+    _hasFileChildren = true;
+
+  childAdded(newChild); // update summaries
+}
+
+void KDirInfo::createDotEntry() {
+  _dotEntry = new KDirInfo(this, true);
+
+  auto files = std::stable_partition(
+      children_.begin(), children_.end(),
+      [](KFileInfo *child) { return child->isDir(); });
+
+  _dotEntry->children_.assign(files, children_.end());
+  children_.erase(files, children_.end());
+
+  for (size_t i = 0; i < numChildren(); i++)
+    children_[i]->setIndexInParent(i);
+
+  for (size_t i = 0; i < _dotEntry->numChildren(); i++) {
+    _dotEntry->children_[i]->setParent(_dotEntry);
+    _dotEntry->children_[i]->setIndexInParent(i);
+  }
+
+  // This directory's own summary already includes the files
+  _dotEntry->recalc();
+  _hasFileChildren = false;
 }
 
 void KDirInfo::childAdded(KFileInfo *newChild) {
   if (!_summaryDirty) {
-    _totalSize += newChild->totalSize();
+    KFileSize size = newChild->totalSize();
+    KFileSize shared = newChild->sharedSize();
+
+    _totalSize += size;
+    _totalSharedSize += shared;
     _totalItems++;
 
     if (newChild->isDir())
@@ -213,8 +300,20 @@ void KDirInfo::childAdded(KFileInfo *newChild) {
     if (newChild->isFile())
       _totalFiles++;
 
-    if (newChild->mtime() > _latestMtime)
-      _latestMtime = newChild->mtime();
+    raiseMtime(_latestMtime, newChild->mtime());
+
+    if (!_isDotEntry) {
+      _pendingSize += size;
+      _pendingSharedSize += shared;
+
+      if (newChild->isDir())
+        _pendingSubDirs++;
+
+      if (newChild->isFile())
+        _pendingFiles++;
+
+      _pendingItems++;
+    }
   } else {
     // NOP
 
@@ -227,10 +326,126 @@ void KDirInfo::childAdded(KFileInfo *newChild) {
      */
   }
 
-  if (_parent)
+  // The dot entry's children are the directory's own files, so the
+  // directory is kept up to date right away. Anything further up has to
+  // wait for propagateDeltas().
+
+  if (_isDotEntry && _parent)
     _parent->childAdded(newChild);
 }
 
+void KDirInfo::setFolded() {
+  if (!_folded) {
+    _folded = new Folded;
+    _folded->size = 0;
+    _folded->sharedSize = 0;
+    _folded->items = 0;
+    _folded->subDirs = 0;
+    _folded->files = 0;
+    _folded->latestMtime = 0;
+  }
+}
+
+void KDirInfo::addFolded(KFileSize size, KFileSize sharedSize, mode_t mode,
+                         time_t mtime) {
+  Folded folded;
+  folded.size = size;
+  folded.sharedSize = sharedSize;
+  folded.items = 1;
+  folded.subDirs = S_ISDIR(mode);
+  folded.files = S_ISREG(mode);
+  folded.latestMtime = mtime;
+
+  addFolded(folded);
+}
+
+void KDirInfo::addFolded(const Folded &folded) {
+  setFolded();
+
+  _folded->size += folded.size;
+  _folded->sharedSize += folded.sharedSize;
+  _folded->items += folded.items;
+  _folded->subDirs += folded.subDirs;
+  _folded->files += folded.files;
+
+  if (folded.latestMtime > _folded->latestMtime)
+    _folded->latestMtime = folded.latestMtime;
+
+  // Just like childAdded()
+
+  if (!_summaryDirty) {
+    _totalSize += folded.size;
+    _totalSharedSize += folded.sharedSize;
+    _totalSubDirs += folded.subDirs;
+    _totalFiles += folded.files;
+    raiseMtime(_latestMtime, folded.latestMtime);
+    _totalItems += folded.items;
+
+    _pendingSize += folded.size;
+    _pendingSharedSize += folded.sharedSize;
+    _pendingSubDirs += folded.subDirs;
+    _pendingFiles += folded.files;
+    _pendingItems += folded.items;
+  }
+}
+
+void KDirInfo::addFoldedHardLink(KFileSize size) {
+  setFolded();
+
+  _folded->size += size;
+  _folded->sharedSize += size;
+  markAsDirty();
+}
+
+void KDirInfo::markAsDirty() {
+  for (KDirInfo *dir = this; dir; dir = dir->_parent)
+    dir->_summaryDirty = true;
+}
+
+void KDirInfo::propagateDeltas() {
+  KDirInfo *dir = this;
+
+  while (dir->_parent) {
+    // Take the deltas out atomically so another thread propagating the
+    // same directory can't move them a second time. Since _pendingItems
+    // is taken first, a concurrent childAdded() may leave some of the
+    // other deltas behind for now; they will follow with its directory's
+    // own propagateDeltas().
+
+    KFileCount items = dir->_pendingItems.exchange(0);
+
+    if (items == 0)
+      break;
+
+    KFileSize size = dir->_pendingSize.exchange(0);
+    KFileSize shared = dir->_pendingSharedSize.exchange(0);
+    KFileCount subDirs = dir->_pendingSubDirs.exchange(0);
+    KFileCount files = dir->_pendingFiles.exchange(0);
+    KDirInfo *parent = dir->_parent;
+
+    // A dirty parent (and thus all of its ancestors) will recalculate
+    // everything anyway.
+
+    if (parent->_summaryDirty)
+      break;
+
+    parent->_totalSize += size;
+    parent->_totalSharedSize += shared;
+    parent->_totalItems += items;
+    parent->_totalSubDirs += subDirs;
+    parent->_totalFiles += files;
+    raiseMtime(parent->_latestMtime, dir->_latestMtime);
+
+    parent->_pendingSize += size;
+    parent->_pendingSharedSize += shared;
+    parent->_pendingSubDirs += subDirs;
+    parent->_pendingFiles += files;
+    parent->_pendingItems += items;
+
+    dir = parent;
+  }
+}
+
 void KDirInfo::deletingChild(KFileInfo *deletedChild) {
   /**
    * When children are deleted, things go downhill: Marking the summary
@@ -262,13 +477,23 @@ void KDirInfo::deletingChild(KFileInfo *deletedChild) {
                   << " - cannot unlink from children list!" << Qt::endl;
       return;
     }
-    auto it = std::find(children_.begin(), children_.end(), deletedChild);
-    if(it == children_.end()) {
+    size_t index = deletedChild->indexInParent();
+
+    if (index >= children_.size() || children_[index] != deletedChild) {
       qCritical() << "Couldn't unlink " << deletedChild << " from " << this
                   << " children list" << Qt::endl;
     } else {
-      children_.erase(it);
+      // The order of the children doesn't matter: Fill the gap with the
+      // last child rather than moving all the others.
+
+      KFileInfo *last = children_.back();
+      children_[index] = last;
+      last->setIndexInParent(index);
+      children_.pop_back();
     }
+
+    if (children_.empty())
+      _hasFileChildren = false;
   }
 }
 
@@ -280,6 +505,9 @@ void KDirInfo::readJobAdded() {
 }
 
 void KDirInfo::readJobFinished() {
+  // A job that was aborted might never get to finalizeLocal()
+  propagateDeltas();
+
   _pendingReadJobs--;
 
   if (_parent)
@@ -293,7 +521,10 @@ void KDirInfo::readJobAborted() {
     _parent->readJobAborted();
 }
 
-void KDirInfo::finalizeLocal() { cleanupDotEntries(); }
+void KDirInfo::finalizeLocal() {
+  cleanupDotEntries();
+  propagateDeltas();
+}
 
 void KDirInfo::finalizeAll(KDirTree* tree) {
   if (_isDotEntry)
@@ -307,14 +538,13 @@ void KDirInfo::finalizeAll(KDirTree* tree) {
     }
   }
 
-  // Optimization: As long as this directory is not finalized yet, it does
-  // (very likely) have a dot entry and thus all direct children are
-  // subdirectories, not plain files, so we don't need to bother checking
+  // Optimization: If this directory has both files and subdirectories,
+  // the files are in the dot entry, so we don't need to bother checking
   // plain file children as well - so do finalizeLocal() only after all
-  // children are processed. If this step were the first, for directories
-  // that don't have any subdirectories finalizeLocal() would immediately
-  // get all their plain file children reparented to themselves, so they
-  // would need to be processed in the loop, too.
+  // children are processed. If this step were the first, a dot entry
+  // without subdirectory siblings would get its plain file children
+  // reparented to this directory, so they would need to be processed in
+  // the loop, too.
 
   tree->sendFinalizeLocal(this); // Must be sent _before_ finalizeLocal()!
   finalizeLocal();
@@ -341,6 +571,7 @@ void KDirInfo::cleanupDotEntries() {
     _dotEntry->children_.clear();
     for(size_t i = 0; i < numChildren(); i++)
       children_[i]->setParent(this);
+    _hasFileChildren = numChildren() > 0;
   }
 
   // Delete dot entries without any children
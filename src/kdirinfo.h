@@ -5,6 +5,7 @@
  */
 
 #include "kfileinfo.h"
+#include <atomic>
 #include <kfileitem.h>
 
 #ifndef NOT_USED
@@ -25,6 +26,25 @@ class KDirTree;
  * respective methods to integrate seamlessly with the abstraction of a
  * file / directory tree; this class fills those stubs with life.
  *
+ * The summary fields may be updated from several threads at once: Each
+ * directory is filled by one single thread, but what it adds is
+ * propagated to the ancestors with atomic operations (see @ref
+ * propagateDeltas()). What a reader in another thread (i.e. the GUI
+ * thread) may observe while reading is in progress:
+ *
+ * - Each single summary field, the read state and the dirty flag hold a
+ *   value that was correct at some point; none of them is ever torn.
+ * - Different fields need not match each other, e.g. totalItems() may
+ *   already include a file whose size is not in totalSize() yet.
+ * - An ancestor lags behind its descendants by whatever was not
+ *   propagated yet, but never counts anything twice.
+ * - Once all read jobs are done, everything adds up exactly.
+ *
+ * The list of children is not protected: Only the thread filling a
+ * directory touches it while it is read. Deleting children and
+ * recalculating the summary are only done in the GUI thread and not in
+ * subtrees that are still being read.
+ *
  * @short directory item within a @ref KDirTree.
  **/
 class KDirInfo : public KFileInfo {
@@ -69,12 +89,20 @@ public:
    **/
   KFileSize totalSize() override;
 
+  /**
+   * Returns the part of the total size that is in files with more than
+   * one hard link.
+   *
+   * Reimplemented - inherited from @ref KFileInfo.
+   **/
+  KFileSize sharedSize() override;
+
   /**
    * Returns the total number of children in this subtree, excluding this item.
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  int totalItems() override;
+  KFileCount totalItems() override;
 
   /**
    * Returns the total number of subdirectories in this subtree,
@@ -82,7 +110,7 @@ public:
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  int totalSubDirs() override;
+  KFileCount totalSubDirs() override;
 
   /**
    * Returns the total number of plain file children in this subtree,
@@ -90,7 +118,7 @@ public:
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  int totalFiles() override;
+  KFileCount totalFiles() override;
 
   /**
    * Returns the latest modification time of this subtree.
@@ -167,6 +195,11 @@ public:
    * non-directory children separately from directories. This way the end
    * user can easily tell which summary fields belong to the directory
    * itself and which are the accumulated values of the entire subtree.
+   *
+   * The dot entry is only created when a directory gets both files and
+   * subdirectories: As long as there are only files, they are stored
+   * directly in the directory (which is where they would end up after
+   * @ref finalizeLocal() anyway).
    **/
   KDirInfo *dotEntry() const override { return _dotEntry; }
 
@@ -184,12 +217,85 @@ public:
   bool isDotEntry() const override { return _isDotEntry; }
 
   /**
-   * Notification that a child has been added somewhere in the subtree.
+   * Notification that a child has been added to this directory.
+   *
+   * This only updates the summary fields of this directory (and of the
+   * real directory if this is a dot entry). The ancestors learn about
+   * the new child with @ref propagateDeltas(), i.e. when this directory
+   * is finalized: Walking up to the root for each single file would be
+   * much too expensive in deep trees.
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
   void childAdded(KFileInfo *newChild) override;
 
+  /**
+   * Add everything that was added to this subtree since the last call to
+   * the summary fields of all ancestors.
+   *
+   * This is done automatically when this directory is finalized or its
+   * read job is done.
+   **/
+  void propagateDeltas();
+
+  /**
+   * Summary of the contents of a folded directory
+   **/
+  struct Folded {
+    KFileSize size;
+    KFileSize sharedSize;
+    KFileCount items;
+    KFileCount subDirs;
+    KFileCount files;
+    time_t latestMtime;
+  };
+
+  /**
+   * Mark this directory as one whose contents are not kept in the tree:
+   * Everything below it is only added to its summary fields with @ref
+   * addFolded().
+   **/
+  void setFolded();
+
+  /**
+   * Returns 'true' if this directory's contents are not kept in the tree,
+   * only their summary. See @ref setFolded().
+   **/
+  bool isFolded() const { return _folded != nullptr; }
+
+  /**
+   * Add an item somewhere below this (folded) directory to the summary
+   * fields without adding it to the tree. 'size' and 'sharedSize' are
+   * what @ref totalSize() and @ref sharedSize() would return for it.
+   **/
+  void addFolded(KFileSize size, KFileSize sharedSize, mode_t mode,
+                 time_t mtime);
+
+  /**
+   * Add the summary of several items below this (folded) directory at
+   * once, e.g. the one stored in a cache file.
+   **/
+  void addFolded(const Folded &folded);
+
+  /**
+   * Returns the summary of the contents of this directory if it is
+   * folded, 0 if not.
+   **/
+  const Folded *folded() const { return _folded; }
+
+  /**
+   * A hard link somewhere below this folded directory that was not
+   * counted so far is counted now, since the one that was is gone: Add
+   * the 'size' of its inode to the summary fields.
+   **/
+  void addFoldedHardLink(KFileSize size);
+
+  /**
+   * Mark the summary fields of this directory and all of its ancestors as
+   * outdated, so they are recalculated when they are needed next time.
+   **/
+  void markAsDirty();
+
   /**
    * Notification that a child is about to be deleted somewhere in the
    * subtree.
@@ -277,6 +383,11 @@ protected:
    **/
   void cleanupDotEntries();
 
+  /**
+   * Create the dot entry and move all non-directory children there.
+   **/
+  void createDotEntry();
+
   //
   // Data members
   //
@@ -284,20 +395,36 @@ protected:
   bool _isDotEntry : 1;   // Flag: is this entry a "dot entry"?
   bool _isMountPoint : 1; // Flag: is this a mount point?
   bool _isExcluded : 1;   // Flag: was this directory excluded?
-  int _pendingReadJobs;   // number of open directories in this subtree
+  std::atomic<int> _pendingReadJobs; // number of open directories in this subtree
   KDirInfo *_dotEntry;   // pseudo entry to hold non-dir children
+  Folded *_folded;       // only for folded directories
 
   // Some cached values
 
-  KFileSize _totalSize;
-  int _totalItems;
-  int _totalSubDirs;
-  int _totalFiles;
-  time_t _latestMtime;
-
-  bool _summaryDirty : 1; // dirty flag for the cached values
-  bool _beingDestroyed : 1;
-  KDirReadState _readState;
+  std::atomic<KFileSize> _totalSize;
+  std::atomic<KFileSize> _totalSharedSize;
+  std::atomic<KFileCount> _totalItems;
+  std::atomic<KFileCount> _totalSubDirs;
+  std::atomic<KFileCount> _totalFiles;
+  std::atomic<time_t> _latestMtime;
+
+  // What was added since the last propagateDeltas(), i.e. what the
+  // ancestors don't know yet. Whoever adds to these increments
+  // _pendingItems last, and propagateDeltas() takes it first.
+
+  std::atomic<KFileSize> _pendingSize;
+  std::atomic<KFileSize> _pendingSharedSize;
+  std::atomic<KFileCount> _pendingItems;
+  std::atomic<KFileCount> _pendingSubDirs;
+  std::atomic<KFileCount> _pendingFiles;
+
+  // Not bitfields: Other threads read these while the filling thread
+  // writes the flags next to them.
+
+  std::atomic<bool> _summaryDirty; // dirty flag for the cached values
+  bool _beingDestroyed;
+  bool _hasFileChildren; // non-directory children without a dot entry?
+  std::atomic<KDirReadState> _readState;
 
 private:
   void recalcOneChild(KFileInfo*);
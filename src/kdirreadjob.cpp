@@ -4,7 +4,10 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -13,11 +16,25 @@
 #include <sys/errno.h>
 
 #include "k4dirstat.h"
+#include "kbulkstat.h"
 #include "kdirreadjob.h"
 #include "kdirtree.h"
 #include "kdirtreecache.h"
 #include "kexcluderules.h"
 #include <QDir>
+#include <algorithm>
+
+// See ioprio_set(2); glibc has no wrapper for it.
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+#define MAX_READ_CREDIT 1000 // millisec of reading saved up while idle
+
+// Compare everything that is looked up in the bulk loaded metadata with
+// what lstat() says about it. Only for debugging; this is slower than
+// lstat() alone.
+#define VERIFY_BULKSTAT 0
 
 using namespace KDirStat;
 
@@ -70,32 +87,89 @@ void KDirReadJob::deletingChild(KFileInfo *deletedChild) {
 KLocalDirReadJob::KLocalDirReadJob(KDirTree *tree, KDirInfo *dir)
     : KDirReadJob(tree, dir), _diskDir(0) {}
 
+KLocalDirReadJob::KLocalDirReadJob(KDirTree *tree, KDirInfo *dir,
+                                   const QString &path)
+    : KDirReadJob(tree, dir), _diskDir(0), _foldedPath(path) {}
+
+/**
+ * lstat() 'entry' of the directory 'dirFd' or look it up in 'bulkStat'
+ * if possible. Returns 'true' on success.
+ **/
+static bool statEntry(int dirFd, struct dirent *entry,
+                      const KBulkStat *bulkStat, struct stat *statInfo) {
+  // Directories always need lstat() to notice mount points
+  if (bulkStat && entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN &&
+      bulkStat->stat(entry->d_ino, statInfo)) {
+#if VERIFY_BULKSTAT
+    struct stat lstatInfo;
+
+    if (fstatat(dirFd, entry->d_name, &lstatInfo, AT_SYMLINK_NOFOLLOW) == 0 &&
+        (lstatInfo.st_mode != statInfo->st_mode ||
+         lstatInfo.st_nlink != statInfo->st_nlink ||
+         lstatInfo.st_size != statInfo->st_size ||
+         lstatInfo.st_blocks != statInfo->st_blocks ||
+         lstatInfo.st_mtime != statInfo->st_mtime))
+      qWarning() << "Bulk stat differs from lstat() for" << entry->d_name
+                 << "- mode" << statInfo->st_mode << lstatInfo.st_mode
+                 << "links" << statInfo->st_nlink << lstatInfo.st_nlink
+                 << "size" << statInfo->st_size << lstatInfo.st_size
+                 << "blocks" << statInfo->st_blocks << lstatInfo.st_blocks
+                 << "mtime" << statInfo->st_mtime << lstatInfo.st_mtime
+                 << Qt::endl;
+#endif
+
+    return true;
+  }
+
+  return fstatat(dirFd, entry->d_name, statInfo, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
 KLocalDirReadJob::~KLocalDirReadJob() {}
 
 void KLocalDirReadJob::startReading() {
   struct dirent *entry;
   struct stat statInfo;
+  if (!_foldedPath.isEmpty() ||
+      (_tree->maxTreeDepth() > 0 &&
+       _dir->treeLevel() >= _tree->maxTreeDepth())) {
+    readFolded();
+    return;
+  }
+
   QString dirName = _dir->url();
+  KExcludeRules *excludeRules = KExcludeRules::excludeRules();
 
   if ((_diskDir = opendir(dirName.toLocal8Bit()))) {
     _tree->sendProgressInfo(dirName);
     _dir->setReadState(KDirReading);
+    excludeRules->updateState(&_excludeState, dirName);
+
+    // lstat() relative to the directory: No need to build a complete
+    // path for each entry
+    int dirFd = dirfd(_diskDir);
+    int itemCount = 0;
+
+    // Inode numbers only mean something on the device they were loaded for
+    const KBulkStat *bulkStat = _tree->bulkStat();
+
+    if (bulkStat && bulkStat->device() != _dir->device())
+      bulkStat = 0;
 
     while ((entry = readdir(_diskDir))) {
       QString entryName = entry->d_name;
 
       if (entryName != "." && entryName != "..") {
-        QString fullName = dirName + "/" + entryName;
-        QByteArray rawFullName = dirName.toLocal8Bit() +
-                                 QDir::separator().toLatin1() +
-                                 QByteArray(entry->d_name);
-        if (lstat(rawFullName.data(), &statInfo) == 0) // lstat() OK
+        itemCount++;
+
+        if (statEntry(dirFd, entry, bulkStat, &statInfo)) // lstat() OK
         {
           if (S_ISDIR(statInfo.st_mode)) // directory child?
           {
             KDirInfo *subDir = new KDirInfo(entryName, &statInfo, _dir);
+            KExcludeMatchState subDirState;
 
-            if (KExcludeRules::excludeRules()->match(fullName)) {
+            if (excludeRules->matchEntry(_excludeState, dirName, entryName,
+                                         &subDirState)) {
               subDir->setExcluded();
               subDir->setReadState(KDirOnRequestOnly);
               _tree->sendFinalizeLocal(subDir);
@@ -104,14 +178,18 @@ void KLocalDirReadJob::startReading() {
             {
               if (_dir->device() == subDir->device()) // normal case
               {
-                _tree->addJob(new KLocalDirReadJob(_tree, subDir));
+                KDirReadJob *job = new KLocalDirReadJob(_tree, subDir);
+                job->setExcludeState(subDirState);
+                _tree->addJob(job);
               } else // The subdirectory we just found is a mount point.
               {
                 // qDebug() << "Found mount point " << subDir << endl;
                 subDir->setMountPoint();
 
                 if (_tree->crossFileSystems()) {
-                  _tree->addJob(new KLocalDirReadJob(_tree, subDir));
+                  KDirReadJob *job = new KLocalDirReadJob(_tree, subDir);
+                  job->setExcludeState(subDirState);
+                  _tree->addJob(job);
                 } else {
                   subDir->setReadState(KDirOnRequestOnly);
                   _tree->sendFinalizeLocal(subDir);
@@ -130,6 +208,7 @@ void KLocalDirReadJob::startReading() {
               // Read content of this subdirectory from cache file
               //
 
+              QString fullName = dirName + "/" + entryName;
               KCacheReadJob *cacheReadJob =
                   new KCacheReadJob(_tree, _dir->parent(), fullName);
               Q_CHECK_PTR(cacheReadJob);
@@ -168,14 +247,15 @@ void KLocalDirReadJob::startReading() {
               }
             } else {
               KFileInfo *child = new KFileInfo(entryName, &statInfo, _dir);
+              _tree->addHardLink(child, statInfo.st_ino);
               _dir->insertChild(child);
               childAdded(child);
             }
           }
         } else // lstat() error
         {
-          qWarning() << "lstat(" << fullName << ") failed: " << strerror(errno)
-                     << Qt::endl;
+          qWarning() << "lstat(" << dirName + "/" + entryName
+                     << ") failed: " << strerror(errno) << Qt::endl;
 
           /*
            * Not much we can do when lstat() didn't work; let's at
@@ -190,6 +270,7 @@ void KLocalDirReadJob::startReading() {
     }
 
     closedir(_diskDir);
+    _queue->itemsRead(itemCount);
     // qDebug() << "Finished reading " << _dir << endl;
     _dir->setReadState(KDirFinished);
     _dir->finalizeLocal();
@@ -206,7 +287,109 @@ void KLocalDirReadJob::startReading() {
   // Don't add anything after finished() since this deletes this job!
 }
 
-KFileInfo *KLocalDirReadJob::stat(const QUrl &url, KDirInfo *parent) {
+void KLocalDirReadJob::readFolded() {
+  bool ownDir = _foldedPath.isEmpty();
+  QString dirName = ownDir ? _dir->url() : _foldedPath;
+  KExcludeRules *excludeRules = KExcludeRules::excludeRules();
+
+  _dir->setFolded();
+
+  if (!(_diskDir = opendir(dirName.toLocal8Bit()))) {
+    if (ownDir) {
+      _dir->setReadState(KDirError);
+      _dir->finalizeLocal();
+      _tree->sendFinalizeLocal(_dir);
+    }
+
+    finished();
+    return;
+  }
+
+  if (ownDir) {
+    _tree->sendProgressInfo(dirName);
+    _dir->setReadState(KDirReading);
+  }
+
+  excludeRules->updateState(&_excludeState, dirName);
+
+  const KBulkStat *bulkStat = _tree->bulkStat();
+
+  if (bulkStat && bulkStat->device() != _dir->device())
+    bulkStat = 0;
+
+  QString prefix = dirName.endsWith('/') ? dirName : dirName + "/";
+  int dirFd = dirfd(_diskDir);
+  int itemCount = 0;
+  struct dirent *entry;
+  struct stat statInfo;
+
+  while ((entry = readdir(_diskDir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    itemCount++;
+
+    if (!statEntry(dirFd, entry, bulkStat, &statInfo))
+      continue; // Not even a placeholder here
+
+    if (S_ISDIR(statInfo.st_mode)) {
+      _dir->addFolded(statInfo.st_size, 0, statInfo.st_mode,
+                      statInfo.st_mtime);
+
+      QString entryName = QString::fromLocal8Bit(entry->d_name);
+      KExcludeMatchState subDirState;
+
+      if (excludeRules->matchEntry(_excludeState, dirName, entryName,
+                                   &subDirState))
+        continue;
+
+      if (statInfo.st_dev != _dir->device() && !_tree->crossFileSystems())
+        continue;
+
+      KDirReadJob *job =
+          new KLocalDirReadJob(_tree, _dir, prefix + entryName);
+      job->setExcludeState(subDirState);
+      _tree->addJob(job);
+    } else {
+      // Just like KFileInfo would count it
+
+      bool special = S_ISBLK(statInfo.st_mode) || S_ISCHR(statInfo.st_mode) ||
+                     S_ISFIFO(statInfo.st_mode) || S_ISSOCK(statInfo.st_mode);
+      KFileSize size = special ? 0 : statInfo.st_blocks * 512;
+      KFileSize sharedSize = 0;
+
+      if (statInfo.st_nlink > 1) {
+        if (!_tree->addFoldedHardLink(_dir, statInfo.st_dev, statInfo.st_ino,
+                                      size))
+          size = 0;
+
+        sharedSize = size;
+      }
+
+      _dir->addFolded(size, sharedSize, statInfo.st_mode, statInfo.st_mtime);
+
+      if (_tree->isLargeFoldedFile(size))
+        _tree->addFoldedFile(prefix + QString::fromLocal8Bit(entry->d_name),
+                             size);
+    }
+  }
+
+  closedir(_diskDir);
+  _diskDir = 0;
+  _queue->itemsRead(itemCount);
+
+  if (ownDir) {
+    _dir->setReadState(KDirFinished);
+    _dir->finalizeLocal();
+    _tree->sendFinalizeLocal(_dir);
+  }
+
+  finished();
+  // Don't add anything after finished() since this deletes this job!
+}
+
+KFileInfo *KLocalDirReadJob::stat(const QUrl &url, KDirInfo *parent,
+                                  KDirTree *tree) {
   struct stat statInfo;
 
   if (lstat(url.path().toLocal8Bit(), &statInfo) == 0) // lstat() OK
@@ -222,7 +405,14 @@ KFileInfo *KLocalDirReadJob::stat(const QUrl &url, KDirInfo *parent) {
 
       return dir;
     } else // no directory
-      return new KFileInfo(name, &statInfo, parent);
+    {
+      KFileInfo *file = new KFileInfo(name, &statInfo, parent);
+
+      if (tree)
+        tree->addHardLink(file, statInfo.st_ino);
+
+      return file;
+    }
   } else // lstat() failed
     return 0;
 }
@@ -259,11 +449,18 @@ void KioDirReadJob::startReading() {
 void KioDirReadJob::entries(KIO::Job *job, const KIO::UDSEntryList &entryList) {
   NOT_USED(job);
   QUrl url(_dir->url()); // Cache this - it's expensive!
+  KExcludeRules *excludeRules = KExcludeRules::excludeRules();
 
   if (!url.isValid()) {
     qWarning() << Q_FUNC_INFO << "URL malformed: " << _dir->url() << Qt::endl;
   }
 
+  QString dirPath = url.path();
+  excludeRules->updateState(&_excludeState, dirPath);
+
+  if (_queue)
+    _queue->itemsRead(entryList.size());
+
   KIO::UDSEntryList::ConstIterator it = entryList.begin();
 
   while (it != entryList.end()) {
@@ -281,14 +478,19 @@ void KioDirReadJob::entries(KIO::Job *job, const KIO::UDSEntryList &entryList) {
         _dir->insertChild(subDir);
         childAdded(subDir);
 
-        if (KExcludeRules::excludeRules()->match(url.path())) {
+        KExcludeMatchState subDirState;
+
+        if (excludeRules->matchEntry(_excludeState, dirPath, entry.name(),
+                                     &subDirState)) {
           subDir->setExcluded();
           subDir->setReadState(KDirOnRequestOnly);
           _tree->sendFinalizeLocal(subDir);
           subDir->finalizeLocal();
         } else // No exclude rule matched
         {
-          _tree->addJob(new KioDirReadJob(_tree, subDir));
+          KDirReadJob *subDirJob = new KioDirReadJob(_tree, subDir);
+          subDirJob->setExcludeState(subDirState);
+          _tree->addJob(subDirJob);
         }
       } else // non-directory child
       {
@@ -398,7 +600,10 @@ void KCacheReadJob::read() {
   }
 }
 
-KDirReadJobQueue::KDirReadJobQueue() : QObject() {
+KDirReadJobQueue::KDirReadJobQueue()
+    : QObject(), _largestFirst(false), _serial(0), _maxItemsPerSecond(0),
+      _idleIoPriority(false), _savedIoPriority(-1), _itemsRead(0),
+      _rateItems(0), _itemsPerSecond(0) {
 
   connect(&_timer, SIGNAL(timeout()), this, SLOT(timeSlicedRead()));
 }
@@ -407,18 +612,143 @@ KDirReadJobQueue::~KDirReadJobQueue() { clear(); }
 
 void KDirReadJobQueue::enqueue(KDirReadJob *job) {
   if (job) {
-    _queue.append(job);
+    if (_largestFirst && job->dir())
+      addWaiting(job);
+    else
+      _queue.append(job);
+
     job->setQueue(this);
 
     if (!_timer.isActive()) {
       // qDebug() << "First job queued" << endl;
+      beginReading();
       emit startingReading();
       _timer.start(0);
     }
   }
 }
 
+void KDirReadJobQueue::beginReading() {
+  _itemsRead = 0;
+  _rateItems = 0;
+  _itemsPerSecond = 0;
+  _readTimer.start();
+  _rateTimer.start();
+
+#ifdef SYS_ioprio_set
+  if (_idleIoPriority && _savedIoPriority < 0) {
+    int oldPriority = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+    if (oldPriority >= 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0)
+      _savedIoPriority = oldPriority;
+    else
+      qWarning() << "Can't switch to idle I/O priority:" << strerror(errno)
+                 << Qt::endl;
+  }
+#endif
+}
+
+void KDirReadJobQueue::endReading() {
+  _timer.stop();
+  _itemsPerSecond = 0;
+
+#ifdef SYS_ioprio_set
+  if (_savedIoPriority >= 0) {
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, _savedIoPriority);
+    _savedIoPriority = -1;
+  }
+#endif
+}
+
+void KDirReadJobQueue::itemsRead(int count) {
+  _itemsRead += count;
+  _rateItems += count;
+
+  qint64 elapsed = _rateTimer.elapsed();
+
+  if (elapsed >= 1000) {
+    _itemsPerSecond = _rateItems * 1000 / elapsed;
+    _rateItems = 0;
+    _rateTimer.restart();
+  }
+}
+
+bool KDirReadJobQueue::WaitingJob::operator<(const WaitingJob &other) const {
+  // std::push_heap() etc. put the largest one on top
+
+  if (size != other.size)
+    return size < other.size;
+
+  if (links != other.links)
+    return links < other.links;
+
+  return serial > other.serial;
+}
+
+void KDirReadJobQueue::setLargestFirst(bool largestFirst) {
+  if (largestFirst == _largestFirst)
+    return;
+
+  _largestFirst = largestFirst;
+
+  // Sort the waiting jobs the new way. The current job (if any) stays in
+  // front of the queue.
+
+  QList<KDirReadJob *> jobs;
+
+  if (_largestFirst) {
+    jobs = _queue.mid(1);
+    _queue = _queue.mid(0, 1);
+  } else {
+    std::sort_heap(_waiting.begin(), _waiting.end()); // largest last
+
+    for (auto it = _waiting.rbegin(); it != _waiting.rend(); ++it)
+      jobs.append(it->job);
+
+    _waiting.clear();
+  }
+
+  foreach (KDirReadJob *job, jobs) {
+    if (_largestFirst && job->dir())
+      addWaiting(job);
+    else
+      _queue.append(job);
+  }
+}
+
+void KDirReadJobQueue::addWaiting(KDirReadJob *job) {
+  WaitingJob waiting;
+  waiting.job = job;
+  waiting.size = job->dir()->byteSize();
+  waiting.links = job->dir()->links();
+  waiting.serial = _serial++;
+
+  _waiting.push_back(waiting);
+  std::push_heap(_waiting.begin(), _waiting.end());
+}
+
+void KDirReadJobQueue::takeWaiting() {
+  if (_waiting.empty())
+    return;
+
+  std::pop_heap(_waiting.begin(), _waiting.end());
+  _queue.append(_waiting.back().job);
+  _waiting.pop_back();
+}
+
+KDirReadJob *KDirReadJobQueue::head() {
+  if (_queue.isEmpty())
+    takeWaiting();
+
+  return _queue.first();
+}
+
 KDirReadJob *KDirReadJobQueue::dequeue() {
+  if (_queue.isEmpty())
+    takeWaiting();
+
   KDirReadJob *job = _queue.first();
   _queue.removeFirst();
 
@@ -435,18 +765,25 @@ void KDirReadJobQueue::clear() {
     delete job;
     i.remove();
   }
+
+  for (size_t j = 0; j < _waiting.size(); j++)
+    delete _waiting[j].job;
+
+  _waiting.clear();
+  endReading();
 }
 
 void KDirReadJobQueue::abort() {
-  while (!_queue.isEmpty()) {
-    KDirReadJob *job = _queue.first();
+  while (!isEmpty()) {
+    KDirReadJob *job = dequeue();
 
     if (job->dir())
       job->dir()->readJobAborted();
 
-    _queue.removeFirst();
     delete job;
   }
+
+  endReading();
 }
 
 void KDirReadJobQueue::killAll(KDirInfo *subtree) {
@@ -462,11 +799,49 @@ void KDirReadJobQueue::killAll(KDirInfo *subtree) {
     } else {
     }
   }
+
+  auto killed = std::partition(
+      _waiting.begin(), _waiting.end(), [subtree](const WaitingJob &waiting) {
+        return !waiting.job->dir()->isInSubtree(subtree);
+      });
+
+  if (killed != _waiting.end()) {
+    for (auto it = killed; it != _waiting.end(); ++it)
+      delete it->job;
+
+    _waiting.erase(killed, _waiting.end());
+    std::make_heap(_waiting.begin(), _waiting.end());
+  }
 }
 
 void KDirReadJobQueue::timeSlicedRead() {
+  if (_maxItemsPerSecond > 0) {
+    // Wait until reading what was read so far is due at the maximum rate.
+
+    qint64 elapsed = _readTimer.elapsed();
+    qint64 due = _itemsRead * 1000 / _maxItemsPerSecond;
+
+    if (due > elapsed) {
+      _timer.start(qMin(due - elapsed, (qint64)1000));
+      return;
+    }
+
+    // Don't let a long pause (e.g. a slow directory) add up to a burst.
+
+    if (elapsed - due > MAX_READ_CREDIT)
+      _itemsRead = (elapsed - MAX_READ_CREDIT) * _maxItemsPerSecond / 1000;
+
+    if (_timer.interval() != 0)
+      _timer.start(0);
+  }
+
+  if (_queue.isEmpty())
+    takeWaiting();
+
   if (!_queue.isEmpty())
     _queue.first()->read();
+  else
+    endReading(); // Nothing left to read, e.g. after killAll()
 }
 
 void KDirReadJobQueue::jobFinishedNotify(KDirReadJob *job) {
@@ -477,9 +852,9 @@ void KDirReadJobQueue::jobFinishedNotify(KDirReadJob *job) {
 
   // Look for a new job.
 
-  if (_queue.isEmpty()) // No new job available - we're done.
+  if (isEmpty()) // No new job available - we're done.
   {
-    _timer.stop();
+    endReading();
     // qDebug() << "No more jobs - finishing" << endl;
     emit finished();
   }
@@ -6,10 +6,16 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include <QElapsedTimer>
 #include <dirent.h>
 #include <kio/jobclasses.h>
 #include <qlist.h>
 #include <qtimer.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "kexcluderules.h"
 
 #ifndef NOT_USED
 #define NOT_USED(PARAM) ((void)(PARAM))
@@ -94,6 +100,15 @@ public:
    **/
   void setQueue(KDirReadJobQueue *queue) { _queue = queue; }
 
+  /**
+   * Set the exclude rule match state of this job's directory. The job
+   * that found the directory knows it already; otherwise it is
+   * calculated from the directory's path.
+   **/
+  void setExcludeState(const KExcludeMatchState &state) {
+    _excludeState = state;
+  }
+
 protected:
   /**
    * Initialize reading.
@@ -133,6 +148,7 @@ protected:
   KDirInfo *_dir;
   KDirReadJobQueue *_queue;
   bool _started;
+  KExcludeMatchState _excludeState;
 
 }; // class KDirReadJob
 
@@ -175,6 +191,13 @@ public:
    **/
   KLocalDirReadJob(KDirTree *tree, KDirInfo *dir);
 
+  /**
+   * Constructor for reading 'path' somewhere below the folded directory
+   * 'dir': Its contents are only added to the summary of 'dir' (see @ref
+   * KDirInfo::addFolded()).
+   **/
+  KLocalDirReadJob(KDirTree *tree, KDirInfo *dir, const QString &path);
+
   /**
    * Destructor.
    **/
@@ -186,8 +209,12 @@ public:
    * information. Use @ref KFileInfo::isDirInfo() to find out which.
    * Returns 0 if such information cannot be obtained (i.e. the
    * appropriate stat() call fails).
+   *
+   * If 'tree' is specified, a file with more than one hard link is added
+   * to its hard link table (see @ref KDirTree::addHardLink()).
    **/
-  static KFileInfo *stat(const QUrl &url, KDirInfo *parent = nullptr);
+  static KFileInfo *stat(const QUrl &url, KDirInfo *parent = nullptr,
+                         KDirTree *tree = nullptr);
 
 protected:
   /**
@@ -197,7 +224,15 @@ protected:
    **/
   void startReading() override;
 
+  /**
+   * Read a directory below the maximum tree depth (see @ref
+   * KDirTree::maxTreeDepth()): The directory itself if it is at that
+   * depth, or '_foldedPath' below it.
+   **/
+  void readFolded();
+
   DIR *_diskDir;
+  QString _foldedPath;
 
 }; // KLocalDirReadJob
 
@@ -322,6 +357,13 @@ protected:
  * Queue for read jobs
  *
  * Handles time-sliced reading automatically.
+ *
+ * Reading can be slowed down so a scan doesn't get in the way of other
+ * programs' disk I/O: The number of directory entries read per second can
+ * be limited (see @ref setMaxItemsPerSecond()), and the I/O can be done
+ * in the "idle" I/O scheduling class (see @ref setIdleIoPriority()).
+ * Directories are read one at a time anyway, so there is never more than
+ * one directory being read on any device.
  **/
 class KDirReadJobQueue : public QObject {
   Q_OBJECT
@@ -340,9 +382,60 @@ public:
   /**
    * Add a job to the end of the queue. Begin time-sliced reading if not
    * in progress yet.
+   *
+   * In "largest first" mode, the job is sorted in according to the size
+   * of its directory instead (see @ref setLargestFirst()).
    **/
   void enqueue(KDirReadJob *job);
 
+  /**
+   * Set "largest first" mode: Instead of reading the directories in the
+   * order they are found, read those that promise the largest subtrees
+   * first, so the big ones show up early in a long scan.
+   *
+   * Nobody knows how large a subtree is before it is read, so this goes
+   * by what lstat() already said about the directory itself: Its size
+   * (which grows with the number of entries on most file systems), then
+   * its number of links (which counts its subdirectories on most file
+   * systems). Directories that are equal in both are read in the order
+   * they were found.
+   **/
+  void setLargestFirst(bool largestFirst);
+
+  /**
+   * Returns 'true' if the queue is in "largest first" mode.
+   **/
+  bool largestFirst() const { return _largestFirst; }
+
+  /**
+   * Read at most 'maxItemsPerSecond' directory entries per second on
+   * average; 0 means no limit. A directory is always read completely in
+   * one go, so the limit is kept by waiting before the next one.
+   **/
+  void setMaxItemsPerSecond(int maxItemsPerSecond) {
+    _maxItemsPerSecond = maxItemsPerSecond;
+  }
+
+  /**
+   * Do the I/O for reading in the "idle" I/O scheduling class, i.e. only
+   * when no other program needs the disk. This takes effect the next time
+   * reading starts. It only makes a difference with I/O schedulers that
+   * support I/O priorities (like BFQ).
+   **/
+  void setIdleIoPriority(bool idle) { _idleIoPriority = idle; }
+
+  /**
+   * Notification that a job read 'count' directory entries.
+   * Read jobs should call this so the rate limit can be kept.
+   **/
+  void itemsRead(int count);
+
+  /**
+   * Returns the number of directory entries read per second recently or
+   * 0 if nothing is being read.
+   **/
+  int itemsPerSecond() const { return _itemsPerSecond; }
+
   /**
    * Remove the head of the queue and return it.
    **/
@@ -351,17 +444,17 @@ public:
   /**
    * Get the head of the queue (the next job that is due for processing).
    **/
-  KDirReadJob *head() const { return _queue.first(); }
+  KDirReadJob *head();
 
   /**
    * Count the number of pending jobs in the queue.
    **/
-  int count() const { return _queue.count(); }
+  int count() const { return _queue.count() + (int)_waiting.size(); }
 
   /**
    * Check if the queue is empty.
    **/
-  bool isEmpty() const { return _queue.isEmpty(); }
+  bool isEmpty() const { return _queue.isEmpty() && _waiting.empty(); }
 
   /**
    * Clear the queue: Remove all pending jobs from the queue and destroy them.
@@ -413,8 +506,55 @@ protected slots:
   void timeSlicedRead();
 
 protected:
+  /**
+   * A job waiting in "largest first" mode.
+   **/
+  struct WaitingJob {
+    KDirReadJob *job;
+    off_t size;     // of the directory
+    nlink_t links;  // of the directory
+    quint64 serial; // order of enqueue()
+
+    bool operator<(const WaitingJob &other) const;
+  };
+
+  /**
+   * Add 'job' to the waiting jobs.
+   **/
+  void addWaiting(KDirReadJob *job);
+
+  /**
+   * Start the bookkeeping for the rate (limit) and switch to the idle I/O
+   * priority if desired.
+   **/
+  void beginReading();
+
+  /**
+   * Stop time-sliced reading and restore the I/O priority.
+   **/
+  void endReading();
+
+  /**
+   * Move the most promising waiting job to the queue.
+   **/
+  void takeWaiting();
+
+  // In "largest first" mode, only the current job and jobs without a
+  // directory are in _queue; the others wait in the _waiting heap.
   QList<KDirReadJob *> _queue;
+  std::vector<WaitingJob> _waiting;
+  bool _largestFirst;
+  quint64 _serial;
   QTimer _timer;
+
+  int _maxItemsPerSecond;
+  bool _idleIoPriority;
+  int _savedIoPriority; // -1 if not changed
+  qint64 _itemsRead;    // since _readTimer started, for the limit
+  QElapsedTimer _readTimer;
+  int _rateItems; // since _rateTimer started
+  QElapsedTimer _rateTimer;
+  int _itemsPerSecond;
 };
 
 } // namespace KDirStat
@@ -22,6 +22,7 @@
 #include "kdirstatsettings.h"
 #include "kdirtreeview.h"
 #include "kexcluderules.h"
+#include "ktreemapcolors.h"
 #include "ktreemapview.h"
 #include <KHelpClient>
 #include <KLocalizedString>
@@ -552,8 +553,54 @@ KGeneralSettingsPage::KGeneralSettingsPage(QWidget *parent, k4dirstat *mainWin)
   _crossFileSystems = new QCheckBox(i18n("Cross &File System Boundaries"));
   _enableLocalDirReader =
       new QCheckBox(i18n("Use Optimized &Local Directory Read Methods"));
+  _watchForChanges = new QCheckBox(i18n("&Watch for Changes After Reading"));
+  _saveCheckpoints =
+      new QCheckBox(i18n("&Save Checkpoints to Resume Interrupted Scans"));
+  _saveCheckpoints->setToolTip(
+      i18n("Writes everything read so far to a file every few minutes. The "
+           "program does not respond while the file is written, which can "
+           "take several seconds for a large tree; checkpoints are then "
+           "written less often."));
+  _largestFirst = new QCheckBox(i18n("Read Lar&gest Directories First"));
+  _idleIoPriority = new QCheckBox(i18n("Read with &Idle I/O Priority"));
+  _useBulkStat = new QCheckBox(
+      i18n("Use XFS / Btrfs &Bulk Metadata Reading (Needs Root)"));
+  _useBulkStat->setToolTip(
+      i18n("Only when reading the root of a file system or Btrfs "
+           "subvolume. The metadata is loaded in the background; until "
+           "it is there, files are looked at one by one as usual."));
   gboxLayout->addWidget(_crossFileSystems);
   gboxLayout->addWidget(_enableLocalDirReader);
+  gboxLayout->addWidget(_watchForChanges);
+  gboxLayout->addWidget(_saveCheckpoints);
+  gboxLayout->addWidget(_largestFirst);
+  gboxLayout->addWidget(_idleIoPriority);
+  gboxLayout->addWidget(_useBulkStat);
+
+  QHBoxLayout *rateLayout = new QHBoxLayout();
+  gboxLayout->addLayout(rateLayout);
+  QLabel *rateLabel =
+      new QLabel(i18n("Limi&t Reading to Items per Second (0: No Limit): "));
+  _maxItemsPerSecond = new QSpinBox();
+  _maxItemsPerSecond->setMinimum(0);
+  _maxItemsPerSecond->setMaximum(1000000);
+  _maxItemsPerSecond->setSingleStep(100);
+  rateLabel->setBuddy(_maxItemsPerSecond);
+  rateLayout->addWidget(rateLabel);
+  rateLayout->addWidget(_maxItemsPerSecond);
+  rateLayout->addStretch();
+
+  QHBoxLayout *depthLayout = new QHBoxLayout();
+  gboxLayout->addLayout(depthLayout);
+  QLabel *depthLabel =
+      new QLabel(i18n("Keep Directories Only Down to Le&vel (0: All): "));
+  _maxTreeDepth = new QSpinBox();
+  _maxTreeDepth->setMinimum(0);
+  _maxTreeDepth->setMaximum(100);
+  depthLabel->setBuddy(_maxTreeDepth);
+  depthLayout->addWidget(depthLabel);
+  depthLayout->addWidget(_maxTreeDepth);
+  depthLayout->addStretch();
 
   connect(_enableLocalDirReader, SIGNAL(stateChanged(int)), this,
           SLOT(checkEnabledState()));
@@ -624,6 +671,13 @@ void KGeneralSettingsPage::apply() {
 
   config.writeEntry("CrossFileSystems", _crossFileSystems->isChecked());
   config.writeEntry("EnableLocalDirReader", _enableLocalDirReader->isChecked());
+  config.writeEntry("WatchForChanges", _watchForChanges->isChecked());
+  config.writeEntry("SaveCheckpoints", _saveCheckpoints->isChecked());
+  config.writeEntry("LargestFirst", _largestFirst->isChecked());
+  config.writeEntry("IdleIoPriority", _idleIoPriority->isChecked());
+  config.writeEntry("UseBulkStat", _useBulkStat->isChecked());
+  config.writeEntry("MaxItemsPerSecond", _maxItemsPerSecond->value());
+  config.writeEntry("MaxTreeDepth", _maxTreeDepth->value());
 
   config = KSharedConfig::openConfig()->group("Exclude");
   // config.setGroup( "Exclude" );
@@ -636,7 +690,7 @@ void KGeneralSettingsPage::apply() {
     QString ruleText = item->text();
     excludeRulesStringList.append(ruleText);
     // qDebug() << "Adding exclude rule " << ruleText << endl;
-    KExcludeRules::excludeRules()->add(new KExcludeRule(QRegExp(ruleText)));
+    KExcludeRules::excludeRules()->add(KExcludeRule::fromText(ruleText));
   }
 
   config.writeEntry("ExcludeRules", excludeRulesStringList);
@@ -645,6 +699,13 @@ void KGeneralSettingsPage::apply() {
 void KGeneralSettingsPage::revertToDefaults() {
   _crossFileSystems->setChecked(false);
   _enableLocalDirReader->setChecked(true);
+  _watchForChanges->setChecked(false);
+  _saveCheckpoints->setChecked(false);
+  _largestFirst->setChecked(false);
+  _idleIoPriority->setChecked(false);
+  _useBulkStat->setChecked(false);
+  _maxItemsPerSecond->setValue(0);
+  _maxTreeDepth->setValue(0);
   _excludeRulesListView->clear();
   _editExcludeRuleButton->setEnabled(false);
   _deleteExcludeRuleButton->setEnabled(false);
@@ -656,11 +717,18 @@ void KGeneralSettingsPage::setup() {
   _crossFileSystems->setChecked(config.readEntry("CrossFileSystems", false));
   _enableLocalDirReader->setChecked(
       config.readEntry("EnableLocalDirReader", true));
+  _watchForChanges->setChecked(config.readEntry("WatchForChanges", false));
+  _saveCheckpoints->setChecked(config.readEntry("SaveCheckpoints", false));
+  _largestFirst->setChecked(config.readEntry("LargestFirst", false));
+  _idleIoPriority->setChecked(config.readEntry("IdleIoPriority", false));
+  _useBulkStat->setChecked(config.readEntry("UseBulkStat", false));
+  _maxItemsPerSecond->setValue(config.readEntry("MaxItemsPerSecond", 0));
+  _maxTreeDepth->setValue(config.readEntry("MaxTreeDepth", 0));
   _excludeRulesListView->clear();
 
   foreach (KExcludeRule *excludeRule, KExcludeRules::excludeRules()->rules()) {
     QListWidgetItem *n = new QListWidgetItem(_excludeRulesListView);
-    n->setText(excludeRule->regexp().pattern());
+    n->setText(excludeRule->text());
   }
 
   checkEnabledState();
@@ -668,6 +736,9 @@ void KGeneralSettingsPage::setup() {
 
 void KGeneralSettingsPage::checkEnabledState() {
   _crossFileSystems->setEnabled(_enableLocalDirReader->isChecked());
+  _watchForChanges->setEnabled(_enableLocalDirReader->isChecked());
+  _useBulkStat->setEnabled(_enableLocalDirReader->isChecked());
+  _maxTreeDepth->setEnabled(_enableLocalDirReader->isChecked());
 
   int excludeRulesCount = _excludeRulesListView->count();
 
@@ -679,7 +750,8 @@ void KGeneralSettingsPage::addExcludeRule() {
   bool ok;
   QString text =
       QInputDialog::getText(this, i18n("New exclude rule"),
-                            i18n("Regular expression for new exclude rule:"),
+                            i18n("Regular expression for new exclude rule\n"
+                                 "(or \"glob:\" followed by a glob pattern):"),
                             QLineEdit::Normal, QString(), &ok);
   if (ok && !text.isEmpty()) {
     QListWidgetItem *l = new QListWidgetItem(_excludeRulesListView);
@@ -697,7 +769,8 @@ void KGeneralSettingsPage::editExcludeRule() {
     bool ok;
     QString text =
         QInputDialog::getText(this, i18n("Edit exclude rule"),
-                              i18n("Exclude rule (regular expression):"),
+                              i18n("Exclude rule (regular expression or\n"
+                                   "\"glob:\" followed by a glob pattern):"),
                               QLineEdit::Normal, item->text(), &ok);
     if (ok) {
       if (text.isEmpty())
@@ -821,6 +894,24 @@ KTreemapPage::KTreemapPage(QWidget *parent, k4dirstat *mainWin)
   plainTileLayout->addWidget(label);
   plainTileLayout->addWidget(_outlineColor);
 
+  // File colors
+
+  QGroupBox *colorBox = new QGroupBox(i18n("File &Colors"), this);
+  layout->addWidget(colorBox);
+  QVBoxLayout *colorBoxLayout = new QVBoxLayout();
+  colorBox->setLayout(colorBoxLayout);
+  _fileColorRules = new QListWidget();
+  colorBoxLayout->addWidget(_fileColorRules);
+
+  QHBoxLayout *colorButtonLayout = new QHBoxLayout();
+  colorBoxLayout->addLayout(colorButtonLayout);
+  QPushButton *addFileColorRuleButton = new QPushButton(i18n("&Add"));
+  _editFileColorRuleButton = new QPushButton(i18n("&Edit"));
+  _deleteFileColorRuleButton = new QPushButton(i18n("&Delete"));
+  colorButtonLayout->addWidget(addFileColorRuleButton);
+  colorButtonLayout->addWidget(_editFileColorRuleButton);
+  colorButtonLayout->addWidget(_deleteFileColorRuleButton);
+
   // Misc
 
   QWidget *gridBox = new QWidget(this);
@@ -850,6 +941,10 @@ KTreemapPage::KTreemapPage(QWidget *parent, k4dirstat *mainWin)
   _autoResize = new QCheckBox(i18n("Auto-&Resize Treemap"), this);
   layout->addWidget(_autoResize);
 
+  _levelOfDetail =
+      new QCheckBox(i18n("Progressive Level of &Detail for Large Trees"), this);
+  layout->addWidget(_levelOfDetail);
+
   // Connections
 
   connect(_ambientLight, SIGNAL(valueChanged(int)), _ambientLightSB,
@@ -869,6 +964,15 @@ KTreemapPage::KTreemapPage(QWidget *parent, k4dirstat *mainWin)
   connect(_forceCushionGrid, SIGNAL(stateChanged(int)), this,
           SLOT(checkEnabledState()));
 
+  connect(addFileColorRuleButton, SIGNAL(clicked()), this,
+          SLOT(addFileColorRule()));
+  connect(_editFileColorRuleButton, SIGNAL(clicked()), this,
+          SLOT(editFileColorRule()));
+  connect(_deleteFileColorRuleButton, SIGNAL(clicked()), this,
+          SLOT(deleteFileColorRule()));
+  connect(_fileColorRules, SIGNAL(itemDoubleClicked(QListWidgetItem *)), this,
+          SLOT(editFileColorRule()));
+
   checkEnabledState();
 }
 
@@ -887,12 +991,20 @@ void KTreemapPage::apply() {
   config.writeEntry("ForceCushionGrid", _forceCushionGrid->isChecked());
   config.writeEntry("MinTileSize", _minTileSize->value());
   config.writeEntry("AutoResize", _autoResize->isChecked());
+  config.writeEntry("LevelOfDetail", _levelOfDetail->isChecked());
   config.writeEntry("CushionGridColor", _cushionGridColor->color());
   config.writeEntry("OutlineColor", _outlineColor->color());
   config.writeEntry("FileFillColor", _fileFillColor->color());
   config.writeEntry("DirFillColor", _dirFillColor->color());
   config.writeEntry("HighlightColor", _highlightColor->color());
 
+  QStringList fileColorRules;
+
+  for (int i = 0; i < _fileColorRules->count(); i++)
+    fileColorRules.append(_fileColorRules->item(i)->text());
+
+  config.writeEntry("FileColorRules", fileColorRules);
+
   if (treemapView()) {
     treemapView()->readConfig();
     treemapView()->rebuildTreemap();
@@ -909,12 +1021,17 @@ void KTreemapPage::revertToDefaults() {
   _forceCushionGrid->setChecked(false);
   _minTileSize->setValue(DefaultMinTileSize);
   _autoResize->setChecked(true);
+  _levelOfDetail->setChecked(true);
 
   _cushionGridColor->setColor(QColor(0x80, 0x80, 0x80));
   _outlineColor->setColor(QColor(Qt::black));
   _fileFillColor->setColor(QColor(0xde, 0x8d, 0x53));
   _dirFillColor->setColor(QColor(0x10, 0x7d, 0xb4));
   _highlightColor->setColor(QColor(Qt::red));
+
+  _fileColorRules->clear();
+  _fileColorRules->addItems(KTreemapColorRules::defaultRules());
+  checkEnabledState();
 }
 
 void KTreemapPage::setup() {
@@ -932,6 +1049,7 @@ void KTreemapPage::setup() {
   _forceCushionGrid->setChecked(config.readEntry("ForceCushionGrid", false));
   _minTileSize->setValue(config.readEntry("MinTileSize", DefaultMinTileSize));
   _autoResize->setChecked(config.readEntry("AutoResize", true));
+  _levelOfDetail->setChecked(config.readEntry("LevelOfDetail", true));
 
   _cushionGridColor->setColor(
       readColorEntry(config, "CushionGridColor", QColor(0x80, 0x80, 0x80)));
@@ -947,6 +1065,10 @@ void KTreemapPage::setup() {
   _ambientLightSB->setValue(_ambientLight->value());
   _heightScalePercentSB->setValue(_heightScalePercent->value());
 
+  _fileColorRules->clear();
+  _fileColorRules->addItems(config.readEntry(
+      "FileColorRules", KTreemapColorRules::defaultRules()));
+
   checkEnabledState();
 }
 
@@ -959,6 +1081,50 @@ void KTreemapPage::checkEnabledState() {
     _cushionGridColorL->setEnabled(_forceCushionGrid->isChecked());
     _ensureContrast->setEnabled(!_forceCushionGrid->isChecked());
   }
+
+  int fileColorRulesCount = _fileColorRules->count();
+
+  _editFileColorRuleButton->setEnabled(fileColorRulesCount > 0);
+  _deleteFileColorRuleButton->setEnabled(fileColorRulesCount > 0);
+}
+
+void KTreemapPage::addFileColorRule() {
+  bool ok;
+  QString text = QInputDialog::getText(
+      this, i18n("New file color rule"),
+      i18n("Color and filename extensions (e.g. \"#00ff00: zip gz\"):"),
+      QLineEdit::Normal, QString(), &ok);
+  if (ok && !text.isEmpty())
+    _fileColorRules->addItem(text);
+
+  checkEnabledState();
+}
+
+void KTreemapPage::editFileColorRule() {
+  QListWidgetItem *item = _fileColorRules->currentItem();
+
+  if (item) {
+    bool ok;
+    QString text = QInputDialog::getText(
+        this, i18n("Edit file color rule"),
+        i18n("Color and filename extensions (e.g. \"#00ff00: zip gz\"):"),
+        QLineEdit::Normal, item->text(), &ok);
+    if (ok) {
+      if (text.isEmpty())
+        delete _fileColorRules->takeItem(_fileColorRules->currentRow());
+      else
+        item->setText(text);
+    }
+  }
+
+  checkEnabledState();
+}
+
+void KTreemapPage::deleteFileColorRule() {
+  if (_fileColorRules->currentItem())
+    delete _fileColorRules->takeItem(_fileColorRules->currentRow());
+
+  checkEnabledState();
 }
 
 QColor KTreemapPage::readColorEntry(KConfigGroup config, const char *entryName,
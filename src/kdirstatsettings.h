@@ -547,6 +547,13 @@ protected:
 
   QCheckBox *_crossFileSystems;
   QCheckBox *_enableLocalDirReader;
+  QCheckBox *_watchForChanges;
+  QCheckBox *_saveCheckpoints;
+  QCheckBox *_largestFirst;
+  QCheckBox *_idleIoPriority;
+  QCheckBox *_useBulkStat;
+  QSpinBox *_maxItemsPerSecond;
+  QSpinBox *_maxTreeDepth;
 
   QListWidget *_excludeRulesListView;
   QPushButton *_addExcludeRuleButton;
@@ -602,6 +609,23 @@ public slots:
    **/
   void checkEnabledState();
 
+protected slots:
+
+  /**
+   * Add a new file color rule.
+   **/
+  void addFileColorRule();
+
+  /**
+   * Edit the currently selected file color rule.
+   **/
+  void editFileColorRule();
+
+  /**
+   * Delete the currently selected file color rule.
+   **/
+  void deleteFileColorRule();
+
 protected:
   /**
    * Returns the main window's current treemap view or 0 if there is
@@ -639,6 +663,10 @@ protected:
   KColorButton *_highlightColor;
   QSpinBox *_minTileSize;
   QCheckBox *_autoResize;
+  QCheckBox *_levelOfDetail;
+  QListWidget *_fileColorRules;
+  QPushButton *_editFileColorRuleButton;
+  QPushButton *_deleteFileColorRuleButton;
 
 }; // class KTreemapPage
 
@@ -4,13 +4,36 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include "kbulkstat.h"
 #include "kdirreadjob.h"
 #include "kdirtree.h"
 #include "kdirtreecache.h"
+#include "kdirtreewatcher.h"
+#include "kexcluderules.h"
 #include <KSharedConfig>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QStandardPaths>
+#include <QThread>
+#include <QThreadPool>
+#include <algorithm>
 #include <kconfig.h>
 #include <kconfiggroup.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+// Check the summary fields of the whole tree against a serial sum after
+// reading is finished, and check a scratch tree that is filled by several
+// threads at once the same way. Expensive - only for debugging.
+#define VERBOSE_CHECK_TOTALS 0
+
+// Wait at least this many times as long as writing the last checkpoint
+// took before writing the next one, so the user interface is blocked for
+// no more than a small fraction of the time, however large the tree gets.
+#define CHECKPOINT_WAIT_PER_WRITE_TIME 50
 using namespace KDirStat;
 
 KDirTree::KDirTree() : QObject() {
@@ -18,13 +41,25 @@ KDirTree::KDirTree() : QObject() {
   _isFileProtocol = false;
   _isBusy = false;
   _readMethod = KDirReadUnknown;
+  _watcher = 0;
+  _bulkStat = 0;
+  _bulkStatLoader = 0;
+  _threadPool = 0;
+  _largeItemsIncomplete = false;
 
   readConfig();
 
   connect(&_jobQueue, SIGNAL(finished()), this, SLOT(slotFinished()));
+  connect(&_checkpointTimer, SIGNAL(timeout()), this, SLOT(saveCheckpoint()));
 }
 
 KDirTree::~KDirTree() {
+  // Quitting in the middle of a scan
+  if (_checkpointTimer.isActive())
+    writeCheckpoint();
+
+  delete _watcher;
+  stopBulkStat();
   _jobQueue.clear();
   selectItems();
 
@@ -37,11 +72,24 @@ void KDirTree::readConfig() {
 
   _crossFileSystems = config.readEntry("CrossFileSystems", false);
   _enableLocalDirReader = config.readEntry("EnableLocalDirReader", true);
+  _watchForChanges = config.readEntry("WatchForChanges", false);
+  _watchBudget = config.readEntry("WatchBudget", 8192);
+  _saveCheckpoints = config.readEntry("SaveCheckpoints", false);
+  _checkpointInterval = config.readEntry("CheckpointInterval", 300);
+  _useBulkStat = config.readEntry("UseBulkStat", false);
+  _maxTreeDepth = config.readEntry("MaxTreeDepth", 0);
+  _topFilesCount = config.readEntry("TopFilesCount", 100);
+  _jobQueue.setLargestFirst(config.readEntry("LargestFirst", false));
+  _jobQueue.setMaxItemsPerSecond(config.readEntry("MaxItemsPerSecond", 0));
+  _jobQueue.setIdleIoPriority(config.readEntry("IdleIoPriority", false));
 }
 
 void KDirTree::setRoot(KFileInfo *newRoot) {
   if (_root) {
     selectItems();
+    _hardLinks.clear();
+    forgetLargeItems(_root);
+    _fileTypeStats.clear();
     emit deletingChild(_root);
     delete _root;
     emit childDeleted();
@@ -51,10 +99,18 @@ void KDirTree::setRoot(KFileInfo *newRoot) {
 }
 
 void KDirTree::clear(bool sendSignals) {
+  // Without signals, the watcher wouldn't notice its directories are gone
+  delete _watcher;
+  _watcher = 0;
+  _checkpointTimer.stop();
   _jobQueue.clear();
+  stopBulkStat();
 
   if (_root) {
     selectItems();
+    _hardLinks.clear();
+    forgetLargeItems(_root);
+    _fileTypeStats.clear();
 
     if (sendSignals)
       emit deletingChild(_root);
@@ -105,10 +161,21 @@ void KDirTree::startReading(const QUrl &url) {
     if (_root->isDir()) {
       KDirInfo *dir = (KDirInfo *)_root;
 
-      if (_readMethod == KDirReadLocal)
-        addJob(new KLocalDirReadJob(this, dir));
+      // Checkpoints are cache files, and those only know local paths
+      if (_saveCheckpoints && _isFileProtocol)
+        _checkpointTimer.start(_checkpointInterval * 1000);
       else
+        _checkpointTimer.stop();
+
+      if (_readMethod == KDirReadLocal) {
+        // This is only worth while for reading a complete tree, not for
+        // refreshing a subtree.
+
+        startBulkStat(url.path());
+        addJob(new KLocalDirReadJob(this, dir));
+      } else {
         addJob(new KioDirReadJob(this, dir));
+      }
     } else {
       _isBusy = false;
       emit finished();
@@ -122,13 +189,59 @@ void KDirTree::startReading(const QUrl &url) {
   }
 }
 
+/**
+ * Add the selected items in 'subtree' to 'found'.
+ **/
+static void findSelected(KFileInfo *subtree, std::vector<KFileInfo *> &found) {
+  if (subtree->isSelected())
+    found.push_back(subtree);
+
+  for (size_t i = 0; i < subtree->numChildren(); i++)
+    findSelected(subtree->child(i), found);
+
+  if (subtree->dotEntry())
+    findSelected(subtree->dotEntry(), found);
+}
+
 void KDirTree::selectionInSubTree(KFileInfo *subtree) {
-  for(size_t i = 0; i < _selection.size(); i++) {
-    if(_selection[i]->isInSubtree(subtree)) {
-      selectItems();
-      break;
+  if (_selection.empty())
+    return;
+
+  std::vector<KFileInfo *> deleted;
+
+  if ((size_t)subtree->totalItems() < _selection.size()) {
+    findSelected(subtree, deleted);
+  } else {
+    // Fewer items selected than in the subtree: Checking their ancestors
+    // is cheaper.
+
+    for (size_t i = 0; i < _selection.size(); i++) {
+      if (_selection[i]->isInSubtree(subtree))
+        deleted.push_back(_selection[i]);
     }
   }
+
+  if (deleted.empty())
+    return;
+
+  for (size_t i = 0; i < deleted.size(); i++)
+    unselect(deleted[i]);
+
+  emit selectionChanged(this);
+}
+
+void KDirTree::unselect(KFileInfo *item) {
+  size_t index = _selectionIndex.take(item);
+  KFileInfo *last = _selection.back();
+
+  // Fill the gap with the last item
+  _selection[index] = last;
+  _selection.pop_back();
+
+  if (last != item)
+    _selectionIndex.insert(last, index);
+
+  item->setSelected(false);
 }
 
 void KDirTree::refresh(KFileInfo *subtree) {
@@ -169,6 +282,9 @@ void KDirTree::refresh(KFileInfo *subtree) {
      * I just found that out the hard way by several hours of debugging. ;-}
      **/
     parent->deletingChild(subtree);
+    forgetHardLinks(subtree);
+    forgetLargeItems(subtree);
+    forgetFileTypes(subtree);
     delete subtree;
     emit childDeleted();
 
@@ -178,7 +294,7 @@ void KDirTree::refresh(KFileInfo *subtree) {
     // Create new subtree root.
 
     subtree = (_readMethod == KDirReadLocal)
-                  ? KLocalDirReadJob::stat(url, parent)
+                  ? KLocalDirReadJob::stat(url, parent, this)
                   : KioDirReadJob::stat(url, parent);
 
     // qDebug() << "New subtree: " << subtree << endl;
@@ -206,22 +322,350 @@ void KDirTree::refresh(KFileInfo *subtree) {
   }
 }
 
+void KDirTree::updateChildren(KDirInfo *dir, const QSet<QString> &names) {
+  if (_readMethod != KDirReadLocal) {
+    refresh(dir);
+    return;
+  }
+
+  // Look up the old children by name only once
+
+  QHash<QString, KFileInfo *> oldChildren;
+
+  for (size_t i = 0; i < dir->numChildren(); i++)
+    oldChildren.insert(dir->child(i)->name(), dir->child(i));
+
+  if (dir->dotEntry()) {
+    KDirInfo *dotEntry = dir->dotEntry();
+
+    for (size_t i = 0; i < dotEntry->numChildren(); i++)
+      oldChildren.insert(dotEntry->child(i)->name(), dotEntry->child(i));
+  }
+
+  QString dirName = dir->url();
+  QString prefix = dirName.endsWith('/') ? dirName : dirName + "/";
+  KExcludeRules *excludeRules = KExcludeRules::excludeRules();
+  KExcludeMatchState dirState;
+
+  // Find out what changed before changing anything
+
+  struct Change {
+    KFileInfo *oldChild;
+    KFileInfo *newChild;
+    ino_t inode;
+  };
+
+  QList<Change> changes;
+
+  foreach (const QString &name, names) {
+    KFileInfo *oldChild = oldChildren.value(name);
+    struct stat statInfo;
+    KFileInfo *newChild = 0;
+
+    if (lstat((prefix + name).toLocal8Bit(), &statInfo) == 0) {
+      if (S_ISDIR(statInfo.st_mode))
+        newChild = new KDirInfo(name, &statInfo, dir);
+      else
+        newChild = new KFileInfo(name, &statInfo, dir);
+    }
+
+    // Only a file can change in place; a directory under an old name is
+    // always a different one.
+
+    if (oldChild && newChild && !oldChild->isDir() && !newChild->isDir() &&
+        oldChild->byteSize() == newChild->byteSize() &&
+        oldChild->mtime() == newChild->mtime()) {
+      delete newChild;
+      continue;
+    }
+
+    if (!oldChild && !newChild)
+      continue;
+
+    Change change = {oldChild, newChild, newChild ? statInfo.st_ino : 0};
+    changes << change;
+  }
+
+  if (changes.isEmpty())
+    return;
+
+  // Without a dot entry, all children are of the same kind. The views
+  // don't expect the files to move, so if both kinds would be there
+  // afterwards, read everything again instead.
+
+  if (!dir->dotEntry()) {
+    QSet<KFileInfo *> replaced;
+    bool hasDirs = false;
+    bool hasFiles = false;
+
+    foreach (const Change &change, changes) {
+      if (change.oldChild)
+        replaced.insert(change.oldChild);
+
+      if (change.newChild && change.newChild->isDir())
+        hasDirs = true;
+      else if (change.newChild)
+        hasFiles = true;
+    }
+
+    for (size_t i = 0; i < dir->numChildren(); i++) {
+      KFileInfo *child = dir->child(i);
+
+      if (replaced.contains(child))
+        continue;
+
+      if (child->isDir())
+        hasDirs = true;
+      else
+        hasFiles = true;
+    }
+
+    if (hasDirs && hasFiles) {
+      foreach (const Change &change, changes)
+        delete change.newChild;
+
+      refresh(dir);
+      return;
+    }
+  }
+
+  // Earlier calls in the same batch of changes may have started already
+
+  if (!_isBusy) {
+    _isBusy = true;
+    emit startingReading();
+  }
+
+  // 'dir' changes size, and it may be one of the largest directories
+  _largeItemsIncomplete = true;
+
+  foreach (const Change &change, changes) {
+    KFileInfo *newChild = change.newChild;
+
+    if (change.oldChild)
+      deleteSubtree(change.oldChild);
+
+    if (!newChild)
+      continue;
+
+    if (newChild->isDir()) {
+      KDirInfo *subDir = (KDirInfo *)newChild;
+      KExcludeMatchState subDirState;
+
+      excludeRules->updateState(&dirState, dirName);
+
+      if (subDir->device() != dir->device())
+        subDir->setMountPoint();
+
+      if (excludeRules->matchEntry(dirState, dirName, newChild->name(),
+                                 &subDirState)) {
+        subDir->setExcluded();
+        subDir->setReadState(KDirOnRequestOnly);
+        emit finalizeLocal(subDir);
+        subDir->finalizeLocal();
+      } else if (subDir->isMountPoint() && !_crossFileSystems) {
+        subDir->setReadState(KDirOnRequestOnly);
+        emit finalizeLocal(subDir);
+        subDir->finalizeLocal();
+      } else {
+        KDirReadJob *job = new KLocalDirReadJob(this, subDir);
+        job->setExcludeState(subDirState);
+        addJob(job);
+      }
+    }
+
+    addHardLink(newChild, change.inode);
+    dir->insertChild(newChild);
+    childAddedNotify(newChild);
+  }
+
+  dir->propagateDeltas();
+
+  // Read jobs will get to slotFinished() on their own - not only those
+  // added here, but also those of earlier calls in the same batch of
+  // changes and of any refresh() before them.
+  if (_jobQueue.isEmpty())
+    slotFinished();
+}
+
 void KDirTree::abortReading() {
   if (_jobQueue.isEmpty())
     return;
 
+  if (_checkpointTimer.isActive()) {
+    // Before the read states all say "aborted"
+    _checkpointTimer.stop();
+    writeCheckpoint();
+  }
+
   _jobQueue.abort();
+  stopBulkStat();
 
   _isBusy = false;
   emit aborted();
 }
 
+#if VERBOSE_CHECK_TOTALS
+/**
+ * Sum up the subtree below 'item' one item after another, without
+ * using any summary fields.
+ **/
+static void sumSerially(KFileInfo *item, KFileSize &size, KFileCount &subDirs,
+                        KFileCount &files) {
+  for (size_t i = 0; i < item->numChildren(); i++) {
+    KFileInfo *child = item->child(i);
+
+    if (!child->isDirInfo())
+      size += child->totalSize();
+    else if (child->readState() != KDirOnRequestOnly)
+      size += child->size();
+
+    if (child->isDir())
+      subDirs++;
+
+    if (child->isFile())
+      files++;
+
+    sumSerially(child, size, subDirs, files);
+  }
+
+  if (item->dotEntry())
+    sumSerially(item->dotEntry(), size, subDirs, files);
+}
+
+/**
+ * Compare the summary fields of 'root' against a serial sum.
+ **/
+static void checkTotals(KFileInfo *root, const char *what) {
+  KFileSize size = root->size();
+  KFileCount subDirs = 0;
+  KFileCount files = 0;
+  sumSerially(root, size, subDirs, files);
+
+  if (size != root->totalSize() || subDirs != root->totalSubDirs() ||
+      files != root->totalFiles())
+    qWarning() << what << "summary mismatch: size" << root->totalSize()
+               << "!=" << size << "subdirs" << root->totalSubDirs() << "!="
+               << subDirs << "files" << root->totalFiles() << "!=" << files
+               << Qt::endl;
+  else
+    qDebug() << what << "summary OK:" << size << "bytes" << subDirs
+             << "subdirs" << files << "files" << Qt::endl;
+}
+
+namespace {
+/**
+ * Fills a directory of a scratch tree the way a read job would: Files
+ * and subdirectories are added one by one, and each of them is
+ * propagated to the ancestors right away to get as much contention on
+ * the shared ancestors as possible.
+ **/
+class KStressFillTask : public QRunnable {
+public:
+  KStressFillTask(KDirInfo *dir) : _dir(dir) {}
+
+  void run() override { fill(_dir, 3); }
+
+private:
+  void fill(KDirInfo *dir, int depth) {
+    for (int i = 0; i < 100; i++) {
+      dir->insertChild(new KFileInfo(dir, QString("f%1").arg(i),
+                                     S_IFREG | 0644, 1000 + i, i));
+      dir->propagateDeltas();
+    }
+
+    for (int i = 0; depth > 0 && i < 4; i++) {
+      KDirInfo *subDir =
+          new KDirInfo(dir, QString("d%1").arg(i), S_IFDIR | 0755, 4096, i);
+      dir->insertChild(subDir);
+      dir->propagateDeltas();
+      fill(subDir, depth - 1);
+      subDir->propagateDeltas();
+    }
+  }
+
+  KDirInfo *_dir;
+};
+} // namespace
+
+/**
+ * Fill the subdirectories of a scratch tree from several threads at once
+ * while reading the summary like a view would, then check the summary.
+ **/
+static void stressTotals() {
+  KDirInfo root(0, "/stress", S_IFDIR | 0755, 4096, 0);
+  QThreadPool threadPool;
+  threadPool.setMaxThreadCount(qMax(4, QThread::idealThreadCount()));
+
+  // Only the thread that fills a directory may insert into it
+
+  for (int i = 0; i < 64; i++)
+    root.insertChild(
+        new KDirInfo(&root, QString("t%1").arg(i), S_IFDIR | 0755, 4096, 0));
+
+  for (size_t i = 0; i < root.numChildren(); i++)
+    threadPool.start(
+        new KStressFillTask(static_cast<KDirInfo *>(root.child(i))));
+
+  KFileSize lastSize = 0;
+
+  while (!threadPool.waitForDone(1)) {
+    // The totals may lag behind, but they never go back
+    KFileSize size = root.totalSize();
+
+    if (size < lastSize)
+      qWarning() << "Stress test: Total size went back from" << lastSize
+                 << "to" << size << Qt::endl;
+
+    lastSize = size;
+  }
+
+  checkTotals(&root, "Stress test");
+}
+#endif
+
 void KDirTree::slotFinished() {
   _isBusy = false;
+
+  // Files added later have to be looked at anyway
+  stopBulkStat();
+
+  if (_checkpointTimer.isActive()) {
+    // The scan is complete: Nothing left to continue
+    _checkpointTimer.stop();
+    QFile::remove(checkpointFileName());
+  }
+
+#if VERBOSE_CHECK_TOTALS
+  if (_root && _root->isDirInfo())
+    checkTotals(_root, "Tree");
+
+  stressTotals();
+#endif
+
+  if (_watchForChanges && _readMethod == KDirReadLocal && _root &&
+      _root->isDirInfo()) {
+    if (!_watcher)
+      _watcher = new KDirTreeWatcher(this, _watchBudget);
+
+    _watcher->setBudget(_watchBudget);
+    _watcher->watchTree(); // Pick up any directories read since last time
+  } else if (_watcher) {
+    // This may be called while the watcher is applying changes
+    _watcher->deleteLater();
+    _watcher = 0;
+  }
+
   emit finished();
 }
 
 void KDirTree::childAddedNotify(KFileInfo *newChild) {
+  // Directories only when they are finalized: Only then their size is known
+  if (!newChild->isDirInfo()) {
+    addLargeItem(newChild);
+    _fileTypeStats.add(newChild);
+  }
+
   emit childAdded(newChild);
 
   if (newChild->dotEntry())
@@ -252,6 +696,11 @@ void KDirTree::deleteSubtree(KFileInfo *subtree) {
     parent->deletingChild(subtree);
   }
 
+  // Before an empty dot entry is deleted below: These need the parents
+  forgetHardLinks(subtree);
+  forgetLargeItems(subtree);
+  forgetFileTypes(subtree);
+
   // Send notification to anybody interested (e.g., to attached views)
   deletingChildNotify(subtree);
 
@@ -295,13 +744,300 @@ void KDirTree::deleteSubtree(KFileInfo *subtree) {
   emit childDeleted();
 }
 
+void KDirTree::startBulkStat(const QString &path) {
+  stopBulkStat();
+
+  if (!_useBulkStat)
+    return;
+
+  if (!_threadPool) {
+    _threadPool = new QThreadPool(this);
+    _threadPool->setMaxThreadCount(1);
+  }
+
+  // Reading starts with lstat() right away and switches to the bulk
+  // metadata as soon as it is there.
+  _bulkStatLoader = new KBulkStatLoader(path);
+  _threadPool->start(_bulkStatLoader);
+}
+
+void KDirTree::stopBulkStat() {
+  if (_bulkStatLoader) {
+    _bulkStatLoader->cancel();
+    _threadPool->waitForDone();
+    delete _bulkStatLoader;
+    _bulkStatLoader = 0;
+  }
+
+  delete _bulkStat;
+  _bulkStat = 0;
+}
+
+const KBulkStat *KDirTree::bulkStat() {
+  if (!_bulkStat && _bulkStatLoader && _bulkStatLoader->isDone())
+    _bulkStat = _bulkStatLoader->take();
+
+  return _bulkStat;
+}
+
+void KDirTree::addHardLink(KFileInfo *file, ino_t inode) {
+  if (file->links() > 1 && !file->isDir())
+    file->setHardLinkState(
+        _hardLinks.add(file->device(), inode, file->allocatedSize(), file)
+            ? KHardLinkCounted
+            : KHardLinkOther);
+}
+
+void KDirTree::forgetHardLinks(KFileInfo *subtree) {
+  if (_hardLinks.count() == 0)
+    return;
+
+  if (!subtree->parent()) {
+    _hardLinks.clear();
+    return;
+  }
+
+  std::vector<KFileInfo *> links;
+
+  if (subtree->totalItems() < (KFileCount)_hardLinks.linkCount()) {
+    QList<KFileInfo *> items;
+    items.append(subtree);
+
+    while (!items.isEmpty()) {
+      KFileInfo *item = items.takeLast();
+
+      // This includes folded directories that stand in for the files
+      // below them
+      if (_hardLinks.contains(item))
+        links.push_back(item);
+
+      for (size_t i = 0; i < item->numChildren(); i++)
+        items.append(item->child(i));
+
+      if (item->dotEntry())
+        items.append(item->dotEntry());
+    }
+  } else {
+    // Fewer links than items in the subtree: Checking their ancestors is
+    // cheaper.
+
+    foreach (KFileInfo *link, _hardLinks.links()) {
+      if (link->isInSubtree(subtree))
+        links.push_back(link);
+    }
+  }
+
+  if (links.empty())
+    return;
+
+  std::vector<std::pair<KFileInfo *, KFileSize>> promoted;
+  _hardLinks.remove(links, promoted);
+
+  // Another link of these inodes is counted now: The directories that
+  // contain it grow.
+
+  for (size_t i = 0; i < promoted.size(); i++) {
+    KFileInfo *link = promoted[i].first;
+
+    if (link->isDirInfo()) {
+      ((KDirInfo *)link)->addFoldedHardLink(promoted[i].second);
+    } else {
+      _fileTypeStats.remove(link);
+      link->setHardLinkState(KHardLinkCounted);
+      _fileTypeStats.add(link);
+
+      if (link->parent())
+        link->parent()->markAsDirty();
+    }
+  }
+
+  if (!promoted.empty())
+    _largeItemsIncomplete = true;
+}
+
+bool KDirTree::addFoldedHardLink(KDirInfo *dir, dev_t device, ino_t inode,
+                                 KFileSize size) {
+  return _hardLinks.add(device, inode, size, dir);
+}
+
+bool KDirTree::isLargeFoldedFile(KFileSize size) const {
+  if (_topFilesCount <= 0 || size == 0)
+    return false;
+
+  return _largestFoldedFiles.size() < (size_t)_topFilesCount ||
+         size > _largestFoldedFiles.front().size;
+}
+
+void KDirTree::addFoldedFile(const QString &url, KFileSize size) {
+  KLargeItem file;
+  file.item = 0;
+  file.url = url;
+  file.size = size;
+
+  addLargeItem(_largestFoldedFiles, file);
+}
+
+void KDirTree::addLargeItem(std::vector<KLargeItem> &heap,
+                            const KLargeItem &item) {
+  if (_topFilesCount <= 0 || item.size == 0)
+    return;
+
+  bool full = heap.size() >= (size_t)_topFilesCount;
+
+  if (full && item.size <= heap.front().size)
+    return;
+
+  // A directory may be finalized more than once, e.g. after resuming
+  if (item.item) {
+    for (size_t i = 0; i < heap.size(); i++) {
+      if (heap[i].item == item.item)
+        return;
+    }
+  }
+
+  if (full) {
+    std::pop_heap(heap.begin(), heap.end());
+    heap.pop_back();
+  }
+
+  heap.push_back(item);
+  std::push_heap(heap.begin(), heap.end());
+}
+
+void KDirTree::addLargeItem(KFileInfo *item) {
+  KLargeItem large;
+  large.item = item;
+
+  if (!item->isDirInfo()) {
+    large.size = item->totalSize();
+    addLargeItem(_largestFiles, large);
+  } else if (!item->isDotEntry() && item->readState() == KDirFinished &&
+             item->totalSubDirs() == 0) {
+    // Only directories without subdirectories: Otherwise the root and its
+    // ancestors of the largest ones would always be on top.
+    large.size = item->totalSize();
+    addLargeItem(_largestDirs, large);
+  }
+}
+
+void KDirTree::forgetLargeItems(KFileInfo *subtree) {
+  if (!subtree->parent()) {
+    _largestFiles.clear();
+    _largestDirs.clear();
+    _largestFoldedFiles.clear();
+    _largeItemsIncomplete = false;
+    return;
+  }
+
+  auto gone = [subtree](const KLargeItem &large) {
+    return large.item == subtree || large.item->isInSubtree(subtree) ||
+           subtree->isInSubtree(large.item);
+  };
+
+  std::vector<KLargeItem> *heaps[] = {&_largestFiles, &_largestDirs};
+
+  for (std::vector<KLargeItem> *heap : heaps) {
+    auto it = std::remove_if(heap->begin(), heap->end(), gone);
+
+    if (it != heap->end()) {
+      heap->erase(it, heap->end());
+      std::make_heap(heap->begin(), heap->end());
+      _largeItemsIncomplete = true;
+    }
+  }
+
+  if (_largestFoldedFiles.empty())
+    return;
+
+  // Folded files are gone for good; the tree doesn't know about them
+
+  QString prefix = subtree->url() + "/";
+  auto it = std::remove_if(
+      _largestFoldedFiles.begin(), _largestFoldedFiles.end(),
+      [&prefix](const KLargeItem &file) {
+        return file.url.startsWith(prefix);
+      });
+
+  if (it != _largestFoldedFiles.end()) {
+    _largestFoldedFiles.erase(it, _largestFoldedFiles.end());
+    std::make_heap(_largestFoldedFiles.begin(), _largestFoldedFiles.end());
+  }
+}
+
+void KDirTree::rebuildLargeItems() {
+  _largestFiles.clear();
+  _largestDirs.clear();
+  _largeItemsIncomplete = false;
+
+  if (!_root)
+    return;
+
+  QList<KFileInfo *> items;
+  items.append(_root);
+
+  while (!items.isEmpty()) {
+    KFileInfo *item = items.takeLast();
+    addLargeItem(item);
+
+    for (size_t i = 0; i < item->numChildren(); i++)
+      items.append(item->child(i));
+
+    if (item->dotEntry())
+      items.append(item->dotEntry());
+  }
+}
+
+std::vector<KLargeItem> KDirTree::largestFiles() {
+  if (_largeItemsIncomplete)
+    rebuildLargeItems();
+
+  std::vector<KLargeItem> files = _largestFiles;
+  files.insert(files.end(), _largestFoldedFiles.begin(),
+               _largestFoldedFiles.end());
+  std::sort(files.begin(), files.end()); // largest first
+
+  if (files.size() > (size_t)_topFilesCount)
+    files.resize(_topFilesCount);
+
+  return files;
+}
+
+std::vector<KLargeItem> KDirTree::largestDirs() {
+  if (_largeItemsIncomplete)
+    rebuildLargeItems();
+
+  std::vector<KLargeItem> dirs = _largestDirs;
+  std::sort_heap(dirs.begin(), dirs.end()); // largest first
+
+  return dirs;
+}
+
+void KDirTree::forgetFileTypes(KFileInfo *subtree) {
+  if (subtree->parent())
+    _fileTypeStats.removeSubtree(subtree);
+  else
+    _fileTypeStats.clear();
+}
+
+void KDirTree::recalcFileTypeStats() {
+  _fileTypeStats.clear();
+
+  if (_root)
+    _fileTypeStats.addSubtree(_root);
+}
+
 void KDirTree::addJob(KDirReadJob *job) { _jobQueue.enqueue(job); }
 
 void KDirTree::sendProgressInfo(const QString &infoLine) {
   emit progressInfo(infoLine);
 }
 
-void KDirTree::sendFinalizeLocal(KDirInfo *dir) { emit finalizeLocal(dir); }
+void KDirTree::sendFinalizeLocal(KDirInfo *dir) {
+  if (dir)
+    addLargeItem(dir);
+
+  emit finalizeLocal(dir);
+}
 
 void KDirTree::sendStartingReading() { emit startingReading(); }
 
@@ -310,10 +1046,30 @@ void KDirTree::sendFinished() { emit finished(); }
 void KDirTree::sendAborted() { emit aborted(); }
 
 void KDirTree::selectItems(const std::vector<KFileInfo *> & newSelection) {
-  if (newSelection != _selection) {
-    _selection = newSelection;
-    emit selectionChanged(this);
+  // Without duplicates, the same number of items that are all selected
+  // already is the same selection.
+
+  bool same = newSelection.size() == _selection.size();
+
+  for (size_t i = 0; same && i < newSelection.size(); i++)
+    same = newSelection[i]->isSelected();
+
+  if (same)
+    return;
+
+  for (size_t i = 0; i < _selection.size(); i++)
+    _selection[i]->setSelected(false);
+
+  _selection = newSelection;
+  _selectionIndex.clear();
+  _selectionIndex.reserve(_selection.size());
+
+  for (size_t i = 0; i < _selection.size(); i++) {
+    _selection[i]->setSelected(true);
+    _selectionIndex.insert(_selection[i], i);
   }
+
+  emit selectionChanged(this);
 }
 
 bool KDirTree::writeCache(const QString &cacheFileName) {
@@ -324,6 +1080,57 @@ bool KDirTree::writeCache(const QString &cacheFileName) {
 void KDirTree::readCache(const QString &cacheFileName) {
   _isBusy = true;
   emit startingReading();
+
+  // Cache files only contain local paths. Any directories that were not
+  // read yet when the cache file was written are read this way.
+
+  readConfig();
+  _isFileProtocol = true;
+  _readMethod = _enableLocalDirReader ? KDirReadLocal : KDirReadKIO;
+
+  if (_saveCheckpoints && cacheFileName == checkpointFileName())
+    _checkpointTimer.start(_checkpointInterval * 1000);
+
   addJob(new KCacheReadJob(this, 0, cacheFileName));
 }
 
+bool KDirTree::writeCheckpoint() {
+  // While a cache file is read, it is not clear yet what is missing
+  if (!_root || _root->readState() == KDirCached)
+    return false;
+
+  QString fileName = checkpointFileName();
+  QString newFileName = fileName + ".new";
+  QDir().mkpath(QFileInfo(fileName).path());
+
+  // Only replace the old checkpoint with a complete new one
+
+  if (!writeCache(newFileName) || rename(QFile::encodeName(newFileName),
+                                         QFile::encodeName(fileName)) != 0) {
+    qWarning() << "Can't write checkpoint" << fileName << Qt::endl;
+    return false;
+  }
+
+  return true;
+}
+
+void KDirTree::saveCheckpoint() {
+  // The complete tree is written every time, and that takes longer the
+  // more there is read already.
+
+  QElapsedTimer writeTimer;
+  writeTimer.start();
+  writeCheckpoint();
+
+  qint64 interval = qMax((qint64)_checkpointInterval * 1000,
+                         writeTimer.elapsed() * CHECKPOINT_WAIT_PER_WRITE_TIME);
+
+  if (_checkpointTimer.isActive())
+    _checkpointTimer.start((int)interval);
+}
+
+QString KDirTree::checkpointFileName() {
+  return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) +
+         "/checkpoint" DEFAULT_CACHE_NAME;
+}
+
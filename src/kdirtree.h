@@ -8,11 +8,18 @@
 
 #include "kdirinfo.h"
 #include "kdirreadjob.h"
+#include "kfiletypestats.h"
+#include "khardlinktable.h"
+#include <QHash>
+#include <QSet>
+#include <QTimer>
 #include <dirent.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
+class QThreadPool;
+
 #ifndef NOT_USED
 #define NOT_USED(PARAM) ((void)(PARAM))
 #endif
@@ -24,6 +31,9 @@
 namespace KDirStat {
 // Forward declarations
 class KDirReadJob;
+class KDirTreeWatcher;
+class KBulkStat;
+class KBulkStatLoader;
 
 /**
  * Directory read methods.
@@ -34,6 +44,21 @@ typedef enum {
   KDirReadKIO      // Use KDE's KIO network transparent methods
 } KDirReadMethod;
 
+/**
+ * One of the largest files or directories of a tree, see @ref
+ * KDirTree::largestFiles().
+ **/
+struct KLargeItem {
+  KFileInfo *item; // 0 for a folded file that is not in the tree
+  QString url;     // only for folded files
+  KFileSize size;  // allocated size
+
+  // For a min-heap: The smallest one on top
+  bool operator<(const KLargeItem &other) const { return size > other.size; }
+
+  QString itemUrl() const { return item ? item->url() : url; }
+};
+
 /**
  * This class provides some infrastructure as well as global data for a
  * directory tree. It acts as the glue that holds things together: The root
@@ -45,7 +70,66 @@ typedef enum {
  **/
 class KDirTree : public QObject {
   Q_OBJECT
+
+  /**
+   * Remove any selected item in 'subtree' from the selection.
+   **/
   void selectionInSubTree(KFileInfo *);
+
+  /**
+   * Forget about the hard links in 'subtree' before 'subtree' is deleted.
+   * Where one of them was counted, another link of the same inode outside
+   * 'subtree' is counted instead; if there is none, the next one that is
+   * added.
+   **/
+  void forgetHardLinks(KFileInfo *subtree);
+
+  /**
+   * Forget about the largest items in 'subtree' before 'subtree' is
+   * deleted. Directories that contain 'subtree' are forgotten, too, since
+   * they shrink.
+   **/
+  void forgetLargeItems(KFileInfo *subtree);
+
+  /**
+   * Remove the files in 'subtree' from the file type statistics before
+   * 'subtree' is deleted.
+   **/
+  void forgetFileTypes(KFileInfo *subtree);
+
+  /**
+   * Start loading the metadata of the file system whose root is 'path' in
+   * bulk in the background, if enabled. See @ref bulkStat().
+   **/
+  void startBulkStat(const QString &path);
+
+  /**
+   * Cancel loading the bulk metadata and throw it away.
+   **/
+  void stopBulkStat();
+
+  /**
+   * Add 'item' to the largest files or directories if it is one.
+   **/
+  void addLargeItem(KFileInfo *item);
+
+  /**
+   * Add 'item' to the min-heap 'heap' of at most @ref topFilesCount()
+   * items if it is large enough.
+   **/
+  void addLargeItem(std::vector<KLargeItem> &heap, const KLargeItem &item);
+
+  /**
+   * Fill the largest files and directories from the whole tree again
+   * after some of them were forgotten.
+   **/
+  void rebuildLargeItems();
+
+  /**
+   * Remove 'item' from the selection without any notification.
+   **/
+  void unselect(KFileInfo *item);
+
 public:
   /**
    * Constructor.
@@ -97,6 +181,11 @@ public slots:
    * i.e. take care not to cause endless signal ping-pong!
    *
    * Select nothing if '0' is passed.
+   *
+   * The order of the items doesn't matter, and 'newSelection' must not
+   * contain any item twice. Checking whether this is the same selection
+   * as before and updating it only takes as long as the number of items
+   * involved since each item keeps a "selected" flag.
    **/
   void selectItems(const std::vector<KFileInfo *> &
                    newSelection = std::vector<KFileInfo*>());
@@ -106,6 +195,37 @@ public slots:
    **/
   void deleteSubtree(KFileInfo *subtree);
 
+  /**
+   * Decide whether or not 'file' is the hard link of inode 'inode' that
+   * is counted in the size summaries. Call this for items read with
+   * lstat() before inserting them into the tree; this does nothing for
+   * directories and items with only one link.
+   **/
+  void addHardLink(KFileInfo *file, ino_t inode);
+
+  /**
+   * Find the device and inode of hard link 'file' that was added with
+   * @ref addHardLink(). Returns 'false' if it wasn't.
+   **/
+  bool hardLinkInode(KFileInfo *file, dev_t &device, ino_t &inode) const {
+    return _hardLinks.inode(file, device, inode);
+  }
+
+  /**
+   * Bring the children of 'dir' whose names are in 'names' up to date
+   * with what is on disk without reading all of 'dir' again: Children
+   * that are gone or changed are deleted, new or changed ones are added
+   * (and read if they are directories). Names that are unchanged or
+   * don't exist on either side are ignored.
+   *
+   * If this would make the files of 'dir' move into a new dot entry or
+   * out of it, 'dir' is refreshed instead.
+   *
+   * This is only supported for local directories; other trees are
+   * refreshed.
+   **/
+  void updateChildren(KDirInfo *dir, const QSet<QString> &names);
+
 public:
   /**
    * Returns the root item of this tree.
@@ -180,6 +300,84 @@ public:
    **/
   void setCrossFileSystems(bool doCross) { _crossFileSystems = doCross; }
 
+  /**
+   * Returns the object that keeps this tree up to date after reading or 0
+   * if changes are not watched.
+   **/
+  KDirTreeWatcher *watcher() const { return _watcher; }
+
+  /**
+   * Returns the metadata of the file system that is being read, loaded in
+   * bulk, or 0 if there is none (yet). See @ref KBulkStat.
+   **/
+  const KBulkStat *bulkStat();
+
+  /**
+   * Returns the level below which directories are folded, i.e. their
+   * contents are only added to their summary and not kept in the tree
+   * (see @ref KDirInfo::setFolded()), or 0 if everything is kept. This
+   * keeps the memory bounded for huge trees.
+   *
+   * This is only supported by the local directory reader.
+   **/
+  int maxTreeDepth() const { return _maxTreeDepth; }
+
+  /**
+   * Returns how many of the largest files and directories are kept track
+   * of, see @ref largestFiles().
+   **/
+  int topFilesCount() const { return _topFilesCount; }
+
+  /**
+   * Returns the largest files of the tree by allocated size, the largest
+   * first, including those below the maximum tree depth that are not
+   * kept in the tree (see @ref maxTreeDepth()).
+   *
+   * These are kept in bounded min-heaps while reading, so this is cheap
+   * even for huge trees - unless items were deleted since then: That
+   * takes one pass over the whole tree.
+   **/
+  std::vector<KLargeItem> largestFiles();
+
+  /**
+   * Returns the largest directories without any subdirectories, the
+   * largest first. See @ref largestFiles().
+   **/
+  std::vector<KLargeItem> largestDirs();
+
+  /**
+   * Returns how much space the files of each type take up in the whole
+   * tree. This is kept up to date while reading and deleting; files
+   * below the maximum tree depth are not included.
+   **/
+  const KFileTypeStats &fileTypeStats() const { return _fileTypeStats; }
+
+  /**
+   * Calculate the file type statistics from scratch, e.g. after the
+   * treemap color rules changed.
+   **/
+  void recalcFileTypeStats();
+
+  /**
+   * Returns 'true' if a folded file of 'size' bytes is large enough to
+   * be one of the largest folded files (see @ref largestFiles()). Use
+   * this before building its URL.
+   **/
+  bool isLargeFoldedFile(KFileSize size) const;
+
+  /**
+   * Add a folded file to the largest ones if it is large enough.
+   **/
+  void addFoldedFile(const QString &url, KFileSize size);
+
+  /**
+   * Decide whether or not a folded file with inode 'inode' on 'device'
+   * that takes up 'size' bytes is the hard link that is counted. The
+   * folded directory 'dir' stands in for the file. See @ref addHardLink().
+   **/
+  bool addFoldedHardLink(KDirInfo *dir, dev_t device, ino_t inode,
+                         KFileSize size);
+
   /**
    * Return the tree's current selection.
    *
@@ -189,6 +387,11 @@ public:
    * KDirTree and thus other views with @ref KDirTree::selectItem().
    * Attached views should connect to the @ref
    * selectionChanged() signal to be notified when the selection changes.
+   *
+   * Deleted items are removed from the selection. The other items remain
+   * selected, but their order may change.
+   *
+   * Use @ref KFileInfo::isSelected() to check if an item is selected.
    **/
   const std::vector<KFileInfo *> & selection() const { return _selection; }
 
@@ -257,6 +460,12 @@ public:
    **/
   bool isBusy() { return _isBusy; }
 
+  /**
+   * Returns the number of directory entries read per second recently or 0
+   * if nothing is being read.
+   **/
+  int itemsPerSecond() const { return _jobQueue.itemsPerSecond(); }
+
   /**
    * Write the complete tree to a cache file.
    *
@@ -266,9 +475,33 @@ public:
 
   /**
    * Read a cache file.
+   *
+   * Directories that were not read yet when the cache file was written
+   * are read from disk afterwards.
    **/
   void readCache(const QString &cacheFileName);
 
+  /**
+   * Write the tree to the checkpoint file (see @ref checkpointFileName())
+   * as far as it is read, marking the directories that are still to be
+   * read. Reading the checkpoint file with @ref readCache() continues
+   * the scan.
+   *
+   * This is done periodically while reading if enabled in the config,
+   * and when reading is aborted. The whole tree is written in the GUI
+   * thread each time, so the user interface stalls while it is written;
+   * for a large tree, the next checkpoint is delayed accordingly.
+   *
+   * Returns true if OK, false upon error.
+   **/
+  bool writeCheckpoint();
+
+  /**
+   * Returns the name of the checkpoint file. It is removed when a scan
+   * that writes checkpoints finishes.
+   **/
+  static QString checkpointFileName();
+
 signals:
 
   /**
@@ -347,13 +580,37 @@ protected slots:
    **/
   void slotFinished();
 
+  /**
+   * Write a checkpoint if the tree can be written right now.
+   **/
+  void saveCheckpoint();
+
 protected:
   KFileInfo *_root;
   std::vector<KFileInfo *> _selection;
+  QHash<KFileInfo *, size_t> _selectionIndex; // item -> index in _selection
   KDirReadJobQueue _jobQueue;
   KDirReadMethod _readMethod;
   bool _crossFileSystems;
   bool _enableLocalDirReader;
+  bool _watchForChanges;
+  int _watchBudget;
+  KDirTreeWatcher *_watcher;
+  KHardLinkTable _hardLinks;
+  bool _useBulkStat;
+  KBulkStat *_bulkStat;
+  KBulkStatLoader *_bulkStatLoader; // until _bulkStat is taken from it
+  QThreadPool *_threadPool;
+  int _maxTreeDepth;
+  int _topFilesCount;
+  std::vector<KLargeItem> _largestFiles;       // min-heap
+  std::vector<KLargeItem> _largestDirs;        // min-heap
+  std::vector<KLargeItem> _largestFoldedFiles; // min-heap
+  bool _largeItemsIncomplete;
+  KFileTypeStats _fileTypeStats;
+  bool _saveCheckpoints;
+  int _checkpointInterval; // seconds
+  QTimer _checkpointTimer;
   bool _isFileProtocol;
   bool _isBusy;
 
@@ -13,6 +13,11 @@
 #include <QFileInfo>
 #include <ctype.h>
 #include <errno.h>
+#include <stdio.h>
+
+// Check the totals of the first directory against those stored in the
+// cache file after reading it
+#define VERBOSE_CACHE_TOTALS 0
 
 #define KB 1024
 #define MB (1024 * 1024)
@@ -20,7 +25,31 @@
 
 using namespace KDirStat;
 
+/**
+ * Returns 'true' if the contents of 'item' are not (completely) known yet,
+ * so they have to be read from disk when the cache file is read.
+ **/
+static bool isUnread(KFileInfo *item) {
+  if (!item->isDirInfo() || item->isDotEntry())
+    return false;
+
+  // A directory that is still being read from a cache file looks
+  // complete, but it may not be.
+
+  KDirReadState state = item->readState();
+
+  if (state == KDirQueued || state == KDirReading || state == KDirCached)
+    return true;
+
+  // A folded directory has its own read jobs for everything below it;
+  // its folded totals are incomplete until the last of them is done.
+
+  KDirInfo *dir = (KDirInfo *)item;
+  return dir->isFolded() && (dir->isBusy() || state == KDirAborted);
+}
+
 KCacheWriter::KCacheWriter(const QString &fileName, KDirTree *tree) {
+  _tree = tree;
   _ok = writeCache(fileName, tree);
 }
 
@@ -48,30 +77,50 @@ bool KCacheWriter::writeCache(const QString &fileName, KDirTree *tree) {
                   "# Type\tpath\t\tsize\tmtime\t\t<optional fields>\n"
                   "\n");
 
-  writeTree(cache, tree->root());
+  QString url = tree->root()->url();
+  writeTree(cache, tree->root(), url);
   gzclose(cache);
 
   return true;
 }
 
-void KCacheWriter::writeTree(gzFile cache, KFileInfo *item) {
+void KCacheWriter::writeTree(gzFile cache, KFileInfo *item, QString &url) {
   if (!item)
     return;
 
   // Write entry for this item
   if (!item->isDotEntry())
-    writeItem(cache, item);
+    writeItem(cache, item, url);
+
+  // Whatever was read so far will be read again anyway
+  if (isUnread(item))
+    return;
 
   // Write file children
   if (item->dotEntry())
-    writeTree(cache, item->dotEntry());
+    writeTree(cache, item->dotEntry(), url); // same URL as this item
 
   // Recurse through subdirectories
-  for(size_t i = 0; i < item->numChildren(); i++)
-    writeTree(cache, item->child(i));
+  int urlLength = url.length();
+
+  for(size_t i = 0; i < item->numChildren(); i++) {
+    KFileInfo *child = item->child(i);
+
+    if (child->isDirInfo()) {
+      if (url != "/") // avoid duplicating slashes
+        url += '/';
+
+      url += child->name();
+      writeTree(cache, child, url);
+      url.truncate(urlLength);
+    } else {
+      writeTree(cache, child, url); // files only use their name
+    }
+  }
 }
 
-void KCacheWriter::writeItem(gzFile cache, KFileInfo *item) {
+void KCacheWriter::writeItem(gzFile cache, KFileInfo *item,
+                             const QString &url) {
   if (!item)
     return;
 
@@ -100,8 +149,7 @@ void KCacheWriter::writeItem(gzFile cache, KFileInfo *item) {
   if (item->isDirInfo() && !item->isDotEntry()) {
     // Use absolute path
 
-    gzprintf(cache, " %s",
-             QUrl::toPercentEncoding(item->url(), "/").constData());
+    gzprintf(cache, " %s", QUrl::toPercentEncoding(url, "/").constData());
   } else {
     // Use relative path
 
@@ -110,7 +158,7 @@ void KCacheWriter::writeItem(gzFile cache, KFileInfo *item) {
 
   // Write size
 
-  gzprintf(cache, "\t%s", formatSize(item->byteSize()).toLocal8Bit().constData());
+  writeSize(cache, item->byteSize());
 
   // Write mtime
 
@@ -120,12 +168,58 @@ void KCacheWriter::writeItem(gzFile cache, KFileInfo *item) {
 
   gzprintf(cache, "\tblocks: %lld", item->blocks());
 
-  if (item->isFile() && item->links() > 1)
+  if (item->isFile() && item->links() > 1) {
     gzprintf(cache, "\tlinks: %u", (unsigned)item->links());
 
+    // Which of the links is counted; without this, readers count a share
+    // of the size for each link.
+    if (item->hardLinkState() != KHardLinkUnknown)
+      gzprintf(cache, "\tcounted: %d",
+               item->hardLinkState() == KHardLinkCounted ? 1 : 0);
+
+    // The inode, so the reader can add the link to the tree's hard link
+    // table and it is still counted only once after a refresh
+    dev_t device;
+    ino_t inode;
+
+    if (_tree->hardLinkInode(item, device, inode))
+      gzprintf(cache, "\tdev: %llu\tino: %llu", (unsigned long long)device,
+               (unsigned long long)inode);
+  }
+
+  if (item->isDirInfo()) {
+    // Aggregates; readers that don't know them simply skip them
+    gzprintf(cache, "\titems: %lld\tsubdirs: %lld\tfiles: %lld",
+             item->totalItems(), item->totalSubDirs(), item->totalFiles());
+
+    if (isUnread(item)) {
+      gzprintf(cache, "\tunread: 1");
+    } else if (((KDirInfo *)item)->isFolded()) {
+      // Size, shared size, items, subdirs, files and latest mtime of the
+      // contents that are not in the tree
+      const KDirInfo::Folded *folded = ((KDirInfo *)item)->folded();
+
+      gzprintf(cache, "\tfolded: %lld,%lld,%lld,%lld,%lld,0x%lx",
+               folded->size, folded->sharedSize, folded->items,
+               folded->subDirs, folded->files,
+               (unsigned long)folded->latestMtime);
+    }
+  }
+
   gzputc(cache, '\n');
 }
 
+void KCacheWriter::writeSize(gzFile cache, KFileSize size) {
+  if (size >= GB && size % GB == 0)
+    gzprintf(cache, "\t%lldG", size / GB);
+  else if (size >= MB && size % MB == 0)
+    gzprintf(cache, "\t%lldM", size / MB);
+  else if (size >= KB && size % KB == 0)
+    gzprintf(cache, "\t%lldK", size / KB);
+  else
+    gzprintf(cache, "\t%lld", size);
+}
+
 QString KCacheWriter::formatSize(KFileSize size) {
   if (size >= GB && size % GB == 0) {
     return QString("%1G").arg(size / GB);
@@ -154,6 +248,9 @@ KCacheReader::KCacheReader(const QString &fileName, KDirTree *tree,
   _toplevel = parent;
   _lastDir = 0;
   _lastExcludedDir = 0;
+  _firstDir = 0;
+  _firstDirSubDirs = -1;
+  _firstDirFiles = -1;
 
   _cache = gzopen(fileName.toLocal8Bit(), "r");
 
@@ -182,6 +279,18 @@ static void setStateRecursive(KDirInfo * root) {
 
 KCacheReader::~KCacheReader() {
   setStateRecursive(_toplevel);
+
+  // Continue where reading stopped when the cache file was written
+
+  foreach (KDirInfo *dir, _unreadDirs) {
+    dir->setReadState(KDirQueued);
+
+    if (_tree->readMethod() == KDirReadKIO)
+      _tree->addJob(new KioDirReadJob(_tree, dir));
+    else
+      _tree->addJob(new KLocalDirReadJob(_tree, dir));
+  }
+
   if (_cache)
     gzclose(_cache);
 
@@ -190,6 +299,19 @@ KCacheReader::~KCacheReader() {
   if (_toplevel)
     _toplevel->finalizeAll(_tree);
 
+#if VERBOSE_CACHE_TOTALS
+  if (_firstDir && _firstDirFiles >= 0) {
+    if (_firstDir->totalSubDirs() != _firstDirSubDirs ||
+        _firstDir->totalFiles() != _firstDirFiles)
+      qWarning() << _fileName << ": Expected" << _firstDirSubDirs
+                 << "subdirs and" << _firstDirFiles << "files, got"
+                 << _firstDir->totalSubDirs() << "and"
+                 << _firstDir->totalFiles() << Qt::endl;
+    else
+      qDebug() << _fileName << ": Totals OK" << Qt::endl;
+  }
+#endif
+
   emit finished();
 }
 
@@ -225,6 +347,13 @@ void KCacheReader::addItem() {
   char *mtime_str = field(n++);
   char *blocks_str = 0;
   char *links_str = 0;
+  char *counted_str = 0;
+  char *dev_str = 0;
+  char *ino_str = 0;
+  char *subdirs_str = 0;
+  char *files_str = 0;
+  char *unread_str = 0;
+  char *folded_str = 0;
 
   while (fieldsCount() > n + 1) {
     char *keyword = field(n++);
@@ -234,6 +363,20 @@ void KCacheReader::addItem() {
       blocks_str = val_str;
     if (strcasecmp(keyword, "links:") == 0)
       links_str = val_str;
+    if (strcasecmp(keyword, "counted:") == 0)
+      counted_str = val_str;
+    if (strcasecmp(keyword, "dev:") == 0)
+      dev_str = val_str;
+    if (strcasecmp(keyword, "ino:") == 0)
+      ino_str = val_str;
+    if (strcasecmp(keyword, "subdirs:") == 0)
+      subdirs_str = val_str;
+    if (strcasecmp(keyword, "files:") == 0)
+      files_str = val_str;
+    if (strcasecmp(keyword, "unread:") == 0)
+      unread_str = val_str;
+    if (strcasecmp(keyword, "folded:") == 0)
+      folded_str = val_str;
   }
 
   // Type
@@ -295,7 +438,8 @@ void KCacheReader::addItem() {
 
   //
   // Create a new item
-  QFileInfo fileInfo(QUrl::fromPercentEncoding(raw_path));
+  QString fullPath = QUrl::fromPercentEncoding(raw_path);
+  QFileInfo fileInfo(fullPath);
   QString path, name;
   if (_tree->root()) {
     path = fileInfo.dir().path();
@@ -344,9 +488,29 @@ void KCacheReader::addItem() {
     dir->setReadState(KDirCached);
     _lastDir = dir;
 
+    if (!_firstDir) {
+      // The stored totals are only checked for the first directory
+      _firstDir = dir;
+      _firstDirSubDirs = subdirs_str ? strtoll(subdirs_str, 0, 10) : -1;
+      _firstDirFiles = files_str ? strtoll(files_str, 0, 10) : -1;
+    }
+
     if (parent)
       parent->insertChild(dir);
 
+    // After inserting it: Its parent gets these from propagateDeltas()
+    if (folded_str) {
+      KDirInfo::Folded folded;
+      unsigned long latestMtime = 0;
+
+      if (sscanf(folded_str, "%lld,%lld,%lld,%lld,%lld,0x%lx", &folded.size,
+                 &folded.sharedSize, &folded.items, &folded.subDirs,
+                 &folded.files, &latestMtime) == 6) {
+        folded.latestMtime = (time_t)latestMtime;
+        dir->addFolded(folded);
+      }
+    }
+
     if (!_tree->root()) {
       _tree->setRoot(dir);
       _toplevel = dir;
@@ -358,7 +522,10 @@ void KCacheReader::addItem() {
     _tree->childAddedNotify(dir);
 
     if (dir != _toplevel) {
-      if (KExcludeRules::excludeRules()->match(dir->url())) {
+      // Using the path from the cache rather than dir->url() which
+      // would have to walk up all the way to the root.
+
+      if (KExcludeRules::excludeRules()->match(fullPath)) {
         // qDebug() << "Excluding " << name << endl;
         dir->setExcluded();
         dir->setReadState(KDirOnRequestOnly);
@@ -366,10 +533,13 @@ void KCacheReader::addItem() {
         dir->finalizeLocal();
 
         _lastExcludedDir = dir;
-        _lastExcludedDirUrl = _lastExcludedDir->url();
+        _lastExcludedDirUrl = fullPath;
         _lastDir = 0;
       }
     }
+
+    if (unread_str && atoi(unread_str) && !dir->isExcluded())
+      _unreadDirs.append(dir);
   } else {
     if (parent) {
       // qDebug() << "Creating KFileInfo for " << parent->debugUrl() << "/" <<
@@ -377,6 +547,17 @@ void KCacheReader::addItem() {
 
       KFileInfo *item =
           new KFileInfo(parent, name, mode, size, mtime, blocks, links);
+
+      if (ino_str && links > 1) {
+        // Just like the ones that are read from disk, so another link of
+        // the same inode that is read later is not counted again
+        item->setDevice((dev_t)strtoull(dev_str ? dev_str : "0", 0, 10));
+        _tree->addHardLink(item, (ino_t)strtoull(ino_str, 0, 10));
+      } else if (counted_str && links > 1) {
+        item->setHardLinkState(atoi(counted_str) ? KHardLinkCounted
+                                                 : KHardLinkOther);
+      }
+
       parent->insertChild(item);
       _tree->childAddedNotify(item);
     } else {
@@ -25,6 +25,10 @@ public:
    * Write 'tree' to file 'fileName' in gzip format (using zlib).
    *
    * Check CacheWriter::ok() to see if writing the cache file went OK.
+   *
+   * Directories that are not completely read yet are written without
+   * their contents and marked as unread, so @ref KCacheReader can read
+   * them from disk.
    **/
   KCacheWriter(const QString &fileName, KDirTree *tree);
 
@@ -55,22 +59,41 @@ protected:
   /**
    * Write 'item' recursively to cache file 'cache'.
    * Uses zlib to write gzip-compressed files.
+   *
+   * 'url' is the URL of 'item'. It is extended and truncated again for
+   * each subdirectory on the way down, so no URL has to be built from
+   * scratch for any item.
    **/
-  void writeTree(gzFile cache, KFileInfo *item);
+  void writeTree(gzFile cache, KFileInfo *item, QString &url);
 
   /**
-   * Write 'item' to cache file 'cache' without recursion.
+   * Write 'item' to cache file 'cache' without recursion. 'url' is the
+   * URL of 'item'.
    * Uses zlib to write gzip-compressed files.
    **/
-  void writeItem(gzFile cache, KFileInfo *item);
+  void writeItem(gzFile cache, KFileInfo *item, const QString &url);
+
+  /**
+   * Write a file size like formatSize() does, but without creating any
+   * strings.
+   **/
+  void writeSize(gzFile cache, KFileSize size);
 
   //
   // Data members
   //
 
   bool _ok;
+  KDirTree *_tree;
 };
 
+/**
+ * Reads a cache file written by @ref KCacheWriter into a tree.
+ *
+ * Directories that were not read yet when the cache file was written
+ * (see @ref KDirTree::writeCheckpoint()) are queued for reading from disk
+ * when the cache file is done, so an interrupted scan simply continues.
+ **/
 class KCacheReader : public QObject {
   Q_OBJECT
 
@@ -219,6 +242,10 @@ protected:
   KDirInfo *_lastDir;
   KDirInfo *_lastExcludedDir;
   QString _lastExcludedDirUrl;
+  KDirInfo *_firstDir;
+  KFileCount _firstDirSubDirs; // -1 if not in the cache file
+  KFileCount _firstDirFiles;
+  QList<KDirInfo *> _unreadDirs; // to be read from disk after the cache
 };
 
 } // namespace KDirStat
@@ -737,11 +737,18 @@ void KDirTreeView::sendProgressInfo(const QString &newCurrentDir) {
   _currentDir = newCurrentDir;
 
 #if VERBOSE_PROGRESS_INFO
-  emit progressInfo(i18n("Elapsed time: %1   reading directory %2",
-                         formatTime(_stopWatch.elapsed()), _currentDir));
+  QString info = i18n("Elapsed time: %1   reading directory %2",
+                      formatTime(_stopWatch.elapsed()), _currentDir);
 #else
-  emit progressInfo(i18n("Elapsed time: %1", formatTime(_stopWatch.elapsed())));
+  QString info = i18n("Elapsed time: %1", formatTime(_stopWatch.elapsed()));
 #endif
+
+  int rate = _tree->itemsPerSecond();
+
+  if (rate > 0)
+    info += i18n("   %1 items/s", rate);
+
+  emit progressInfo(info);
 }
 
 void KDirTreeView::fileSelectionChanged(const QItemSelection &, const QItemSelection &) {
@@ -912,7 +919,7 @@ void KDirTreeView::popupContextMenu(const QPoint &localPos) {
       QString text;
 
       if (rule) {
-        text = i18n("Matching exclude rule:   %1", rule->regexp().pattern());
+        text = i18n("Matching exclude rule:   %1", rule->text());
       } else {
         text = i18n("<Unknown exclude rule>");
       }
@@ -960,7 +967,18 @@ void KDirTreeView::popupContextMenu(const QPoint &localPos) {
 
   if (column == _totalSizeCol &&
       (orig->isDir() || orig->isDotEntry())) {
-    popupContextSizeInfo(pos, orig->totalSize());
+    KFileSize shared = orig->sharedSize();
+
+    if (shared > 0) {
+      // Some of it may not be freed by removing this subtree
+      popupContextInfo(
+          pos, i18n("%1 (%2 Bytes) -- unique: %3, shared via hard links: %4",
+                    formatSize(orig->totalSize()),
+                    formatSizeLong(orig->totalSize()),
+                    formatSize(orig->uniqueSize()), formatSize(shared)));
+    } else {
+      popupContextSizeInfo(pos, orig->totalSize());
+    }
   }
 
   // Show alternate time / date format in time / date related columns.
@@ -1134,7 +1152,7 @@ QString formatTime(long millisec, bool showMilliSeconds) {
   return formattedTime;
 }
 
-QString formatCount(int count, bool suppressZero) {
+QString formatCount(KFileCount count, bool suppressZero) {
   if (suppressZero && count == 0)
     return "";
 
@@ -505,7 +505,7 @@ QString formatTime(long millisec, bool showMilliSeconds = false);
  * Returns an empty string if 'suppressZero' is 'true' and the value of
  * 'count' is 0.
  **/
-QString formatCount(int count, bool suppressZero = false);
+QString formatCount(KFileCount count, bool suppressZero = false);
 
 /**
  * Format percentages.
@@ -0,0 +1,310 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <QList>
+#include <QSocketNotifier>
+
+#include "kdirtree.h"
+#include "kdirtreewatcher.h"
+
+#define BATCH_DELAY 1000           // millisec
+#define MAX_CHANGES_PER_DIR 1000   // more than that: read the directory again
+#define VERBOSE_WATCH 0
+
+#define WATCH_MASK                                                             \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |           \
+   IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR |               \
+   IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+using namespace KDirStat;
+
+KDirTreeWatcher::KDirTreeWatcher(KDirTree *tree, int budget)
+    : QObject(tree), _tree(tree), _budget(budget), _notifier(0),
+      _rescanAll(false), _budgetWarned(false) {
+  _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (_fd < 0) {
+    qWarning() << "inotify_init1() failed:" << strerror(errno)
+               << "- not watching for changes" << Qt::endl;
+  } else {
+    _notifier = new QSocketNotifier(_fd, QSocketNotifier::Read, this);
+    connect(_notifier, SIGNAL(activated(int)), this, SLOT(readEvents()));
+  }
+
+  _batchTimer.setSingleShot(true);
+  _batchTimer.setInterval(BATCH_DELAY);
+  connect(&_batchTimer, SIGNAL(timeout()), this, SLOT(applyChanges()));
+
+  connect(tree, SIGNAL(deletingChild(KFileInfo *)), this,
+          SLOT(deletingChild(KFileInfo *)));
+}
+
+KDirTreeWatcher::~KDirTreeWatcher() {
+  delete _notifier;
+
+  if (_fd >= 0)
+    close(_fd); // This removes all watches, too
+}
+
+void KDirTreeWatcher::watchTree() {
+  if (_fd < 0 || !_tree->root() || !_tree->root()->isDirInfo())
+    return;
+
+  // Breadth first: If the budget doesn't suffice, the directories near
+  // the root are the more interesting ones.
+
+  QList<KDirInfo *> queue;
+  queue.append((KDirInfo *)_tree->root());
+
+  while (!queue.isEmpty() && _dirs.size() < _budget) {
+    KDirInfo *dir = queue.takeFirst();
+
+    // Directories that are excluded, not read or still being read are
+    // left alone.
+    if (dir->readState() != KDirFinished)
+      continue;
+
+    if (!_watches.contains(dir) && !addWatch(dir))
+      return;
+
+    for (size_t i = 0; i < dir->numChildren(); i++) {
+      KFileInfo *child = dir->child(i);
+
+      if (child->isDirInfo() && !child->isDotEntry())
+        queue.append((KDirInfo *)child);
+    }
+  }
+
+  if (!queue.isEmpty() && !_budgetWarned) {
+    qWarning() << "Watching" << _dirs.size()
+               << "directories; changes in others are not noticed"
+               << Qt::endl;
+    _budgetWarned = true;
+  }
+}
+
+bool KDirTreeWatcher::addWatch(KDirInfo *dir) {
+  int wd = inotify_add_watch(_fd, dir->url().toLocal8Bit(), WATCH_MASK);
+
+  if (wd < 0) {
+    if (errno == ENOSPC) // The kernel's limit for this user
+    {
+      if (!_budgetWarned) {
+        qWarning() << "No more inotify watches after" << _dirs.size()
+                   << "directories" << Qt::endl;
+        _budgetWarned = true;
+      }
+
+      return false;
+    }
+
+    // Most likely, the directory is gone already; that event is on its way.
+    return true;
+  }
+
+  // The same directory may show up twice, e.g. with bind mounts. Its
+  // events go to the first one.
+
+  if (!_dirs.contains(wd)) {
+    _dirs.insert(wd, dir);
+    _watches.insert(dir, wd);
+  }
+
+  return true;
+}
+
+void KDirTreeWatcher::readEvents() {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *ptr = buffer; ptr < buffer + len;) {
+      struct inotify_event *event = (struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        qWarning() << "Too many changes to keep up with; reading everything "
+                      "again"
+                   << Qt::endl;
+        _rescanAll = true;
+      } else if (event->mask & IN_IGNORED) {
+        // The watch is gone with its directory; the tree learns about that
+        // from the parent directory's watch.
+
+        KDirInfo *dir = _dirs.take(event->wd);
+
+        if (dir)
+          _watches.remove(dir);
+      } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        KDirInfo *dir = _dirs.value(event->wd);
+
+        // Nobody watches the root's parent directory.
+        if (dir && dir == _tree->root())
+          _pendingRescans.insert(dir);
+      } else if (event->len > 0) {
+        addChange(event->wd, QString::fromLocal8Bit(event->name));
+      }
+    }
+  }
+
+  if (len < 0 && errno != EAGAIN && errno != EINTR)
+    qWarning() << "Reading inotify events failed:" << strerror(errno)
+               << Qt::endl;
+
+  if (!_batchTimer.isActive() &&
+      (_rescanAll || !_pendingRescans.isEmpty() || !_pendingChanges.isEmpty()))
+    _batchTimer.start();
+}
+
+void KDirTreeWatcher::addChange(int wd, const QString &name) {
+  KDirInfo *dir = _dirs.value(wd);
+
+  if (!dir || _pendingRescans.contains(dir))
+    return;
+
+  // A folded directory has no children in the tree to update, only its
+  // summary: Read it again.
+  if (dir->isFolded()) {
+    _pendingChanges.remove(dir);
+    _pendingRescans.insert(dir);
+    return;
+  }
+
+  QSet<QString> &names = _pendingChanges[dir];
+  names.insert(name);
+
+  if (names.size() > MAX_CHANGES_PER_DIR) {
+    // Just as well read it all again
+    _pendingChanges.remove(dir);
+    _pendingRescans.insert(dir);
+  }
+}
+
+void KDirTreeWatcher::applyChanges() {
+  if (_tree->isBusy()) {
+    _batchTimer.start(); // Try again later
+    return;
+  }
+
+  if (_rescanAll || _pendingRescans.contains((KDirInfo *)_tree->root())) {
+    // This deletes the old tree; deletingChild() takes care of the rest.
+    _tree->refresh(0);
+    return;
+  }
+
+#if VERBOSE_WATCH
+  qDebug() << "Applying changes in" << _pendingChanges.size()
+           << "directories, reading" << _pendingRescans.size() << "again"
+           << Qt::endl;
+#endif
+
+  // Only read a directory again if no ancestor is read again anyway, and
+  // drop any changes inside those. Look them all up before refreshing
+  // anything: Refreshing deletes the old subtree.
+
+  QSet<KDirInfo *> rescans;
+  _applying = _pendingChanges;
+  _pendingChanges.clear();
+
+  foreach (KDirInfo *dir, _pendingRescans) {
+    KDirInfo *ancestor = dir->parent();
+
+    while (ancestor && !_pendingRescans.contains(ancestor))
+      ancestor = ancestor->parent();
+
+    if (!ancestor)
+      rescans.insert(dir);
+  }
+
+  _pendingRescans.clear();
+
+  if (!rescans.isEmpty()) {
+    for (auto it = _applying.begin(); it != _applying.end();) {
+      KDirInfo *ancestor = it.key();
+
+      while (ancestor && !rescans.contains(ancestor))
+        ancestor = ancestor->parent();
+
+      if (ancestor)
+        it = _applying.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  foreach (KDirInfo *dir, rescans)
+    _tree->refresh(dir);
+
+  // Updating a directory may delete others that are still in the batch;
+  // deletingChild() removes those from it.
+
+  while (!_applying.isEmpty()) {
+    auto it = _applying.begin();
+    KDirInfo *dir = it.key();
+    QSet<QString> names = it.value();
+    _applying.erase(it);
+
+    _tree->updateChildren(dir, names);
+  }
+}
+
+void KDirTreeWatcher::deletingChild(KFileInfo *subtree) {
+  if (subtree == _tree->root()) {
+    forgetAll();
+    return;
+  }
+
+  if (_watches.isEmpty() || !subtree->isDirInfo() || subtree->isDotEntry())
+    return;
+
+  QList<KDirInfo *> dirs;
+  dirs.append((KDirInfo *)subtree);
+
+  while (!dirs.isEmpty()) {
+    KDirInfo *dir = dirs.takeLast();
+    forget(dir);
+
+    for (size_t i = 0; i < dir->numChildren(); i++) {
+      KFileInfo *child = dir->child(i);
+
+      if (child->isDirInfo() && !child->isDotEntry())
+        dirs.append((KDirInfo *)child);
+    }
+  }
+}
+
+void KDirTreeWatcher::forget(KDirInfo *dir) {
+  if (_watches.contains(dir)) {
+    int wd = _watches.take(dir);
+    _dirs.remove(wd);
+    inotify_rm_watch(_fd, wd);
+  }
+
+  _pendingChanges.remove(dir);
+  _pendingRescans.remove(dir);
+  _applying.remove(dir);
+}
+
+void KDirTreeWatcher::forgetAll() {
+  foreach (int wd, _dirs.keys())
+    inotify_rm_watch(_fd, wd);
+
+  _dirs.clear();
+  _watches.clear();
+  _pendingChanges.clear();
+  _pendingRescans.clear();
+  _applying.clear();
+  _rescanAll = false;
+  _budgetWarned = false;
+  _batchTimer.stop();
+}
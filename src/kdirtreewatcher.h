@@ -0,0 +1,132 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QTimer>
+
+class QSocketNotifier;
+
+namespace KDirStat {
+// Forward declarations
+class KDirTree;
+class KDirInfo;
+class KFileInfo;
+
+/**
+ * Keeps a local directory tree up to date after it has been read: Each
+ * directory gets an inotify watch, and the changes reported for it are
+ * collected for a moment and then applied to the tree with @ref
+ * KDirTree::updateChildren(), so only the entries that actually changed
+ * are deleted from the tree and added again.
+ *
+ * The kernel limits the number of watches per user, so at most 'budget'
+ * directories are watched, the ones nearest to the root first. Changes
+ * further down go unnoticed until the next refresh.
+ *
+ * If too many changes pile up in one directory, that directory is simply
+ * read again, just like a folded directory (see @ref KDirInfo::isFolded())
+ * with any change at all. If the kernel's event queue overflows, nobody can tell
+ * which directories are affected, so the complete tree is read again.
+ *
+ * Changes are not applied while the tree is busy reading; they wait for
+ * the next batch.
+ *
+ * @short Live update of a directory tree
+ **/
+class KDirTreeWatcher : public QObject {
+  Q_OBJECT
+
+public:
+  /**
+   * Constructor. Nothing is watched until @ref watchTree() is called.
+   **/
+  KDirTreeWatcher(KDirTree *tree, int budget);
+
+  /**
+   * Destructor.
+   **/
+  virtual ~KDirTreeWatcher();
+
+  /**
+   * Add watches for all directories of the tree that are completely read
+   * and not watched yet, as far as the budget allows.
+   **/
+  void watchTree();
+
+  /**
+   * Set the maximum number of directories to watch. Directories that are
+   * already watched stay watched.
+   **/
+  void setBudget(int budget) { _budget = budget; }
+
+  /**
+   * Returns the number of directories currently watched.
+   **/
+  int watchCount() const { return _dirs.size(); }
+
+protected slots:
+  /**
+   * Read the events that are ready and add them to the current batch.
+   **/
+  void readEvents();
+
+  /**
+   * Apply the current batch to the tree.
+   **/
+  void applyChanges();
+
+  /**
+   * Forget about the directories in 'subtree'.
+   **/
+  void deletingChild(KFileInfo *subtree);
+
+protected:
+  /**
+   * Add a watch for 'dir'. Returns 'false' if no more watches can be
+   * added at all.
+   **/
+  bool addWatch(KDirInfo *dir);
+
+  /**
+   * Forget about 'dir': Remove its watch and its pending changes.
+   **/
+  void forget(KDirInfo *dir);
+
+  /**
+   * Remove all watches and pending changes.
+   **/
+  void forgetAll();
+
+  /**
+   * Make a note that 'name' in the directory watched by 'wd' changed.
+   **/
+  void addChange(int wd, const QString &name);
+
+  KDirTree *_tree;
+  int _budget;
+  int _fd;
+  QSocketNotifier *_notifier;
+  QHash<int, KDirInfo *> _dirs;    // watch descriptor -> directory
+  QHash<KDirInfo *, int> _watches; // directory -> watch descriptor
+
+  // The current batch
+  QHash<KDirInfo *, QSet<QString>> _pendingChanges;
+  QSet<KDirInfo *> _pendingRescans;
+  bool _rescanAll;
+
+  // What is left of the batch that is being applied
+  QHash<KDirInfo *, QSet<QString>> _applying;
+
+  QTimer _batchTimer;
+  bool _budgetWarned;
+};
+
+} // namespace KDirStat
@@ -6,11 +6,245 @@
 
 #include "kexcluderules.h"
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QMutexLocker>
 
-#define VERBOSE_EXCLUDE_MATCHES 1
+#include <atomic>
+
+#define VERBOSE_EXCLUDE_MATCHES 0
+
+// Check each path against both the compiled rules and the plain loop over
+// all rules and report how long each of them took.
+#define VERBOSE_EXCLUDE_TIMING 0
 
 using namespace KDirStat;
 
+/**
+ * If 'pattern' only matches one literal text, store that text in 'literal'
+ * and return 'true'. Escaped characters like "\\." count as literal
+ * characters; anything else with a special meaning doesn't.
+ **/
+static bool literalText(const QString &pattern, QString *literal) {
+  static const QString specialChars("^$.|?*+()[]{}");
+  QString text;
+
+  for (int i = 0; i < pattern.length(); i++) {
+    QChar c = pattern[i];
+
+    if (c == '\\') {
+      if (++i >= pattern.length() || pattern[i].isLetterOrNumber())
+        return false; // "\d", "\1" etc. or a trailing backslash
+
+      text += pattern[i];
+    } else if (specialChars.contains(c)) {
+      return false;
+    } else {
+      text += c;
+    }
+  }
+
+  *literal = text;
+  return true;
+}
+
+/**
+ * Insert 'value' into the sorted list 'list' unless it is already there.
+ * Returns 'false' if it was.
+ **/
+template <class List> static bool insertSorted(List &list, int value) {
+  int i = 0;
+
+  while (i < list.size() && list[i] < value)
+    i++;
+
+  if (i < list.size() && list[i] == value)
+    return false;
+
+  list.insert(i, value);
+  return true;
+}
+
+/**
+ * Find the ']' that closes the character class starting at 'pos' in a
+ * glob pattern. Returns -1 if there is none.
+ **/
+static int classEnd(const QString &pattern, int pos) {
+  int i = pos + 1;
+
+  if (i < pattern.length() && (pattern[i] == '!' || pattern[i] == '^'))
+    i++;
+
+  if (i < pattern.length() && pattern[i] == ']') // "[]...]"
+    i++;
+
+  while (i < pattern.length() && pattern[i] != ']')
+    i++;
+
+  return i < pattern.length() ? i : -1;
+}
+
+/**
+ * Check 'c' against the character class between 'begin' and 'end'
+ * (without the brackets).
+ **/
+static bool classMatches(const QString &pattern, int begin, int end, QChar c) {
+  bool negate = pattern[begin] == '!' || pattern[begin] == '^';
+  bool matched = false;
+
+  if (negate)
+    begin++;
+
+  for (int i = begin; i < end; i++) {
+    if (i + 2 < end && pattern[i + 1] == '-') {
+      if (c >= pattern[i] && c <= pattern[i + 2])
+        matched = true;
+
+      i += 2;
+    } else if (c == pattern[i]) {
+      matched = true;
+    }
+  }
+
+  return matched != negate;
+}
+
+/**
+ * Match 'name' from position 'n' on against the glob 'pattern' from
+ * position 'pos' on.
+ **/
+static bool wildcardMatch(const QString &pattern, int pos, const QString &name,
+                          int n) {
+  while (pos < pattern.length()) {
+    QChar c = pattern[pos];
+
+    if (c == '*') {
+      while (pos < pattern.length() && pattern[pos] == '*')
+        pos++;
+
+      if (pos == pattern.length())
+        return true;
+
+      for (int i = n; i <= name.length(); i++) {
+        if (wildcardMatch(pattern, pos, name, i))
+          return true;
+      }
+
+      return false;
+    }
+
+    if (n >= name.length())
+      return false;
+
+    if (c == '?') {
+      pos++;
+      n++;
+      continue;
+    }
+
+    if (c == '[') {
+      int end = classEnd(pattern, pos);
+
+      if (end > 0) {
+        if (!classMatches(pattern, pos + 1, end, name[n]))
+          return false;
+
+        pos = end + 1;
+        n++;
+        continue;
+      }
+
+      // No closing bracket: Take the '[' literally
+    }
+
+    if (c == '\\' && pos + 1 < pattern.length())
+      c = pattern[++pos];
+
+    if (c != name[n])
+      return false;
+
+    pos++;
+    n++;
+  }
+
+  return n == name.length();
+}
+
+/**
+ * Returns 'true' if the glob path component 'text' contains wildcards.
+ **/
+static bool hasWildcards(const QString &text) {
+  for (int i = 0; i < text.length(); i++) {
+    if (text[i] == '\\')
+      i++;
+    else if (text[i] == '*' || text[i] == '?' || text[i] == '[')
+      return true;
+  }
+
+  return false;
+}
+
+/**
+ * Remove the backslashes from the glob path component 'text'.
+ **/
+static QString unescaped(const QString &text) {
+  QString result;
+
+  for (int i = 0; i < text.length(); i++) {
+    if (text[i] == '\\' && i + 1 < text.length())
+      i++;
+
+    result += text[i];
+  }
+
+  return result;
+}
+
+/**
+ * Match the path components 'components' from 'comp' on against the glob
+ * rule segments 'segments' from 'seg' on.
+ **/
+static bool matchSegments(const QVector<KExcludeGlobSegment> &segments,
+                          int seg, const QStringList &components, int comp) {
+  if (seg == segments.size())
+    return comp == components.size();
+
+  if (segments[seg].kind == KExcludeGlobSegment::AnyDepth) {
+    if (seg + 1 == segments.size()) // "foo/**" matches below "foo" only
+      return comp < components.size();
+
+    for (int i = comp; i <= components.size(); i++) {
+      if (matchSegments(segments, seg + 1, components, i))
+        return true;
+    }
+
+    return false;
+  }
+
+  return comp < components.size() &&
+         segments[seg].matches(components[comp]) &&
+         matchSegments(segments, seg + 1, components, comp + 1);
+}
+
+/**
+ * Append 'name' to the directory path 'path'.
+ **/
+static QString childPath(const QString &path, const QString &name) {
+  if (path.endsWith('/'))
+    return path + name;
+
+  return path + "/" + name;
+}
+
+bool KExcludeGlobSegment::matches(const QString &name) const {
+  if (kind == Literal)
+    return name == text;
+
+  if (kind == Wildcard)
+    return wildcardMatch(text, 0, name, 0);
+
+  return false;
+}
+
 KExcludeRule::KExcludeRule(const QRegExp &regexp)
     : _regexp(regexp), _enabled(true) {
   // NOP
@@ -20,10 +254,71 @@ KExcludeRule::~KExcludeRule() {
   // NOP
 }
 
+KExcludeRule *KExcludeRule::fromText(const QString &text) {
+  if (!text.startsWith("glob:"))
+    return new KExcludeRule(QRegExp(text));
+
+  QString glob = text.mid(5).trimmed();
+
+  if (glob.isEmpty())
+    return 0;
+
+  KExcludeRule *rule = new KExcludeRule(QRegExp());
+  rule->setGlob(glob);
+
+  return rule;
+}
+
+QString KExcludeRule::text() const {
+  if (isGlob())
+    return "glob:" + _glob;
+
+  return _regexp.pattern();
+}
+
+void KExcludeRule::setGlob(const QString &glob) {
+  _glob = glob;
+  _globSegments.clear();
+
+  QString pattern = glob;
+
+  while (pattern.length() > 1 && pattern.endsWith('/'))
+    pattern.chop(1);
+
+  if (!pattern.startsWith('/')) {
+    KExcludeGlobSegment anyDepth = {KExcludeGlobSegment::AnyDepth, QString()};
+    _globSegments.append(anyDepth);
+  }
+
+  foreach (const QString &component, pattern.split('/', Qt::SkipEmptyParts)) {
+    KExcludeGlobSegment segment;
+
+    if (component == "**") {
+      if (!_globSegments.isEmpty() &&
+          _globSegments.last().kind == KExcludeGlobSegment::AnyDepth)
+        continue;
+
+      segment.kind = KExcludeGlobSegment::AnyDepth;
+    } else if (hasWildcards(component)) {
+      segment.kind = KExcludeGlobSegment::Wildcard;
+      segment.text = component;
+    } else {
+      segment.kind = KExcludeGlobSegment::Literal;
+      segment.text = unescaped(component);
+    }
+
+    _globSegments.append(segment);
+  }
+}
+
 bool KExcludeRule::match(const QString &text) {
   if (text.isEmpty() || !_enabled)
     return false;
 
+  if (isGlob())
+    return matchSegments(_globSegments, 0,
+                         text.split('/', Qt::SkipEmptyParts), 0);
+
   return _regexp.exactMatch(text);
 }
 
@@ -43,29 +338,328 @@ KExcludeRules *KExcludeRules::excludeRules() {
 }
 
 void KExcludeRules::add(KExcludeRule *rule) {
-  if (rule)
+  if (rule) {
     _rules.append(rule);
+    compile();
+  }
+}
+
+void KExcludeRules::clear() {
+  qDeleteAll(_rules);
+  _rules.clear();
+  compile();
+}
+
+void KExcludeRules::compile() {
+  _literals.clear();
+  _prefixes.clear();
+  _suffixes.clear();
+  _prefixLengths.clear();
+  _suffixLengths.clear();
+  _fallbackRules.clear();
+  _segments.clear();
+  _startPositions.clear();
+  _anyDepthNames.clear();
+  _generation++;
+
+  static const QRegularExpression backReference("\\\\[1-9]");
+  QStringList alternatives;
+
+  foreach (KExcludeRule *rule, _rules) {
+    QRegExp regexp = rule->regexp();
+
+    if (!rule->isEnabled())
+      continue;
+
+    if (rule->isGlob()) {
+      compileGlob(rule);
+      continue;
+    }
+
+    if (!regexp.isValid())
+      continue; // Can never match anyway
+
+    if ((regexp.patternSyntax() != QRegExp::RegExp &&
+         regexp.patternSyntax() != QRegExp::RegExp2) ||
+        regexp.caseSensitivity() != Qt::CaseSensitive) {
+      _fallbackRules.append(rule);
+      continue;
+    }
+
+    QString pattern = regexp.pattern();
+    QString literal;
+
+    if (literalText(pattern, &literal)) {
+      _literals.insert(literal);
+    } else if (pattern.endsWith(".*") &&
+               literalText(pattern.left(pattern.length() - 2), &literal)) {
+      _prefixes.insert(literal);
+      insertSorted(_prefixLengths, literal.length());
+    } else if (pattern.startsWith(".*") && literalText(pattern.mid(2),
+                                                       &literal)) {
+      _suffixes.insert(literal);
+      insertSorted(_suffixLengths, literal.length());
+    } else if (pattern.contains(backReference) ||
+               !QRegularExpression(pattern).isValid()) {
+      // Back references would refer to the wrong group in the combined
+      // expression, and a few QRegExp patterns are not valid in PCRE.
+      _fallbackRules.append(rule);
+    } else {
+      alternatives << "(?:" + pattern + ")";
+    }
+  }
+
+  _haveCombined = !alternatives.isEmpty();
+
+  if (_haveCombined) {
+    // QRegExp's '.' also matches newlines.
+    _combined = QRegularExpression(
+        "\\A(?:" + alternatives.join('|') + ")\\z",
+        QRegularExpression::DotMatchesEverythingOption);
+    _combined.optimize();
+  } else {
+    _combined = QRegularExpression();
+  }
+
+  _havePathRules = _haveCombined || !_literals.isEmpty() ||
+                   !_prefixes.isEmpty() || !_suffixes.isEmpty() ||
+                   !_fallbackRules.isEmpty();
+}
+
+void KExcludeRules::compileGlob(const KExcludeRule *rule) {
+  const QVector<KExcludeGlobSegment> &segments = rule->globSegments();
+  int start = _segments.size();
+
+  _segments += segments;
+  KExcludeGlobSegment end = {KExcludeGlobSegment::End, QString()};
+  _segments.append(end);
+
+  if (segments.size() > 1 &&
+      segments[0].kind == KExcludeGlobSegment::AnyDepth &&
+      segments[1].kind == KExcludeGlobSegment::Literal) {
+    // "name" or "name/...": Whatever directory is called 'name' gets to
+    // the rest of the rule, so this is a lookup by name instead of a
+    // state that would be carried along everywhere.
+
+    addPosition(_anyDepthNames[segments[1].text], start + 2);
+  } else {
+    addPosition(_startPositions, start);
+  }
+}
+
+void KExcludeRules::addPosition(QVector<int> &positions, int pos) const {
+  if (!insertSorted(positions, pos))
+    return;
+
+  // "**" may also match no path component at all. A trailing "**" needs
+  // at least one, though; advance() takes care of that.
+
+  if (_segments[pos].kind == KExcludeGlobSegment::AnyDepth &&
+      _segments[pos + 1].kind != KExcludeGlobSegment::End)
+    addPosition(positions, pos + 1);
+}
+
+bool KExcludeRules::advance(const KExcludeMatchState &state,
+                            const QString &name,
+                            KExcludeMatchState *newState) const {
+  QVector<int> positions;
+  bool matched = false;
+
+  foreach (int pos, state._positions) {
+    const KExcludeGlobSegment &segment = _segments[pos];
+
+    if (segment.kind == KExcludeGlobSegment::AnyDepth) {
+      addPosition(positions, pos);
+
+      if (_segments[pos + 1].kind == KExcludeGlobSegment::End)
+        matched = true;
+    } else if (segment.matches(name)) {
+      addPosition(positions, pos + 1);
+    }
+  }
+
+  QHash<QString, QVector<int>>::const_iterator it = _anyDepthNames.find(name);
+
+  if (it != _anyDepthNames.end()) {
+    foreach (int pos, it.value())
+      addPosition(positions, pos);
+  }
+
+  for (int i = 0; i < positions.size();) {
+    if (_segments[positions[i]].kind == KExcludeGlobSegment::End) {
+      matched = true;
+      positions.remove(i);
+    } else {
+      i++;
+    }
+  }
+
+  // Most directories don't get any rule any further: Share the parent's
+  // positions then.
+
+  if (positions == state._positions)
+    newState->_positions = state._positions;
+  else
+    newState->_positions = positions;
+
+  newState->_generation = _generation;
+
+  return matched;
+}
+
+void KExcludeRules::updateState(KExcludeMatchState *state,
+                                const QString &path) const {
+  if (state->_generation == _generation)
+    return;
+
+  KExcludeMatchState current;
+  current._positions = _startPositions;
+  current._generation = _generation;
+
+  if (!_segments.isEmpty()) {
+    foreach (const QString &name, path.split('/', Qt::SkipEmptyParts)) {
+      KExcludeMatchState next;
+      advance(current, name, &next);
+      current = next;
+    }
+  }
+
+  *state = current;
+}
+
+bool KExcludeRules::matchEntry(const KExcludeMatchState &parentState,
+                               const QString &parentPath,
+                               const QString &name,
+                               KExcludeMatchState *state) {
+  const KExcludeMatchState *parent = &parentState;
+  KExcludeMatchState recalculated;
+
+  if (parentState._generation != _generation) {
+    updateState(&recalculated, parentPath);
+    parent = &recalculated;
+  }
+
+  KExcludeMatchState newState;
+  bool matched = !_segments.isEmpty() && advance(*parent, name, &newState);
+
+  if (!matched && _havePathRules)
+    matched = matchPath(childPath(parentPath, name));
+
+#if VERBOSE_EXCLUDE_MATCHES
+  if (matched)
+    qDebug() << childPath(parentPath, name) << " matches exclude rule "
+             << matchingRule(childPath(parentPath, name))->text() << Qt::endl;
+#endif
+
+  if (state)
+    *state = newState;
+
+  return matched;
 }
 
 bool KExcludeRules::match(const QString &text) {
   if (text.isEmpty())
     return false;
 
-  foreach (KExcludeRule *rule, _rules) {
-    if (rule->match(text)) {
-#if VERBOSE_EXCLUDE_MATCHES
+#if VERBOSE_EXCLUDE_TIMING
+  static std::atomic<qint64> compiledTime(0);
+  static std::atomic<qint64> eachRuleTime(0);
+  static std::atomic<int> calls(0);
+
+  QElapsedTimer timer;
+  timer.start();
+  bool matched = matchCompiled(text);
+  compiledTime += timer.nsecsElapsed();
 
-      qDebug() << text << " matches exclude rule " << rule->regexp().pattern()
-               << Qt::endl;
+  timer.start();
+  bool matchedByEachRule = matchEachRule(text);
+  eachRuleTime += timer.nsecsElapsed();
 
+  if (matched != matchedByEachRule)
+    qWarning() << "Compiled exclude rules disagree about" << text;
+
+  if (++calls % 10000 == 0)
+    qDebug() << calls << "exclude checks:" << compiledTime / 1000000
+             << "ms compiled vs." << eachRuleTime / 1000000
+             << "ms for checking each rule";
+#else
+  bool matched = matchCompiled(text);
 #endif
+
+#if VERBOSE_EXCLUDE_MATCHES
+  if (matched)
+    qDebug() << text << " matches exclude rule "
+             << matchingRule(text)->text() << Qt::endl;
+#endif
+
+  return matched;
+}
+
+bool KExcludeRules::matchCompiled(const QString &text) {
+  if (_havePathRules && matchPath(text))
+    return true;
+
+  if (_segments.isEmpty())
+    return false;
+
+  KExcludeMatchState state;
+  state._positions = _startPositions;
+  state._generation = _generation;
+  bool matched = false;
+
+  foreach (const QString &name, text.split('/', Qt::SkipEmptyParts)) {
+    KExcludeMatchState next;
+    matched = advance(state, name, &next);
+    state = next;
+  }
+
+  return matched;
+}
+
+bool KExcludeRules::matchPath(const QString &text) {
+  if (_literals.contains(text))
+    return true;
+
+  foreach (int length, _prefixLengths) {
+    if (length > text.length())
+      break;
+
+    if (_prefixes.contains(text.left(length)))
+      return true;
+  }
+
+  foreach (int length, _suffixLengths) {
+    if (length > text.length())
+      break;
+
+    if (_suffixes.contains(text.right(length)))
       return true;
+  }
+
+  if (_haveCombined && _combined.match(text).hasMatch())
+    return true;
+
+  if (!_fallbackRules.isEmpty()) {
+    QMutexLocker locker(&_fallbackMutex);
+
+    foreach (KExcludeRule *rule, _fallbackRules) {
+      if (rule->match(text))
+        return true;
     }
   }
 
   return false;
 }
 
+bool KExcludeRules::matchEachRule(const QString &text) {
+  foreach (KExcludeRule *rule, _rules) {
+    if (rule->match(text))
+      return true;
+  }
+
+  return false;
+}
+
 const KExcludeRule *KExcludeRules::matchingRule(const QString &text) {
   if (text.isEmpty())
     return NULL;
@@ -77,4 +671,3 @@ const KExcludeRule *KExcludeRules::matchingRule(const QString &text) {
 
   return 0;
 }
-
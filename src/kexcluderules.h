@@ -6,15 +6,54 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include <QHash>
 #include <QList>
+#include <QMutex>
+#include <QRegularExpression>
+#include <QSet>
+#include <QVector>
 #include <qregexp.h>
 #include <qstring.h>
 
 namespace KDirStat {
+/**
+ * One path component of a glob exclude rule.
+ **/
+struct KExcludeGlobSegment {
+  enum Kind {
+    Literal,  // a plain name
+    Wildcard, // a name with '*', '?' or '[...]'
+    AnyDepth, // "**": any number of path components
+    End       // only used internally by KExcludeRules
+  };
+
+  Kind kind;
+  QString text;
+
+  /**
+   * Returns 'true' if this segment matches the path component 'name'.
+   * Not meaningful for 'AnyDepth' and 'End'.
+   **/
+  bool matches(const QString &name) const;
+};
+
 /**
  * One single exclude rule to check text (file names) against.
  * It can be enabled or disabled. Only enabled rules can ever match; a
  * disabled exclude rule will never exclude anything.
+ *
+ * A rule is either a regular expression that has to match the complete
+ * path of a directory or a glob pattern in the style of .gitignore files:
+ *
+ *     node_modules     any directory of that name
+ *     *.snapshot       any directory with a name ending in ".snapshot"
+ *     /proc            only /proc itself
+ *     src/build        a "build" directory directly in any "src"
+ *                      directory
+ *
+ * Patterns that don't start with a '/' may match at any depth, "**"
+ * matches any number of path components, and a trailing '/' is ignored
+ * (only directories are checked anyway).
  **/
 class KExcludeRule {
 public:
@@ -28,6 +67,17 @@ public:
    **/
   virtual ~KExcludeRule();
 
+  /**
+   * Create a rule from its text as stored in the config file: A glob
+   * rule if 'text' starts with "glob:", a regular expression otherwise.
+   **/
+  static KExcludeRule *fromText(const QString &text);
+
+  /**
+   * Returns the text of this rule as accepted by fromText().
+   **/
+  QString text() const;
+
   /**
    * Check a string (usually a file name) against this exclude rule.
    * Returns 'true' if the string matches, i.e. if the object this string
@@ -40,14 +90,35 @@ public:
 
   /**
    * Returns this rule's regular expression.
+   * This is invalid for glob rules.
    **/
   QRegExp regexp() const { return _regexp; }
 
   /**
    * Change this rule's regular expression.
+   *
+   * Note that a rule that is already part of a @ref KExcludeRules rule set
+   * must not be changed: The rule set would not notice.
    **/
   void setRegexp(const QRegExp &regexp) { _regexp = regexp; }
 
+  /**
+   * Returns 'true' if this is a glob rule.
+   **/
+  bool isGlob() const { return !_glob.isEmpty(); }
+
+  /**
+   * Returns the glob pattern of a glob rule (without the "glob:" prefix).
+   **/
+  const QString &glob() const { return _glob; }
+
+  /**
+   * Returns the path components of a glob rule.
+   **/
+  const QVector<KExcludeGlobSegment> &globSegments() const {
+    return _globSegments;
+  }
+
   /**
    * Check if this rule is enabled.
    **/
@@ -60,10 +131,39 @@ public:
   void enable(bool enable = true) { _enabled = enable; }
 
 private:
+  /**
+   * Split 'glob' into path components.
+   **/
+  void setGlob(const QString &glob);
+
   QRegExp _regexp;
+  QString _glob;
+  QVector<KExcludeGlobSegment> _globSegments;
   bool _enabled;
 };
 
+/**
+ * How far the glob exclude rules got for one directory. A directory read
+ * job gets this from the job that found its directory and advances it
+ * one path component for each subdirectory with
+ * @ref KExcludeRules::matchEntry(), so checking the glob rules only ever
+ * looks at entry names, not at complete paths.
+ *
+ * Default-constructed states are not valid; the rule set recalculates
+ * those (and any state from before the last change of the rules) from
+ * the path.
+ **/
+class KExcludeMatchState {
+public:
+  KExcludeMatchState() : _generation(-1) {}
+
+private:
+  friend class KExcludeRules;
+
+  QVector<int> _positions; // indices into KExcludeRules::_segments
+  int _generation;
+};
+
 /**
  * Container for multiple exclude rules.
  *
@@ -75,6 +175,16 @@ private:
  *	   {
  *         // exclude this file
  *     }
+ *
+ * The rules are not checked one by one: Whenever the rule set changes,
+ * it is compiled into a few hash tables for rules that are plain strings
+ * ("/proc"), literal prefixes ("/home/.*") or literal suffixes
+ * (".*\\.snapshot") and one single combined regular expression for all
+ * the others. The glob rules are compiled into one set of path
+ * components that can be matched one component at a time.
+ *
+ * match() and matchEntry() may be called from several threads at once;
+ * changing the rule set while that happens is not supported.
  **/
 class KExcludeRules {
 public:
@@ -84,7 +194,8 @@ public:
    * Most applications will want to use excludeRules() instead to create
    * and use a singleton object of this class.
    **/
-  KExcludeRules() {}
+  KExcludeRules()
+      : _haveCombined(false), _havePathRules(false), _generation(0) {}
 
   /**
    * Destructor.
@@ -107,11 +218,28 @@ public:
   /**
    * Check a string against the exclude rules.
    * This will return 'true' if the text matches any (enabled) rule.
-   *
-   * Note that this operation will move current().
    **/
   bool match(const QString &text);
 
+  /**
+   * Check the directory 'name' in the directory 'parentPath' against the
+   * exclude rules. 'parentState' is the match state of the parent
+   * directory (see updateState()); if the entry is not excluded, the
+   * state for the entry itself is returned in 'state'.
+   *
+   * The glob rules only look at 'name' here. The complete path is only
+   * built if there are regular expression rules.
+   **/
+  bool matchEntry(const KExcludeMatchState &parentState,
+                  const QString &parentPath, const QString &name,
+                  KExcludeMatchState *state);
+
+  /**
+   * Make sure 'state' is valid for the current rules, recalculating it
+   * from 'path' if it isn't.
+   **/
+  void updateState(KExcludeMatchState *state, const QString &path) const;
+
   /**
    * Find the exclude rule that matches 'text'.
    * Return 0 if there is no match.
@@ -123,13 +251,79 @@ public:
   /**
    * Clear (delete) all exclude rules.
    **/
-  void clear() { _rules.clear(); }
+  void clear();
 
   const QList<KExcludeRule *> &rules() const { return _rules; }
 
 private:
+  /**
+   * Compile the enabled rules into the lookup tables and the combined
+   * regular expression that match() uses.
+   **/
+  void compile();
+
+  /**
+   * Compile one glob rule into _segments.
+   **/
+  void compileGlob(const KExcludeRule *rule);
+
+  /**
+   * Add 'pos' and every position that can be reached from it without
+   * consuming a path component to 'positions'.
+   **/
+  void addPosition(QVector<int> &positions, int pos) const;
+
+  /**
+   * Advance the glob match state 'state' by the path component 'name'.
+   * Returns 'true' if a glob rule matches there.
+   **/
+  bool advance(const KExcludeMatchState &state, const QString &name,
+               KExcludeMatchState *newState) const;
+
+  /**
+   * Check 'text' against the compiled path rules.
+   **/
+  bool matchPath(const QString &text);
+
+  /**
+   * Check 'text' against the compiled rules.
+   **/
+  bool matchCompiled(const QString &text);
+
+  /**
+   * Check 'text' against each rule in turn. This is what match() used to
+   * do before the rules were compiled.
+   **/
+  bool matchEachRule(const QString &text);
+
   QList<KExcludeRule *> _rules;
+
+  // Compiled path rules
+
+  QSet<QString> _literals;
+  QSet<QString> _prefixes;
+  QSet<QString> _suffixes;
+  QList<int> _prefixLengths;
+  QList<int> _suffixLengths;
+  QRegularExpression _combined;
+  bool _haveCombined;
+  bool _havePathRules;
+
+  // Rules that QRegularExpression can't handle the same way as QRegExp.
+  // QRegExp isn't thread-safe, so they are checked with _fallbackMutex
+  // held.
+  QList<KExcludeRule *> _fallbackRules;
+  QMutex _fallbackMutex;
+
+  // Compiled glob rules: The segments of all rules, each rule terminated
+  // by an 'End' segment. Rules of the very common form "name" are not in
+  // there, but in _anyDepthNames: They can match at any level, so no
+  // state needs to be carried for them.
+
+  QVector<KExcludeGlobSegment> _segments;
+  QVector<int> _startPositions;
+  QHash<QString, QVector<int>> _anyDepthNames;
+  int _generation;
 };
 
 } // namespace KDirStat
-
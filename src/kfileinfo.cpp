@@ -9,6 +9,7 @@
 #include <KLocalizedString>
 #include <QDir>
 #include <QFileInfo>
+#include <QVarLengthArray>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -20,6 +21,10 @@ using namespace KDirStat;
 KFileInfo::KFileInfo(KDirInfo *parent, const char *name) : _parent(parent) {
   // TODO: this contructor is only used by KDirInfo and should be moved there
   _isLocalFile = true;
+  _isSelected = false;
+  _hardLinkState = KHardLinkUnknown;
+  _colorCategory = 0;
+  _indexInParent = 0;
   _name = name ? name : "";
   _device = 0;
   _mode = 0;
@@ -34,6 +39,11 @@ KFileInfo::KFileInfo(const QString &filenameWithoutPath, struct stat *statInfo,
   Q_CHECK_PTR(statInfo);
 
   _isLocalFile = true;
+  _isSelected = false;
+  _hardLinkState = KHardLinkUnknown;
+
+  _colorCategory = 0;
+  _indexInParent = 0;
   _name = filenameWithoutPath;
 
   _device = statInfo->st_dev;
@@ -59,6 +69,11 @@ KFileInfo::KFileInfo(const KFileItem *fileItem, KDirInfo *parent)
   Q_CHECK_PTR(fileItem);
 
   _isLocalFile = fileItem->isLocalFile();
+  _isSelected = false;
+  _hardLinkState = KHardLinkUnknown;
+
+  _colorCategory = 0;
+  _indexInParent = 0;
   _name = parent ? fileItem->name() : fileItem->url().url();
   _device = 0;
   _mode = fileItem->mode();
@@ -91,6 +106,11 @@ KFileInfo::KFileInfo(KDirInfo *parent,
     : _parent(parent) {
   _name = filenameWithoutPath;
   _isLocalFile = true;
+  _isSelected = false;
+  _hardLinkState = KHardLinkUnknown;
+  _colorCategory = 0;
+  _indexInParent = 0;
+  _device = parent ? parent->device() : 0;
   _mode = mode;
   _size = size;
   _mtime = mtime;
@@ -120,25 +140,56 @@ KFileSize KFileInfo::allocatedSize() const { return blocks() * LSTAT_BLOCK_SIZE;
 KFileSize KFileInfo::size() const {
   KFileSize sz = isSparseFile() ? allocatedSize() : _size;
 
-  if (_links > 1)
-    sz /= _links;
+  if (_links > 1) {
+    if (_hardLinkState == KHardLinkOther)
+      sz = 0;
+    else if (_hardLinkState == KHardLinkUnknown)
+      sz /= _links;
+  }
 
   return sz;
 }
 
+KFileSize KFileInfo::totalSize() {
+  if (_links <= 1 || _hardLinkState == KHardLinkCounted)
+    return allocatedSize();
+
+  if (_hardLinkState == KHardLinkOther)
+    return 0;
+
+  return allocatedSize() / _links;
+}
+
+KFileSize KFileInfo::sharedSize() {
+  return _links > 1 && !isDir() ? totalSize() : 0;
+}
+
 QString KFileInfo::url() const {
-  if (_parent) {
-    QString parentUrl = _parent->url();
-
-    if (isDotEntry()) // don't append "/." for dot entries
-      return parentUrl;
-
-    if (parentUrl == "/") // avoid duplicating slashes
-      return parentUrl + _name;
-    else
-      return parentUrl + "/" + _name;
-  } else
-    return _name;
+  // Collect the path components first so the URL can be built in one
+  // single string instead of one string for each ancestor.
+
+  QVarLengthArray<const KFileInfo *, 64> components;
+  int length = 0;
+
+  for (const KFileInfo *item = this; item; item = item->parent()) {
+    if (item->isDotEntry() && item->parent()) // don't append "/." for dot entries
+      continue;
+
+    components.append(item);
+    length += item->_name.length() + 1;
+  }
+
+  QString url;
+  url.reserve(length);
+
+  for (int i = components.size() - 1; i >= 0; i--) {
+    if (i < components.size() - 1 && url != "/") // avoid duplicating slashes
+      url += '/';
+
+    url += components[i]->_name;
+  }
+
+  return url;
 }
 
 QString KFileInfo::debugUrl() const {
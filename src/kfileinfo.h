@@ -25,6 +25,10 @@ namespace KDirStat {
 // something larger:
 typedef long long KFileSize;
 
+// Numbers of items: Scanning a large backup volume from the root can
+// easily find more than 2^31 of them.
+typedef long long KFileCount;
+
 // Taken from Linux <limits.h> (the Alpha definition - 64 Bit long!).
 // This is how much bytes this program can handle.
 #define KFileSizeMax 9223372036854775807LL
@@ -47,6 +51,15 @@ typedef enum {
   KDirError          // Error while reading
 } KDirReadState;
 
+/**
+ * Which of the hard links of a file is counted in the size summaries.
+ **/
+typedef enum {
+  KHardLinkUnknown, // Not known: Count a share according to the link count
+  KHardLinkCounted, // The one link of the inode that is counted
+  KHardLinkOther    // Another link of an inode that is counted elsewhere
+} KHardLinkState;
+
 /**
  * The most basic building block of a @ref KDirTree:
  *
@@ -106,6 +119,17 @@ public:
    **/
   bool isLocalFile() const { return _isLocalFile; }
 
+  /**
+   * Returns whether or not this item is part of its tree's selection.
+   * See @ref KDirTree::selection().
+   **/
+  bool isSelected() const { return _isSelected; }
+
+  /**
+   * Set the "selected" flag. Only @ref KDirTree should call this.
+   **/
+  void setSelected(bool selected) { _isSelected = selected; }
+
   /**
    * Returns the file or directory name without path, i.e. only the last
    * path name component (i.e. "printcap" rather than "/etc/printcap").
@@ -152,6 +176,13 @@ public:
    **/
   dev_t device() const { return _device; }
 
+  /**
+   * Set the device this file resides on, e.g. for items read from a
+   * cache file. This has to be done before this item is inserted into the
+   * tree.
+   **/
+  void setDevice(dev_t device) { _device = device; }
+
   /**
    * The file permissions and object type as returned by lstat().
    * You might want to use the repective convenience methods instead:
@@ -165,6 +196,20 @@ public:
    **/
   nlink_t links() const { return _links; }
 
+  /**
+   * Returns which of its file's hard links this is as far as the size
+   * summaries are concerned. Only relevant if @ref links() is more than 1.
+   **/
+  KHardLinkState hardLinkState() const {
+    return (KHardLinkState)_hardLinkState;
+  }
+
+  /**
+   * Set the hard link state. This has to be done before this item is
+   * inserted into the tree. See @ref KDirTree::addHardLink().
+   **/
+  void setHardLinkState(KHardLinkState state) { _hardLinkState = state; }
+
   /**
    * The file size in bytes. This does not take unused space in the last
    * disk block (cluster) into account, yet it is the only size all kinds
@@ -195,8 +240,10 @@ public:
   /**
    * The file size, taking into account multiple links for plain files or
    * the true allocated size for sparse files. For plain files with
-   * multiple links this will be size/no_links, for sparse files it is
-   * the number of bytes actually allocated.
+   * multiple links this is the complete size for the link that is counted
+   * and 0 for the other links (size/no_links if that isn't known, see
+   * @ref hardLinkState()), for sparse files it is the number of bytes
+   * actually allocated.
    *
    * This is only called in the treeview to display the size of individual
    * files. It's not used to compute the size of folders recursively.
@@ -213,31 +260,68 @@ public:
    **/
   time_t mtime() const { return _mtime; }
 
+  /**
+   * Returns the treemap color category cached for this item or 0 if
+   * there is none yet. See @ref KTreemapColorRules.
+   **/
+  unsigned char colorCategory() const { return _colorCategory; }
+
+  /**
+   * Cache the treemap color category for this item.
+   **/
+  void setColorCategory(unsigned char category) { _colorCategory = category; }
+
+  /**
+   * Returns the index of this item in its parent's children list. This is
+   * maintained by the parent so it can unlink children in constant time.
+   **/
+  unsigned int indexInParent() const { return _indexInParent; }
+
+  /**
+   * Set the index in the parent's children list. Only @ref KDirInfo
+   * should call this.
+   **/
+  void setIndexInParent(unsigned int index) { _indexInParent = index; }
+
   /**
    * Returns the total size in bytes of this subtree.
    * Derived classes that have children should overwrite this.
    **/
-  virtual KFileSize totalSize() { return allocatedSize() / _links; }
+  virtual KFileSize totalSize();
+
+  /**
+   * Returns the part of @ref totalSize() that is in files with more than
+   * one hard link: Removing the subtree doesn't necessarily free that
+   * space, since other links may remain (in or outside of the tree).
+   * Derived classes that have children should overwrite this.
+   **/
+  virtual KFileSize sharedSize();
+
+  /**
+   * Returns the part of @ref totalSize() that is not shared via hard
+   * links, i.e. the space that removing this subtree will free for sure.
+   **/
+  KFileSize uniqueSize() { return totalSize() - sharedSize(); }
 
   /**
    * Returns the total number of children in this subtree, excluding this item.
    * Derived classes that have children should overwrite this.
    **/
-  virtual int totalItems() { return 0; }
+  virtual KFileCount totalItems() { return 0; }
 
   /**
    * Returns the total number of subdirectories in this subtree,
    * excluding this item. Dot entries and "." or ".." are not counted.
    * Derived classes that have children should overwrite this.
    **/
-  virtual int totalSubDirs() { return 0; }
+  virtual KFileCount totalSubDirs() { return 0; }
 
   /**
    * Returns the total number of plain file children in this subtree,
    * excluding this item.
    * Derived classes that have children should overwrite this.
    **/
-  virtual int totalFiles() { return 0; }
+  virtual KFileCount totalFiles() { return 0; }
 
   /**
    * Returns the latest modification time of this subtree.
@@ -502,6 +586,10 @@ protected:
 
   QString _name;          // the file name (without path!)
   bool _isLocalFile : 1;  // flag: local or remote file?
+  bool _isSelected : 1;   // flag: part of the tree's selection?
+  unsigned char _hardLinkState : 2; // KHardLinkState
+  unsigned char _colorCategory; // cached treemap color category
+  unsigned int _indexInParent;  // index in the parent's children list
   dev_t _device;          // device this object resides on
   mode_t _mode;           // file permissions + object type
   nlink_t _links;         // number of links
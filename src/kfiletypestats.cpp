@@ -0,0 +1,90 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QList>
+
+#include "kdirinfo.h"
+#include "kfiletypestats.h"
+#include "ktreemapcolors.h"
+
+// Anything longer is hardly an extension ("report.2010-03-01-final"), and
+// those would only bloat the table.
+#define MAX_EXTENSION_LENGTH 16
+
+using namespace KDirStat;
+
+KFileTypeStats::KFileTypeStats() { clear(); }
+
+void KFileTypeStats::clear() {
+  _extensionIds.clear();
+  _extensions.clear();
+  _byExtension.clear();
+  _byCategory.clear();
+  _total = KFileTypeTotals();
+
+  // Id 0: No extension
+  _extensions.append(QString());
+  _byExtension.resize(1);
+}
+
+int KFileTypeStats::extensionId(const QString &name) {
+  int dot = name.lastIndexOf('.');
+
+  // Hidden files like ".profile" don't have an extension
+  if (dot <= 0 || dot == name.length() - 1 ||
+      name.length() - dot - 1 > MAX_EXTENSION_LENGTH)
+    return 0;
+
+  QString ext = name.mid(dot + 1).toLower();
+  QHash<QString, int>::const_iterator it = _extensionIds.constFind(ext);
+
+  if (it != _extensionIds.constEnd())
+    return it.value();
+
+  int id = _extensions.size();
+  _extensionIds.insert(ext, id);
+  _extensions.append(ext);
+  _byExtension.append(KFileTypeTotals());
+
+  return id;
+}
+
+void KFileTypeStats::add(KFileInfo *file, int sign) {
+  if (!file->isFile())
+    return;
+
+  KFileSize size = sign * file->totalSize();
+  int category = KTreemapColorRules::colorRules()->cachedCategory(file);
+
+  if (category >= _byCategory.size())
+    _byCategory.resize(category + 1);
+
+  KFileTypeTotals &byExtension = _byExtension[extensionId(file->name())];
+  byExtension.size += size;
+  byExtension.files += sign;
+
+  _byCategory[category].size += size;
+  _byCategory[category].files += sign;
+
+  _total.size += size;
+  _total.files += sign;
+}
+
+void KFileTypeStats::addSubtree(KFileInfo *subtree, int sign) {
+  QList<KFileInfo *> items;
+  items.append(subtree);
+
+  while (!items.isEmpty()) {
+    KFileInfo *item = items.takeLast();
+    add(item, sign);
+
+    for (size_t i = 0; i < item->numChildren(); i++)
+      items.append(item->child(i));
+
+    if (item->dotEntry())
+      items.append(item->dotEntry());
+  }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QHash>
+#include <QStringList>
+#include <QVector>
+
+#include "kfileinfo.h"
+
+namespace KDirStat {
+/**
+ * Size and number of the files of one type.
+ **/
+struct KFileTypeTotals {
+  KFileSize size; // like totalSize()
+  KFileCount files;
+
+  KFileTypeTotals() : size(0), files(0) {}
+};
+
+/**
+ * How much space the files of each type take up: By filename extension
+ * and by treemap color category (see @ref KTreemapColorRules).
+ *
+ * Each extension gets a small id the first time it is seen; the totals
+ * are vectors indexed by that id, so adding or removing a file is one
+ * hash lookup and a few additions. Only regular files are counted.
+ *
+ * @ref KDirTree keeps one of these for the whole tree up to date while
+ * reading and deleting; use @ref addSubtree() for any other subtree.
+ *
+ * @short File type statistics
+ **/
+class KFileTypeStats {
+public:
+  /**
+   * Constructor.
+   **/
+  KFileTypeStats();
+
+  /**
+   * Add 'file' if it is a regular file.
+   **/
+  void add(KFileInfo *file) { add(file, 1); }
+
+  /**
+   * Remove 'file' again that was added before.
+   **/
+  void remove(KFileInfo *file) { add(file, -1); }
+
+  /**
+   * Add all files in 'subtree'.
+   **/
+  void addSubtree(KFileInfo *subtree) { addSubtree(subtree, 1); }
+
+  /**
+   * Remove all files in 'subtree' again.
+   **/
+  void removeSubtree(KFileInfo *subtree) { addSubtree(subtree, -1); }
+
+  /**
+   * Forget everything, including the extension ids.
+   **/
+  void clear();
+
+  /**
+   * Returns the number of extensions seen so far. Valid extension ids are
+   * 0 .. extensionCount() - 1; 0 is for files without an extension.
+   **/
+  int extensionCount() const { return _extensions.size(); }
+
+  /**
+   * Returns the extension with id 'id', in lowercase and without the
+   * leading '.'.
+   **/
+  QString extension(int id) const { return _extensions[id]; }
+
+  /**
+   * Returns the totals for the extension with id 'id'.
+   **/
+  const KFileTypeTotals &extensionTotals(int id) const {
+    return _byExtension[id];
+  }
+
+  /**
+   * Returns the number of categories, see @ref
+   * KTreemapColorRules::categoryCount().
+   **/
+  int categoryCount() const { return _byCategory.size(); }
+
+  /**
+   * Returns the totals for color category 'category'.
+   **/
+  const KFileTypeTotals &categoryTotals(int category) const {
+    return _byCategory[category];
+  }
+
+  /**
+   * Returns the totals of all files.
+   **/
+  const KFileTypeTotals &total() const { return _total; }
+
+protected:
+  /**
+   * Add 'file' 'sign' times (1 or -1).
+   **/
+  void add(KFileInfo *file, int sign);
+
+  /**
+   * Add the files in 'subtree' 'sign' times (1 or -1).
+   **/
+  void addSubtree(KFileInfo *subtree, int sign);
+
+  /**
+   * Returns the id for the extension of 'name', creating one if needed.
+   **/
+  int extensionId(const QString &name);
+
+  QHash<QString, int> _extensionIds;
+  QStringList _extensions;               // indexed by extension id
+  QVector<KFileTypeTotals> _byExtension; // indexed by extension id
+  QVector<KFileTypeTotals> _byCategory;  // indexed by color category
+  KFileTypeTotals _total;
+};
+
+} // namespace KDirStat
@@ -0,0 +1,169 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QHeaderView>
+#include <QIcon>
+#include <QPixmap>
+#include <KLocalizedString>
+
+#include "kdirtree.h"
+#include "kfiletypeview.h"
+#include "ktreemapcolors.h"
+
+#define SORT_ROLE Qt::UserRole
+
+#define NAME_COLUMN 0
+#define SIZE_COLUMN 1
+#define PERCENT_COLUMN 2
+#define FILES_COLUMN 3
+
+using namespace KDirStat;
+
+namespace {
+/**
+ * Sorts numeric columns by number, not by text.
+ **/
+class KFileTypeItem : public QTreeWidgetItem {
+public:
+  KFileTypeItem(QTreeWidgetItem *parent) : QTreeWidgetItem(parent) {}
+
+  bool operator<(const QTreeWidgetItem &other) const override {
+    int column = treeWidget() ? treeWidget()->sortColumn() : 0;
+    QVariant key = data(column, SORT_ROLE);
+
+    if (!key.isValid())
+      return QTreeWidgetItem::operator<(other);
+
+    return key.toLongLong() < other.data(column, SORT_ROLE).toLongLong();
+  }
+};
+} // namespace
+
+KFileTypeView::KFileTypeView(KDirTree *tree, QWidget *parent)
+    : QTreeWidget(parent), _tree(tree) {
+  setColumnCount(4);
+  setHeaderLabels(QStringList() << i18n("Type") << i18n("Size") << i18n("%")
+                                << i18n("Files"));
+  setUniformRowHeights(true);
+  header()->setStretchLastSection(false);
+  header()->setSectionResizeMode(NAME_COLUMN, QHeaderView::Stretch);
+
+  for (int column = SIZE_COLUMN; column <= FILES_COLUMN; column++)
+    header()->setSectionResizeMode(column, QHeaderView::ResizeToContents);
+
+  _categories = new QTreeWidgetItem(this, QStringList() << i18n("Categories"));
+  _extensions = new QTreeWidgetItem(this, QStringList() << i18n("Extensions"));
+  _categories->setExpanded(true);
+  _extensions->setExpanded(true);
+
+  setSortingEnabled(true);
+  sortByColumn(SIZE_COLUMN, Qt::DescendingOrder);
+
+  _refreshTimer.setSingleShot(true);
+
+  connect(&_refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+
+  connect(_tree, SIGNAL(startingReading()), this, SLOT(refreshDelayed()));
+  connect(_tree, SIGNAL(finished()), this, SLOT(refreshDelayed()));
+  connect(_tree, SIGNAL(aborted()), this, SLOT(refreshDelayed()));
+  connect(_tree, SIGNAL(childDeleted()), this, SLOT(refreshDelayed()));
+  connect(_tree, SIGNAL(selectionChanged(KDirTree *)), this,
+          SLOT(refreshDelayed()));
+}
+
+KFileTypeView::~KFileTypeView() {}
+
+void KFileTypeView::refreshDelayed() {
+  if (isVisible() && !_refreshTimer.isActive())
+    _refreshTimer.start(0);
+}
+
+void KFileTypeView::showEvent(QShowEvent *event) {
+  QTreeWidget::showEvent(event);
+  refreshDelayed();
+}
+
+void KFileTypeView::refresh() {
+  KFileInfo *subtree = _tree->root();
+
+  // Use the selected directory, but not while it is still being read
+  if (_tree->selection().size() == 1) {
+    KFileInfo *selected = _tree->selection().front();
+
+    if (selected->isDirInfo() && selected->isFinished())
+      subtree = selected;
+  }
+
+  if (subtree == _tree->root()) {
+    fill(_tree->fileTypeStats(), subtree);
+  } else {
+    KFileTypeStats stats;
+    stats.addSubtree(subtree);
+    fill(stats, subtree);
+  }
+}
+
+void KFileTypeView::fill(const KFileTypeStats &stats, KFileInfo *subtree) {
+  KTreemapColorRules *rules = KTreemapColorRules::colorRules();
+  KFileSize totalSize = stats.total().size;
+
+  setSortingEnabled(false); // Much faster to sort only once
+  qDeleteAll(_categories->takeChildren());
+  qDeleteAll(_extensions->takeChildren());
+
+  headerItem()->setText(NAME_COLUMN, subtree ? subtree->url() : i18n("Type"));
+
+  for (int category = 0;
+       category < stats.categoryCount() && category < rules->categoryCount();
+       category++) {
+    const KFileTypeTotals &totals = stats.categoryTotals(category);
+
+    if (totals.files == 0)
+      continue;
+
+    QTreeWidgetItem *item =
+        addRow(_categories, rules->categoryName(category), totals.size,
+               totals.files, totalSize);
+
+    QPixmap swatch(12, 12);
+    swatch.fill(rules->categoryColor(category));
+    item->setIcon(NAME_COLUMN, QIcon(swatch));
+  }
+
+  for (int id = 0; id < stats.extensionCount(); id++) {
+    const KFileTypeTotals &totals = stats.extensionTotals(id);
+
+    if (totals.files == 0)
+      continue;
+
+    QString name =
+        id == 0 ? i18n("(No Extension)") : "*." + stats.extension(id);
+    addRow(_extensions, name, totals.size, totals.files, totalSize);
+  }
+
+  setSortingEnabled(true);
+}
+
+QTreeWidgetItem *KFileTypeView::addRow(QTreeWidgetItem *parent,
+                                       const QString &name, KFileSize size,
+                                       KFileCount files, KFileSize totalSize) {
+  QTreeWidgetItem *item = new KFileTypeItem(parent);
+  double percent = totalSize > 0 ? 100.0 * size / totalSize : 0.0;
+
+  item->setText(NAME_COLUMN, name);
+  item->setText(SIZE_COLUMN, formatSize(size));
+  item->setText(PERCENT_COLUMN, QString::number(percent, 'f', 1) + "%");
+  item->setText(FILES_COLUMN, QString::number(files));
+
+  item->setData(SIZE_COLUMN, SORT_ROLE, size);
+  item->setData(PERCENT_COLUMN, SORT_ROLE, size);
+  item->setData(FILES_COLUMN, SORT_ROLE, files);
+
+  for (int column = SIZE_COLUMN; column <= FILES_COLUMN; column++)
+    item->setTextAlignment(column, Qt::AlignRight);
+
+  return item;
+}
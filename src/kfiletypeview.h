@@ -0,0 +1,80 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QTimer>
+#include <QTreeWidget>
+
+#include "kfileinfo.h"
+
+namespace KDirStat {
+// Forward declarations
+class KDirTree;
+class KFileTypeStats;
+
+/**
+ * A sortable table of how much space the files of each type take up, by
+ * treemap color category and by filename extension: For the selected
+ * directory if there is one, otherwise for the whole tree.
+ *
+ * The numbers for the whole tree are the ones @ref KDirTree keeps up to
+ * date anyway; those for a selected directory take one pass over it.
+ *
+ * @short File type statistics view
+ **/
+class KFileTypeView : public QTreeWidget {
+  Q_OBJECT
+
+public:
+  /**
+   * Constructor.
+   **/
+  KFileTypeView(KDirTree *tree, QWidget *parent = 0);
+
+  /**
+   * Destructor.
+   **/
+  virtual ~KFileTypeView();
+
+public slots:
+  /**
+   * Fill the table from the tree again.
+   **/
+  void refresh();
+
+  /**
+   * Fill the table from the tree again after all events are processed.
+   * Calling this several times in a row refreshes only once.
+   **/
+  void refreshDelayed();
+
+protected:
+  /**
+   * Refresh when the table becomes visible: It isn't kept up to date
+   * while it is hidden.
+   **/
+  void showEvent(QShowEvent *event) override;
+
+  /**
+   * Fill the table from 'stats' for 'subtree'.
+   **/
+  void fill(const KFileTypeStats &stats, KFileInfo *subtree);
+
+  /**
+   * Add a row below 'parent'.
+   **/
+  QTreeWidgetItem *addRow(QTreeWidgetItem *parent, const QString &name,
+                          KFileSize size, KFileCount files,
+                          KFileSize totalSize);
+
+  KDirTree *_tree;
+  QTimer _refreshTimer;
+  QTreeWidgetItem *_categories;
+  QTreeWidgetItem *_extensions;
+};
+
+} // namespace KDirStat
@@ -0,0 +1,135 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include "khardlinktable.h"
+
+#include <algorithm>
+
+#define INITIAL_CAPACITY 1024 // must be a power of 2
+
+using namespace KDirStat;
+
+KHardLinkTable::KHardLinkTable() : _count(0) {}
+
+size_t KHardLinkTable::slot(const std::vector<Entry> &entries, dev_t device,
+                            ino_t inode) {
+  // Inode numbers are often sequential; mix the bits so they don't end up
+  // in long runs of neighbouring slots.
+
+  quint64 hash = (quint64)inode * 0x9e3779b97f4a7c15ULL ^ (quint64)device;
+  hash ^= hash >> 29;
+
+  size_t mask = entries.size() - 1;
+  size_t i = hash & mask;
+
+  while (entries[i].inode != 0 &&
+         (entries[i].inode != inode || entries[i].device != device))
+    i = (i + 1) & mask;
+
+  return i;
+}
+
+bool KHardLinkTable::add(dev_t device, ino_t inode, KFileSize size,
+                         KFileInfo *file) {
+  // No file system uses inode 0 for a file; just count it.
+  if (inode == 0)
+    return true;
+
+  // Keep at least half of the slots free so the probe sequences stay short
+  if ((_count + 1) * 2 > _entries.size())
+    grow();
+
+  Entry &entry = _entries[slot(_entries, device, inode)];
+
+  if (entry.inode == 0) {
+    entry.device = device;
+    entry.inode = inode;
+    entry.size = size;
+    _count++;
+  }
+
+  entry.links.push_back(file);
+  _inodes.insert(file, Inode{device, inode});
+
+  // The first link is counted; if all links were removed so far, this one
+  // is the first again.
+  return entry.links.size() == 1;
+}
+
+void KHardLinkTable::remove(
+    const std::vector<KFileInfo *> &files,
+    std::vector<std::pair<KFileInfo *, KFileSize>> &promoted) {
+  // Remove all of them before picking new counted links, so none of the
+  // removed links can be picked.
+
+  std::vector<Entry *> lostCounted;
+
+  for (KFileInfo *file : files) {
+    const QList<Inode> inodes = _inodes.values(file);
+
+    for (const Inode &inode : inodes) {
+      Entry &entry = _entries[slot(_entries, inode.device, inode.inode)];
+      std::vector<KFileInfo *> &links = entry.links;
+
+      if (!links.empty() && links.front() == file)
+        lostCounted.push_back(&entry);
+
+      for (size_t i = 0; i < links.size(); i++) {
+        if (links[i] == file) {
+          links.erase(links.begin() + i);
+          break;
+        }
+      }
+    }
+
+    _inodes.remove(file);
+  }
+
+  // A folded directory may stand in for several links of one inode, so an
+  // entry may have lost its counted link more than once.
+
+  std::sort(lostCounted.begin(), lostCounted.end());
+  lostCounted.erase(std::unique(lostCounted.begin(), lostCounted.end()),
+                    lostCounted.end());
+
+  for (Entry *entry : lostCounted) {
+    if (!entry->links.empty())
+      promoted.push_back(std::make_pair(entry->links.front(), entry->size));
+  }
+}
+
+bool KHardLinkTable::inode(KFileInfo *file, dev_t &device,
+                           ino_t &inode) const {
+  QMultiHash<KFileInfo *, Inode>::const_iterator it = _inodes.find(file);
+
+  if (it == _inodes.end())
+    return false;
+
+  device = it.value().device;
+  inode = it.value().inode;
+
+  return true;
+}
+
+void KHardLinkTable::clear() {
+  std::vector<Entry>().swap(_entries);
+  _inodes.clear();
+  _count = 0;
+}
+
+void KHardLinkTable::grow() {
+  std::vector<Entry> entries(
+      _entries.empty() ? INITIAL_CAPACITY : _entries.size() * 2, Entry());
+
+  for (size_t i = 0; i < _entries.size(); i++) {
+    Entry &entry = _entries[i];
+
+    if (entry.inode != 0)
+      entries[slot(entries, entry.device, entry.inode)] = std::move(entry);
+  }
+
+  _entries.swap(entries);
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QHash>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+#include "kfileinfo.h"
+
+namespace KDirStat {
+/**
+ * Remembers the inodes with more than one hard link that were found while
+ * reading a tree, so the disk space of each of them is counted only once:
+ * For the first link found, not for the others.
+ *
+ * Only files with more than one link end up here. Each entry holds the
+ * inode's device and number, its size and all of its links that are in
+ * the tree, the counted one first. It is a hash table with open
+ * addressing (linear probing); a second (much smaller) hash finds the
+ * entries of a link without knowing its inode.
+ *
+ * Entries are never removed. When the counted link is removed from the
+ * tree, the next one of that inode is counted instead, or the next one
+ * that is added if there is none left.
+ *
+ * @short Hard link table for counting each inode once
+ **/
+class KHardLinkTable {
+public:
+  /**
+   * Constructor.
+   **/
+  KHardLinkTable();
+
+  /**
+   * Add link 'file' to inode 'inode' on device 'device' that takes up
+   * 'size' bytes on disk. Returns 'true' if 'file' is the link to count,
+   * 'false' if another link of the same inode is counted already.
+   *
+   * 'file' may also be a folded directory that stands in for the link;
+   * it may stand in for several links, even of the same inode.
+   **/
+  bool add(dev_t device, ino_t inode, KFileSize size, KFileInfo *file);
+
+  /**
+   * Remove the links in 'files', typically because they are about to be
+   * deleted from the tree. For each inode whose counted link is among
+   * them, the next remaining link is counted instead: It is added to
+   * 'promoted' together with the size of the inode.
+   **/
+  void remove(const std::vector<KFileInfo *> &files,
+              std::vector<std::pair<KFileInfo *, KFileSize>> &promoted);
+
+  /**
+   * Returns 'true' if 'file' is a link in this table.
+   **/
+  bool contains(KFileInfo *file) const { return _inodes.contains(file); }
+
+  /**
+   * Find the inode of link 'file': Returns 'false' if 'file' is not in
+   * this table.
+   **/
+  bool inode(KFileInfo *file, dev_t &device, ino_t &inode) const;
+
+  /**
+   * Returns all links in this table.
+   **/
+  QList<KFileInfo *> links() const { return _inodes.uniqueKeys(); }
+
+  /**
+   * Returns the number of links in the table.
+   **/
+  int linkCount() const { return _inodes.size(); }
+
+  /**
+   * Remove all entries.
+   **/
+  void clear();
+
+  /**
+   * Returns the number of inodes in the table.
+   **/
+  size_t count() const { return _count; }
+
+protected:
+  struct Entry {
+    dev_t device;
+    ino_t inode; // 0: unused
+    KFileSize size;
+    std::vector<KFileInfo *> links; // the counted one first
+  };
+
+  struct Inode {
+    dev_t device;
+    ino_t inode;
+  };
+
+  /**
+   * Returns the slot for 'device' and 'inode' in 'entries': The one with
+   * that inode or the free one where it belongs.
+   **/
+  static size_t slot(const std::vector<Entry> &entries, dev_t device,
+                     ino_t inode);
+
+  /**
+   * Double the capacity.
+   **/
+  void grow();
+
+  std::vector<Entry> _entries; // capacity is a power of 2
+  size_t _count;
+  QMultiHash<KFileInfo *, Inode> _inodes; // link -> its inodes
+};
+
+} // namespace KDirStat
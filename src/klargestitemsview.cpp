@@ -0,0 +1,96 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QHeaderView>
+#include <KLocalizedString>
+
+#include "kdirtree.h"
+#include "klargestitemsview.h"
+
+#define URL_ROLE Qt::UserRole
+
+using namespace KDirStat;
+
+KLargestItemsView::KLargestItemsView(KDirTree *tree, QWidget *parent)
+    : QTreeWidget(parent), _tree(tree) {
+  setColumnCount(2);
+  setHeaderLabels(QStringList() << i18n("Name") << i18n("Size"));
+  setRootIsDecorated(true);
+  setUniformRowHeights(true);
+  header()->setStretchLastSection(false);
+  header()->setSectionResizeMode(0, QHeaderView::Stretch);
+  header()->setSectionResizeMode(1, QHeaderView::ResizeToContents);
+
+  _files = new QTreeWidgetItem(this, QStringList() << i18n("Largest Files"));
+  _dirs = new QTreeWidgetItem(
+      this, QStringList() << i18n("Largest Directories Without Subdirectories"));
+  _files->setExpanded(true);
+  _dirs->setExpanded(true);
+
+  _refreshTimer.setSingleShot(true);
+
+  connect(&_refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+  connect(this, SIGNAL(itemActivated(QTreeWidgetItem *, int)), this,
+          SLOT(selectItem(QTreeWidgetItem *)));
+
+  connect(_tree, SIGNAL(startingReading()), this, SLOT(refreshDelayed()));
+  connect(_tree, SIGNAL(finished()), this, SLOT(refreshDelayed()));
+  connect(_tree, SIGNAL(aborted()), this, SLOT(refreshDelayed()));
+  connect(_tree, SIGNAL(childDeleted()), this, SLOT(refreshDelayed()));
+}
+
+KLargestItemsView::~KLargestItemsView() {}
+
+void KLargestItemsView::refreshDelayed() {
+  if (isVisible() && !_refreshTimer.isActive())
+    _refreshTimer.start(0);
+}
+
+void KLargestItemsView::showEvent(QShowEvent *event) {
+  QTreeWidget::showEvent(event);
+  refreshDelayed();
+}
+
+void KLargestItemsView::refresh() {
+  qDeleteAll(_files->takeChildren());
+  qDeleteAll(_dirs->takeChildren());
+
+  QTreeWidgetItem *parents[] = {_files, _dirs};
+  std::vector<KLargeItem> items[] = {_tree->largestFiles(),
+                                     _tree->largestDirs()};
+
+  for (int i = 0; i < 2; i++) {
+    for (size_t j = 0; j < items[i].size(); j++) {
+      QString url = items[i][j].itemUrl();
+      QTreeWidgetItem *item = new QTreeWidgetItem(parents[i]);
+
+      item->setText(0, url);
+      item->setText(1, formatSize(items[i][j].size));
+      item->setTextAlignment(1, Qt::AlignRight);
+      item->setData(0, URL_ROLE, url);
+    }
+  }
+}
+
+void KLargestItemsView::selectItem(QTreeWidgetItem *item) {
+  QString url = item->data(0, URL_ROLE).toString();
+
+  if (url.isEmpty())
+    return;
+
+  // Files below the maximum tree depth are not in the tree: Go up to the
+  // folded directory they are in.
+
+  KFileInfo *found = _tree->locate(url);
+
+  while (!found && url.lastIndexOf('/') > 0) {
+    url.truncate(url.lastIndexOf('/'));
+    found = _tree->locate(url);
+  }
+
+  if (found)
+    _tree->selectItems(std::vector<KFileInfo *>(1, found));
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QTimer>
+#include <QTreeWidget>
+
+namespace KDirStat {
+// Forward declarations
+class KDirTree;
+
+/**
+ * A list of the largest files and directories of a @ref KDirTree as @ref
+ * KDirTree::largestFiles() and @ref KDirTree::largestDirs() return them.
+ * Activating an item selects it in the tree; for files below the maximum
+ * tree depth, the folded directory they are in.
+ *
+ * The list only keeps URLs, not tree items, so it can't get out of sync
+ * with the tree in a harmful way.
+ *
+ * @short List of the largest items of a directory tree
+ **/
+class KLargestItemsView : public QTreeWidget {
+  Q_OBJECT
+
+public:
+  /**
+   * Constructor.
+   **/
+  KLargestItemsView(KDirTree *tree, QWidget *parent = 0);
+
+  /**
+   * Destructor.
+   **/
+  virtual ~KLargestItemsView();
+
+public slots:
+  /**
+   * Fill the list from the tree again.
+   **/
+  void refresh();
+
+  /**
+   * Fill the list from the tree again after all events are processed.
+   * Calling this several times in a row refreshes only once.
+   **/
+  void refreshDelayed();
+
+protected slots:
+  /**
+   * Select the tree item that belongs to 'item'.
+   **/
+  void selectItem(QTreeWidgetItem *item);
+
+protected:
+  /**
+   * Refresh when the list becomes visible: It isn't kept up to date
+   * while it is hidden.
+   **/
+  void showEvent(QShowEvent *event) override;
+
+  KDirTree *_tree;
+  QTimer _refreshTimer;
+  QTreeWidgetItem *_files;
+  QTreeWidgetItem *_dirs;
+};
+
+} // namespace KDirStat
@@ -106,7 +106,8 @@ KCleanup *KStdCleanup::moveToTrashBin(QString &icon, QKeySequence &shortcut) {
 }
 
 KCleanup *KStdCleanup::hardDelete(QString &icon, QKeySequence &shortcut) {
-  KCleanup *cleanup = new KCleanup("cleanup_hard_delete", "rm -rf %p",
+  KCleanup *cleanup = new KCleanup("cleanup_hard_delete",
+                                   KCleanup::nativeDeleteCommand(),
                                    i18n("&Delete (no way to undelete!)"));
   Q_CHECK_PTR(cleanup);
   cleanup->setWorksForDir(true);
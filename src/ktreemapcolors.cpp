@@ -0,0 +1,185 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <KLocalizedString>
+#include <QDebug>
+
+#include "kdirinfo.h"
+#include "ktreemapcolors.h"
+
+using namespace KDirStat;
+
+KTreemapColorRules::KTreemapColorRules() { setRules(defaultRules()); }
+
+KTreemapColorRules *KTreemapColorRules::colorRules() {
+  static KTreemapColorRules *singleton = 0;
+
+  if (!singleton) {
+    singleton = new KTreemapColorRules();
+  }
+
+  return singleton;
+}
+
+QStringList KTreemapColorRules::defaultRules() {
+  QStringList rules;
+
+  rules << "#ff0000: =~ =bak"
+        << "#0000ff: =c =cpp =cc =h =hpp =el html htm txt doc php odt ods pdf"
+        << "#ffa000: =o =lo =Po =al =moc.cpp =moc.cc =elc =la =a =rpm dll"
+        << "#00ff00: tar.bz2 tar.gz tar.xz tgz bz2 bz gz zip arj"
+        << "#00ffff: png jpg jpeg gif tif tiff bmp xpm tga xcf ps"
+        << "#ffff00: wav mp3 jar"
+        << "#a0ff00: avi mov mpg mpeg wmv"
+        << "#00007f: db sqlite sql"
+        << "#bea064: cb"
+        << "#ffffff: dat"
+        << "#ff00ff: exe com";
+
+  return rules;
+}
+
+bool KTreemapColorRules::setRules(const QStringList &rules) {
+  if (rules == _rules && !_colors.isEmpty())
+    return false;
+
+  _rules = rules;
+  _extensions.clear();
+  _lowerExtensions.clear();
+  _colors.clear();
+  _names.clear();
+
+  _colors.resize(FirstRuleCategory);
+  _colors[NoCategory] = Qt::white;
+  _colors[DirCategory] = Qt::blue;
+  _colors[DefaultCategory] = Qt::white;
+  _colors[SharedLibCategory] = QColor(0xff, 0xa0, 0x00);
+  _colors[CoreDumpCategory] = Qt::red;
+  _colors[ExecutableCategory] = Qt::magenta;
+
+  _names << i18n("Uncategorized") << i18n("Directories") << i18n("Other")
+         << i18n("Shared Libraries") << i18n("Core Dumps")
+         << i18n("Executables");
+
+  foreach (const QString &rule, _rules) {
+    if (!addRule(rule))
+      qWarning() << "Ignoring invalid treemap color rule" << rule;
+  }
+
+  return true;
+}
+
+bool KTreemapColorRules::addRule(const QString &rule) {
+  int colon = rule.indexOf(':');
+
+  if (colon < 0)
+    return false;
+
+  QColor color(rule.left(colon).trimmed());
+
+  if (!color.isValid())
+    return false;
+
+  if (_colors.size() > 255) // The category must fit into an unsigned char
+    return false;
+
+  unsigned char category = _colors.size();
+  _colors.append(color);
+  _names.append(rule.mid(colon + 1).simplified());
+
+  QStringList extensions =
+      rule.mid(colon + 1).simplified().split(' ', Qt::SkipEmptyParts);
+
+  foreach (const QString &ext, extensions) {
+    if (ext.startsWith('=')) {
+      if (ext.length() > 1 && !_extensions.contains(ext.mid(1)))
+        _extensions.insert(ext.mid(1), category);
+    } else {
+      QString lowerExt = ext.toLower();
+
+      if (!_lowerExtensions.contains(lowerExt))
+        _lowerExtensions.insert(lowerExt, category);
+    }
+  }
+
+  return true;
+}
+
+QColor KTreemapColorRules::color(KFileInfo *file) {
+  if (!file)
+    return Qt::white;
+
+  return _colors[cachedCategory(file)];
+}
+
+unsigned char KTreemapColorRules::cachedCategory(KFileInfo *file) {
+  unsigned char category = file->colorCategory();
+
+  if (category == NoCategory) {
+    category = this->category(file);
+    file->setColorCategory(category);
+  }
+
+  return category;
+}
+
+unsigned char KTreemapColorRules::category(const KFileInfo *file) const {
+  if (!file->isFile())
+    return DirCategory;
+
+  const QString name = file->name();
+
+  // Try all extensions, longest first: Everything after the first '.',
+  // then everything after the second '.' etc.
+
+  int pos = name.indexOf('.');
+
+  while (pos >= 0) {
+    QString ext = name.mid(pos + 1);
+
+    if (ext.isEmpty())
+      break;
+
+    QHash<QString, unsigned char>::const_iterator it = _extensions.find(ext);
+
+    if (it != _extensions.end())
+      return it.value();
+
+    it = _lowerExtensions.find(ext.toLower());
+
+    if (it != _lowerExtensions.end())
+      return it.value();
+
+    pos = name.indexOf('.', pos + 1);
+  }
+
+  // Shared libs: "lib.*\.so.*"
+  if (name.startsWith("lib") && name.indexOf(".so", 3) >= 0)
+    return SharedLibCategory;
+
+  // Very special, but common: Core dumps
+  if (name == "core")
+    return CoreDumpCategory;
+
+  // Special case: Executables
+  if ((file->mode() & S_IXUSR) == S_IXUSR)
+    return ExecutableCategory;
+
+  return DefaultCategory;
+}
+
+void KTreemapColorRules::resetCategories(KFileInfo *subtree) {
+  if (!subtree)
+    return;
+
+  subtree->setColorCategory(NoCategory);
+
+  for (size_t i = 0; i < subtree->numChildren(); i++)
+    resetCategories(subtree->child(i));
+
+  if (subtree->dotEntry())
+    resetCategories(subtree->dotEntry());
+}
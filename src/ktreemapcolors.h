@@ -0,0 +1,149 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ *   Author:	Stefan Hundhammer <sh@suse.de>
+ *              Joshua Hodosh <kdirstat@grumpypenguin.org>
+ */
+
+#include <QHash>
+#include <QStringList>
+#include <QVector>
+#include <qcolor.h>
+
+namespace KDirStat {
+class KFileInfo;
+
+/**
+ * Rules that assign treemap tile colors to files, mostly by filename
+ * extension.
+ *
+ * Each rule is a text of the form
+ *
+ *     color: ext1 ext2 =Ext3 ...
+ *
+ * where 'color' is anything QColor understands (e.g. "#ff0000" or
+ * "red"). Extensions are matched case insensitively unless they are
+ * prefixed with '='. For files with more than one extension, such as
+ * "foo.tar.bz2", the longest one is tried first ("tar.bz2", then
+ * "bz2"). The first rule that lists an extension wins.
+ *
+ * The rules are compiled into hash tables once. The color category
+ * determined for each file is cached in the file's @ref KFileInfo node,
+ * so the rules are only evaluated the first time a file is colored.
+ *
+ * Normal usage:
+ *
+ *     QColor color = KTreemapColorRules::colorRules()->color( file );
+ **/
+class KTreemapColorRules {
+public:
+  /**
+   * Constructor. Starts with the default rules.
+   *
+   * Most applications will want to use colorRules() instead to create
+   * and use a singleton object of this class.
+   **/
+  KTreemapColorRules();
+
+  /**
+   * Return the singleton object of this class.
+   * This will create one if there is none yet.
+   **/
+  static KTreemapColorRules *colorRules();
+
+  /**
+   * Returns the built-in rules.
+   **/
+  static QStringList defaultRules();
+
+  /**
+   * Replace the current rules with 'rules' and compile them. Rule texts
+   * that cannot be parsed are ignored with a warning.
+   *
+   * Returns 'true' if the rules actually changed. In that case, any
+   * category cached in existing tree nodes is stale; use
+   * resetCategories() on them.
+   **/
+  bool setRules(const QStringList &rules);
+
+  /**
+   * Returns the current rules.
+   **/
+  const QStringList &rules() const { return _rules; }
+
+  /**
+   * Returns the tile color for 'file'. Uses (and, if needed, sets) the
+   * category cached in 'file'.
+   **/
+  QColor color(KFileInfo *file);
+
+  /**
+   * Returns the color category of 'file'. Uses (and, if needed, sets) the
+   * category cached in 'file'.
+   **/
+  unsigned char cachedCategory(KFileInfo *file);
+
+  /**
+   * Evaluate the rules for 'file' and return its color category. This
+   * does not use or change the cached category.
+   **/
+  unsigned char category(const KFileInfo *file) const;
+
+  /**
+   * Clear the cached color category of all nodes in 'subtree'.
+   **/
+  static void resetCategories(KFileInfo *subtree);
+
+  /**
+   * Returns the number of categories, including the fixed ones. Valid
+   * categories are 1 .. categoryCount() - 1.
+   **/
+  int categoryCount() const { return _colors.size(); }
+
+  /**
+   * Returns the color of category 'category'.
+   **/
+  QColor categoryColor(unsigned char category) const {
+    return _colors[category];
+  }
+
+  /**
+   * Returns a name for category 'category' that can be shown to the
+   * user: For the categories of the rules, their extensions.
+   **/
+  QString categoryName(unsigned char category) const {
+    return _names[category];
+  }
+
+protected:
+  /**
+   * Fixed categories; the categories for the rules follow these.
+   * 'NoCategory' means that a node has not been categorized yet.
+   **/
+  enum {
+    NoCategory = 0,
+    DirCategory,
+    DefaultCategory,
+    SharedLibCategory,
+    CoreDumpCategory,
+    ExecutableCategory,
+    FirstRuleCategory
+  };
+
+  /**
+   * Parse one rule and add it to the hash tables.
+   * Returns 'false' if it could not be parsed.
+   **/
+  bool addRule(const QString &rule);
+
+  // Data members
+
+  QStringList _rules;
+  QVector<QColor> _colors;                         // indexed by category
+  QStringList _names;                              // indexed by category
+  QHash<QString, unsigned char> _extensions;      // case sensitive
+  QHash<QString, unsigned char> _lowerExtensions; // case insensitive
+};
+
+} // namespace KDirStat
@@ -19,30 +19,27 @@ using std::max;
 using std::min;
 
 struct childSizeComparator {
-  bool operator() (KFileInfo* f1, KFileInfo* f2) {
-    return f1->totalSize() > f2->totalSize();
+  bool operator()(const KTreemapLayoutItem &i1, const KTreemapLayoutItem &i2) {
+    return i1.size > i2.size;
   }
 };
 
-std::vector<KFileInfo*> sortedChildBySize(KFileInfo * info, KFileSize minSize) {
-  std::vector<KFileInfo*> r;
-  r.reserve(info->numChildren());
-  for(size_t i = 0; i < info->numChildren(); i++) {
-    if(info->child(i)->totalSize() >= minSize)
-      r.push_back(info->child(i));
-  }
-  if(info->dotEntry() && info->dotEntry()->totalSize() >= minSize)
-      r.push_back(info->dotEntry());
-  std::sort(r.begin(), r.end(), childSizeComparator());
-  r.shrink_to_fit();
-  return r;
+KTreemapLayoutBuffer &KTreemapLayoutBuffers::acquire() {
+  if (_depth == _levels.size())
+    _levels.emplace_back();
+
+  KTreemapLayoutBuffer &buf = _levels[_depth++];
+  buf.clear();
+
+  return buf;
 }
 
 KTreemapTile::KTreemapTile(KTreemapView *parentView, KTreemapTile *parentTile,
                            KFileInfo *orig, const QRectF &rect,
                            KOrientation orientation)
     : QGraphicsRectItem(rect, parentTile), _parentView(parentView),
-      _parentTile(parentTile), _orig(orig) {
+      _parentTile(parentTile), _orig(orig), _orientation(orientation),
+      _isAggregate(false), _isDirty(false), _pendingIndex(-1) {
   init();
 
   if (parentTile)
@@ -56,7 +53,9 @@ KTreemapTile::KTreemapTile(KTreemapView *parentView, KTreemapTile *parentTile,
                            const KCushionSurface &cushionSurface,
                            KOrientation orientation)
     : QGraphicsRectItem(rect, parentTile), _parentView(parentView),
-      _parentTile(parentTile), _orig(orig), _cushionSurface(cushionSurface) {
+      _parentTile(parentTile), _orig(orig), _cushionSurface(cushionSurface),
+      _orientation(orientation), _isAggregate(false), _isDirty(false),
+      _pendingIndex(-1) {
   init();
 
   // Intentionally not copying the parent's cushion surface!
@@ -64,8 +63,21 @@ KTreemapTile::KTreemapTile(KTreemapView *parentView, KTreemapTile *parentTile,
   createChildren(rect, orientation);
 }
 
+KTreemapTile::KTreemapTile(KTreemapTile *parentTile, const QRectF &rect)
+    : QGraphicsRectItem(rect, parentTile),
+      _parentView(parentTile->parentView()), _parentTile(parentTile),
+      _orig(parentTile->orig()),
+      _cushionSurface(parentTile->cushionSurface()),
+      _orientation(KTreemapAuto), _isAggregate(true), _isDirty(false),
+      _pendingIndex(-1) {
+  init();
+
+  // No children: This tile stands for all of them.
+}
+
 KTreemapTile::~KTreemapTile() {
-  // NOP
+  if (!_isAggregate)
+    _parentView->tileDestroyed(this);
 }
 
 void KTreemapTile::init() {
@@ -82,6 +94,9 @@ void KTreemapTile::init() {
 
   show(); // QCanvasItems are invisible by default!
 
+  if (!_isAggregate)
+    _parentView->tileCreated(this);
+
   // qDebug() << "Creating treemap tile for " << _orig
   //           << " size " << formatSize( _orig->totalSize() ) << endl;
 }
@@ -91,12 +106,109 @@ void KTreemapTile::createChildren(const QRectF &rect,
   if (_orig->totalSize() == 0) // Prevent division by zero
     return;
 
+  if (_orig->hasChildren() && _parentView->layoutBudgetExceeded()) {
+    // Out of time for this rebuild: Leave this tile as it is for now and
+    // create its children later.
+
+    _parentView->deferTile(this);
+    return;
+  }
+
   if (_parentView->squarify())
     createSquarifiedChildren(rect);
   else
     createChildrenSimple(rect, orientation);
 }
 
+void KTreemapTile::refine() {
+  if (!isPending())
+    return;
+
+  _pendingIndex = -1;
+  _cushion = QPixmap();
+  createChildren(rect(), _orientation);
+  update();
+}
+
+KTreemapTile *KTreemapTile::createChild(KFileInfo *orig, const QRect &rect,
+                                        const KCushionSurface &baseSurface,
+                                        KOrientation dir,
+                                        KOrientation orientation) {
+  KCushionSurface assignedSurface = baseSurface;
+  assignedSurface.addRidge(
+      dir, baseSurface.height() * _parentView->heightScaleFactor(), rect);
+
+  KTreemapTile *tile =
+      _parentView->reusableTile(orig, rect, assignedSurface, orientation);
+
+  if (tile) {
+    tile->_parentTile = this;
+    tile->setParentItem(this);
+
+    return tile;
+  }
+
+  tile = new KTreemapTile(_parentView, this, orig, rect, baseSurface,
+                          orientation);
+  Q_CHECK_PTR(tile);
+
+  tile->cushionSurface().addRidge(
+      dir, baseSurface.height() * _parentView->heightScaleFactor(), rect);
+  tile->_assignedSurface = assignedSurface;
+
+  return tile;
+}
+
+bool KTreemapTile::canBeReused(const QRectF &rect,
+                               const KCushionSurface &surface,
+                               KOrientation orientation) const {
+  return !_isDirty && !_isAggregate && orientation == _orientation &&
+         rect == this->rect() && surface == _assignedSurface;
+}
+
+void KTreemapTile::createAggregate(const QRectF &rect) {
+  if (!_parentView->levelOfDetail() || !_orig->hasChildren())
+    return;
+
+  if (rect.width() < 1 || rect.height() < 1)
+    return;
+
+  KTreemapTile *tile = new KTreemapTile(this, rect);
+  Q_CHECK_PTR(tile);
+}
+
+void KTreemapTile::collectChildren(KFileSize minSize,
+                                   KTreemapLayoutBuffer &buf) {
+  size_t count = _orig->numChildren();
+  buf.reserve(count + 1);
+
+  for (size_t i = 0; i < count; i++) {
+    KFileInfo *child = _orig->child(i);
+    KFileSize size = child->totalSize();
+
+    if (size >= minSize)
+      buf.push_back({child, size, 0});
+  }
+
+  KFileInfo *dotEntry = _orig->dotEntry();
+
+  if (dotEntry) {
+    KFileSize size = dotEntry->totalSize();
+
+    if (size >= minSize)
+      buf.push_back({dotEntry, size, 0});
+  }
+
+  std::sort(buf.begin(), buf.end(), childSizeComparator());
+
+  KFileSize sum = 0;
+
+  for (size_t i = 0; i < buf.size(); i++) {
+    sum += buf[i].size;
+    buf[i].sum = sum;
+  }
+}
+
 void KTreemapTile::createChildrenSimple(const QRectF &rect,
                                         KOrientation orientation) {
 
@@ -113,32 +225,35 @@ void KTreemapTile::createChildrenSimple(const QRectF &rect,
 
   int offset = 0;
   int size = dir == KTreemapHorizontal ? rect.width() : rect.height();
-  int count = 0;
   double scale = (double)size / (double)_orig->totalSize();
 
   _cushionSurface.addRidge(childDir, _cushionSurface.height(), rect);
-  std::vector<KFileInfo*> sorted = sortedChildBySize(
-      _orig, _parentView->minTileSize() / scale);
 
-  for(size_t i = 0; i < sorted.size(); i++) {
+  KTreemapLayoutBuffers &buffers = _parentView->layoutBuffers();
+  KTreemapLayoutBuffer &sorted = buffers.acquire();
+  collectChildren(_parentView->minTileSize() / scale, sorted);
+
+  for (size_t i = 0; i < sorted.size(); i++) {
     QRect childRect;
-    int childSize = scale * sorted[i]->totalSize();
-    assert(childSize >= _parentView->minTileSize());;
+    int childSize = scale * sorted[i].size;
+    assert(childSize >= _parentView->minTileSize());
     if (dir == KTreemapHorizontal)
       childRect = QRect(rect.x() + offset, rect.y(), childSize, rect.height());
     else
       childRect = QRect(rect.x(), rect.y() + offset, rect.width(), childSize);
 
-    KTreemapTile *tile = new KTreemapTile(_parentView, this, sorted[i], childRect, childDir);
-    Q_CHECK_PTR(tile);
-
-    tile->cushionSurface().addRidge(
-        dir, _cushionSurface.height() * _parentView->heightScaleFactor(),
-        childRect);
-
+    createChild(sorted[i].orig, childRect, _cushionSurface, dir, childDir);
     offset += childSize;
-    ++count;
   }
+
+  buffers.release();
+
+  if (dir == KTreemapHorizontal)
+    createAggregate(QRectF(rect.x() + offset, rect.y(),
+                           rect.width() - offset, rect.height()));
+  else
+    createAggregate(QRectF(rect.x(), rect.y() + offset, rect.width(),
+                           rect.height() - offset));
 }
 
 void KTreemapTile::createSquarifiedChildren(const QRectF &rect) {
@@ -158,24 +273,30 @@ void KTreemapTile::createSquarifiedChildren(const QRectF &rect) {
     }
 #endif
 
-  std::vector<KFileInfo*> sorted = sortedChildBySize(_orig, minSize);
-  std::vector<KFileInfo*>::iterator it = sorted.begin();
+  // The buffer stays in use while the child tiles (and, recursively,
+  // their children) are created, so the next tree level gets its own.
+
+  KTreemapLayoutBuffers &buffers = _parentView->layoutBuffers();
+  KTreemapLayoutBuffer &sorted = buffers.acquire();
+  collectChildren(minSize, sorted);
+
   QRectF childrenRect = rect;
-  for(size_t i = 0; i < sorted.size(); i++) {
+  size_t begin = 0;
 
+  while (begin < sorted.size()) {
+    size_t end = squarify(childrenRect, scale, sorted, begin);
+    childrenRect = layoutRow(childrenRect, scale, sorted, begin, end);
+    begin = end;
   }
-  std::vector<KFileInfo*> row;
-  while (it != sorted.end()) {
-    row.clear();
-    squarify(childrenRect, scale, it, sorted.end(), row);
-    childrenRect = layoutRow(childrenRect, scale, row);
-  }
+
+  buffers.release();
+
+  // Whatever is left over belongs to children that were too small.
+  createAggregate(childrenRect);
 }
 
-void KTreemapTile::squarify(const QRectF &rect, double scale,
-                            std::vector<KFileInfo*>::iterator &it,
-                            std::vector<KFileInfo*>::iterator end,
-                            std::vector<KFileInfo*> & row) {
+size_t KTreemapTile::squarify(const QRectF &rect, double scale,
+                              const KTreemapLayoutBuffer &buf, size_t begin) {
   // qDebug() << "squarify() " << _orig << " " << rect << endl;
   int length = max(rect.width(), rect.height());
 
@@ -183,51 +304,49 @@ void KTreemapTile::squarify(const QRectF &rect, double scale,
   {
     qWarning() << Q_FUNC_INFO << "Zero length";
 
-    if (it != end) // Prevent endless loop in case of error:
-      ++it;  // Advance iterator.
-    return;
+    return begin + 1; // Prevent endless loop in case of error
   }
 
-  bool improvingAspectRatio = true;
-  double lastWorstAspectRatio = -1.0;
-  double sum = 0;
-
   // This is a bit ugly, but doing all calculations in the 'size' dimension
   // is more efficient here since that requires only one scaling before
   // doing all other calculations in the loop.
   const double scaledLengthSquare = length * (double)length / scale;
 
-  while (it != end && improvingAspectRatio) {
-    sum += (*it)->totalSize();
+  // The buffer is sorted by size, so the largest item of the row is always
+  // its first one and the smallest one is the one just added. The row's sum
+  // comes from the prefix sums. This makes each step O(1).
+  const KFileSize base = begin > 0 ? buf[begin - 1].sum : 0;
+  const double largest = buf[begin].size;
+  double lastWorstAspectRatio = -1.0;
+  size_t end = begin + 1;
+
+  for (; end < buf.size(); ++end) {
+    double sum = buf[end].sum - base;
 
-    if (!row.empty() && sum != 0 && (*it)->totalSize() != 0) {
-      double sumSquare = sum * sum;
-      double worstAspectRatio =
-          max(scaledLengthSquare * row[0]->totalSize() / sumSquare,
-              sumSquare / (scaledLengthSquare * (*it)->totalSize()));
+    if (sum == 0 || buf[end].size == 0)
+      continue;
 
-      if (lastWorstAspectRatio >= 0.0 &&
-          worstAspectRatio > lastWorstAspectRatio) {
-        improvingAspectRatio = false;
-      }
+    double sumSquare = sum * sum;
+    double worstAspectRatio =
+        max(scaledLengthSquare * largest / sumSquare,
+            sumSquare / (scaledLengthSquare * buf[end].size));
 
-      lastWorstAspectRatio = worstAspectRatio;
+    if (lastWorstAspectRatio >= 0.0 &&
+        worstAspectRatio > lastWorstAspectRatio) {
+      // qDebug() << "Getting worse after adding " << buf[end].orig << endl;
+      break;
     }
 
-    if (improvingAspectRatio) {
-      // qDebug() << "Adding " << *it << " size " << (*it)->totalSize() << endl;
-      row.push_back(*it);
-      ++it;
-    } else {
-      // qDebug() << "Getting worse after adding " << *it << " size " <<
-      // (*it)->totalSize() << endl;
-    }
+    lastWorstAspectRatio = worstAspectRatio;
   }
+
+  return end;
 }
 
 QRectF KTreemapTile::layoutRow(const QRectF &rect, double scale,
-                               std::vector<KFileInfo*> &row) {
-  if (row.empty())
+                               const KTreemapLayoutBuffer &buf, size_t begin,
+                               size_t end) {
+  if (begin >= end)
     return rect;
 
   // Determine the direction in which to subdivide.
@@ -240,14 +359,15 @@ QRectF KTreemapTile::layoutRow(const QRectF &rect, double scale,
 
   // This row's secondary length is determined by the area (the number of
   // pixels) to be allocated for all of the row's items.
-  KFileSize sum = 0;
-  for(size_t i = 0; i < row.size(); i++)
-      sum += row[i]->totalSize();
-  int secondary = (int)(sum * scale / primary);
+  KFileSize sum = buf[end - 1].sum - (begin > 0 ? buf[begin - 1].sum : 0);
 
-  if (sum == 0) // Prevent division by zero.
+  // Nothing to lay out, and prevent division by zero: squarify() skips
+  // one item for a zero length rectangle.
+  if (sum == 0 || primary == 0)
     return rect;
 
+  int secondary = (int)(sum * scale / primary);
+
   if (secondary < _parentView->minTileSize()) // We don't want tiles that small.
     return rect;
 
@@ -264,8 +384,8 @@ QRectF KTreemapTile::layoutRow(const QRectF &rect, double scale,
   int offset = 0;
   int remaining = primary;
 
-  foreach (KFileInfo *it, row) {
-    int childSize = (int)(it->totalSize() / (double)sum * primary + 0.5);
+  for (size_t i = begin; i < end; i++) {
+    int childSize = (int)(buf[i].size / (double)sum * primary + 0.5);
 
     if (childSize >
         remaining) // Prevent overflow because of accumulated rounding errors
@@ -281,17 +401,9 @@ QRectF KTreemapTile::layoutRow(const QRectF &rect, double scale,
       else
         childRect = QRect(rect.x(), rect.y() + offset, secondary, childSize);
 
-      KTreemapTile *tile =
-          new KTreemapTile(_parentView, this, it, childRect, rowCushionSurface);
-      Q_CHECK_PTR(tile);
-
-      tile->cushionSurface().addRidge(
-          dir, rowCushionSurface.height() * _parentView->heightScaleFactor(),
-          childRect);
+      createChild(buf[i].orig, childRect, rowCushionSurface, dir);
       offset += childSize;
     }
-
-    ++it;
   }
 
   // Subtract the layouted area from the rectangle.
@@ -318,8 +430,13 @@ void KTreemapTile::paint(QPainter *painter,
   if (size.height() < 1 || size.width() < 1)
     return;
 
+  // Directories are covered by their children. Pending and aggregate tiles
+  // are not, so they are drawn like files.
+  bool isLeaf = isPending() || _isAggregate ||
+                (!_orig->isDir() && !_orig->isDotEntry());
+
   if (_parentView->doCushionShading()) {
-    if (_orig->isDir() || _orig->isDotEntry()) {
+    if (!isLeaf) {
       QGraphicsRectItem::paint(painter, option, widget);
     } else {
       if (_cushion.isNull())
@@ -496,6 +613,11 @@ KCushionSurface::KCushionSurface() {
   _height = CushionHeight;
 }
 
+bool KCushionSurface::operator==(const KCushionSurface &other) const {
+  return _xx2 == other._xx2 && _xx1 == other._xx1 && _yy2 == other._yy2 &&
+         _yy1 == other._yy1 && _height == other._height;
+}
+
 void KCushionSurface::addRidge(KOrientation dim, double height,
                                const QRectF &rect) {
   _height = height;
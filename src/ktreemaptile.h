@@ -7,13 +7,59 @@
  */
 
 #include <QGraphicsRectItem>
+#include <deque>
+#include <vector>
+
+#include "kfileinfo.h"
 
 namespace KDirStat {
-class KFileInfo;
 class KTreemapView;
 
 enum KOrientation { KTreemapHorizontal, KTreemapVertical, KTreemapAuto };
 
+/**
+ * One child to be laid out in a treemap tile. The child's total size is
+ * fetched only once and cached here; 'sum' is the prefix sum of the sizes
+ * of all items up to and including this one in the sorted layout buffer,
+ * so the size of any run of items can be computed without iterating.
+ **/
+struct KTreemapLayoutItem {
+  KFileInfo *orig;
+  KFileSize size;
+  KFileSize sum;
+};
+
+typedef std::vector<KTreemapLayoutItem> KTreemapLayoutBuffer;
+
+/**
+ * Scratch buffers for the treemap layout, owned by the treemap view and
+ * reused for all tiles of all rebuilds.
+ *
+ * Tiles create their children recursively while their own layout buffer
+ * is still in use, so there is one buffer for each tree level that is
+ * currently being laid out. A deque is used so that adding a level does
+ * not invalidate references to the buffers of the levels above.
+ **/
+class KTreemapLayoutBuffers {
+public:
+  KTreemapLayoutBuffers() : _depth(0) {}
+
+  /**
+   * Returns an empty buffer for the next tree level. Each call must be
+   * matched by a call to release().
+   **/
+  KTreemapLayoutBuffer &acquire();
+
+  /**
+   * Return the buffer of the innermost tree level.
+   **/
+  void release() { --_depth; }
+
+private:
+  std::deque<KTreemapLayoutBuffer> _levels;
+  size_t _depth;
+};
+
 /**
  * Helper class for cushioned treemaps: This class holds the polynome
  * parameters for the cushion surface. The height of each point of such a
@@ -75,6 +121,11 @@ public:
    **/
   double yy1() const { return _yy1; }
 
+  /**
+   * Returns 'true' if 'other' has the same coefficients and height.
+   **/
+  bool operator==(const KCushionSurface &other) const;
+
 protected:
   /**
    * Calculate a new square polynomal coefficient for adding a ridge of
@@ -127,6 +178,16 @@ protected:
                const KCushionSurface &cushionSurface,
                KOrientation orientation = KTreemapAuto);
 
+  /**
+   * Constructor for an aggregate tile: A leaf inside 'parentTile' that
+   * covers the area of all of its children that are too small to get a
+   * tile of their own. It is drawn with the parent's cushion surface.
+   *
+   * Aggregate tiles refer to the same @ref KFileInfo as their parent,
+   * but they are not registered with the view's tile lookup table.
+   **/
+  KTreemapTile(KTreemapTile *parentTile, const QRectF &rect);
+
 public:
   /**
    * Destructor.
@@ -154,6 +215,55 @@ public:
    **/
   KCushionSurface &cushionSurface() { return _cushionSurface; }
 
+  /**
+   * Returns 'true' if this is an aggregate tile for children that are
+   * too small to be shown individually.
+   **/
+  bool isAggregate() const { return _isAggregate; }
+
+  /**
+   * Returns 'true' if creating this tile's children was postponed
+   * because the view's layout time budget was used up.
+   **/
+  bool isPending() const { return _pendingIndex >= 0; }
+
+  /**
+   * Returns the position of this tile in the view's queue of pending
+   * tiles or -1 if it is not pending.
+   **/
+  int pendingIndex() const { return _pendingIndex; }
+
+  /**
+   * Set the position of this tile in the view's queue of pending tiles.
+   **/
+  void setPendingIndex(int index) { _pendingIndex = index; }
+
+  /**
+   * Create the children of a pending tile.
+   **/
+  void refine();
+
+  /**
+   * Returns 'true' if this tile's subtree changed since it was laid out,
+   * so it can't be reused in the next layout.
+   **/
+  bool isDirty() const { return _isDirty; }
+
+  /**
+   * Mark this tile as changed.
+   **/
+  void setDirty() { _isDirty = true; }
+
+  /**
+   * Returns 'true' if this tile can stand in for a new tile that would be
+   * laid out in 'rect' with the parent's cushion surface 'surface' and
+   * subdivided in 'orientation': That new tile would look exactly the
+   * same, so this one can be kept with all its children and its already
+   * rendered cushion.
+   **/
+  bool canBeReused(const QRectF &rect, const KCushionSurface &surface,
+                   KOrientation orientation) const;
+
 protected:
   /**
    * Create children (sub-tiles) of this tile.
@@ -169,6 +279,23 @@ protected:
    **/
   void createChildrenSimple(const QRectF &rect, KOrientation orientation);
 
+  /**
+   * Create a child tile for 'orig' in 'rect', starting from
+   * 'baseSurface', and add a cushion ridge in direction 'dir' for it. If
+   * the view has an unchanged tile for 'orig' from the previous layout,
+   * that one is moved here instead.
+   **/
+  KTreemapTile *createChild(KFileInfo *orig, const QRect &rect,
+                            const KCushionSurface &baseSurface,
+                            KOrientation dir,
+                            KOrientation orientation = KTreemapAuto);
+
+  /**
+   * Create an aggregate tile in 'rect' if level of detail mode is on and
+   * 'rect' is large enough to be visible.
+   **/
+  void createAggregate(const QRectF &rect);
+
   /**
    * Create children using the "squarified treemaps" algorithm as
    * described by Mark Bruls, Kees Huizing, and Jarke J. van Wijk of the
@@ -198,24 +325,30 @@ protected:
   void createSquarifiedChildren(const QRectF &rect);
 
   /**
-   * Squarify as many children as possible: Try to squeeze members
-   * referred to by 'it' into 'rect' until the aspect ratio doesn't get
-   * better any more. Returns a list of children that should be laid out
-   * in 'rect'. Moves 'it' until there is no more improvement or 'it'
-   * runs out of items.
+   * Fill 'buf' with all children (including the dot entry) of at least
+   * 'minSize', sorted by size in descending order, and set up their
+   * prefix sums.
+   **/
+  void collectChildren(KFileSize minSize, KTreemapLayoutBuffer &buf);
+
+  /**
+   * Squarify as many children as possible: Try to squeeze the items of
+   * 'buf' starting at index 'begin' into 'rect' until the aspect ratio
+   * doesn't get better any more. Returns the end index of the row that
+   * should be laid out in 'rect'.
    *
    * 'scale' is the scaling factor between file sizes and pixels.
    **/
-  void squarify(const QRectF &rect, double scale,
-                std::vector<KFileInfo*>::iterator &,
-                std::vector<KFileInfo*>::iterator end,
-                std::vector<KFileInfo*> & output);
+  size_t squarify(const QRectF &rect, double scale,
+                  const KTreemapLayoutBuffer &buf, size_t begin);
 
   /**
-   * Lay out all members of 'row' within 'rect' along its longer side.
-   * Returns the new rectangle with the layouted area subtracted.
+   * Lay out the items [begin, end) of 'buf' within 'rect' along its
+   * longer side. Returns the new rectangle with the layouted area
+   * subtracted.
    **/
-  QRectF layoutRow(const QRectF &rect, double scale, std::vector<KFileInfo*> &row);
+  QRectF layoutRow(const QRectF &rect, double scale,
+                   const KTreemapLayoutBuffer &buf, size_t begin, size_t end);
 
   /**
    * Draw the tile.
@@ -257,7 +390,12 @@ protected:
   KTreemapTile *_parentTile;
   KFileInfo *_orig;
   KCushionSurface _cushionSurface;
+  KCushionSurface _assignedSurface; // as assigned by the parent's layout
   QPixmap _cushion;
+  KOrientation _orientation;
+  bool _isAggregate;
+  bool _isDirty;
+  int _pendingIndex; // in the view's queue of pending tiles, or -1
 
 }; // class KTreemapTile
 
@@ -5,22 +5,25 @@
  */
 
 #include <qevent.h>
-#include <qregexp.h>
 
 #include <KSharedConfig>
 #include <kconfig.h>
 #include <kconfiggroup.h>
 
 #include "kdirtree.h"
+#include "ktreemapcolors.h"
 #include "ktreemaptile.h"
 #include "ktreemapview.h"
 
+#define VERBOSE_LAYOUT_TIMING 0
+
 using namespace KDirStat;
 
 KTreemapView::KTreemapView(KDirTree *tree, QWidget *parent,
                            const QSize &initialSize)
     : QGraphicsView(parent), _tree(tree), _rootTile(0), _selectedTile(0),
-      _selectionRect(0) {
+      _selectionRect(0), _oldRootTile(0), _incrementalUpdate(false),
+      _firstPendingTile(0) {
   // qDebug() << Q_FUNC_INFO << endl;
 
   readConfig();
@@ -59,16 +62,29 @@ KTreemapView::KTreemapView(KDirTree *tree, QWidget *parent,
 
   connect(tree, SIGNAL(childDeleted()), &_refreshTimer, SLOT(start()));
   connect(&_refreshTimer, SIGNAL(timeout()), this, SLOT(rebuildTreemap()));
+
+  _refineTimer.setSingleShot(true);
+  connect(&_refineTimer, SIGNAL(timeout()), this, SLOT(refinePendingTiles()));
 }
 
-KTreemapView::~KTreemapView() {}
+KTreemapView::~KTreemapView() {
+  // Delete the tiles while the tile lookup table they unregister from
+  // still exists; the scene would otherwise only be deleted as a child
+  // QObject after all data members are gone.
+  clear();
+}
 
 void KTreemapView::clear() {
+  _pendingTiles.clear();
+  _firstPendingTile = 0;
+  _refineTimer.stop();
+
   if (scene())
     scene()->clear();
   _selectedTile = 0;
   _selectionRect = 0;
   _rootTile = 0;
+  _incrementalUpdate = false;
 }
 
 void KTreemapView::readConfig() {
@@ -84,6 +100,9 @@ void KTreemapView::readConfig() {
   _ensureContrast = config.readEntry("EnsureContrast", true);
   _forceCushionGrid = config.readEntry("ForceCushionGrid", false);
   _minTileSize = config.readEntry("MinTileSize", DefaultMinTileSize);
+  _levelOfDetail = config.readEntry("LevelOfDetail", true);
+  _layoutTimeBudget =
+      config.readEntry("LayoutTimeBudget", DefaultLayoutTimeBudget);
 
   _highlightColor = readColorEntry(&config, "HighlightColor", QColor(Qt::red));
   _cushionGridColor =
@@ -94,6 +113,14 @@ void KTreemapView::readConfig() {
   _dirFillColor =
       readColorEntry(&config, "DirFillColor", QColor(0x10, 0x7d, 0xb4));
 
+  QStringList colorRules = config.readEntry(
+      "FileColorRules", KTreemapColorRules::defaultRules());
+
+  if (KTreemapColorRules::colorRules()->setRules(colorRules) && _tree) {
+    KTreemapColorRules::resetCategories(_tree->root());
+    _tree->recalcFileTypeStats(); // by the categories of the new rules
+  }
+
   if (_autoResize) {
     setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
     setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
@@ -116,6 +143,11 @@ KTreemapTile *KTreemapView::tileAt(QPoint pos) {
       break;
   }
 
+  // An aggregate tile has no node of its own; use the directory it
+  // belongs to.
+  if (tile && tile->isAggregate())
+    tile = tile->parentTile();
+
   return tile;
 }
 
@@ -305,16 +337,51 @@ void KTreemapView::rebuildTreemap() {
 void KTreemapView::rebuildTreemap(KFileInfo *newRoot) {
   QRect viewportRect(0, 0, this->width(), this->height());
   QRectF newSize = mapToScene(viewportRect).boundingRect();
-  clear();
-  if (newRoot) {
-    QGraphicsScene *canv = new QGraphicsScene(this);
-    canv->setSceneRect(newSize);
+
+  // After deleting nodes, most of the old tiles can be reused if neither
+  // the root nor the size changed: Lay out the new treemap in the old
+  // scene and let the tiles pick up their unchanged counterparts, then
+  // get rid of what is left of the old treemap.
+
+  bool incremental = _incrementalUpdate && _rootTile && newRoot &&
+                     newRoot == _rootTile->orig() &&
+                     newSize == _rootTile->rect();
+  _incrementalUpdate = false;
+
+  if (incremental) {
+    _oldRootTile = _rootTile;
+    _layoutTimer.start();
     _rootTile = new KTreemapTile(this,    // parentView
                                  0,       // parentTile
                                  newRoot, // orig
                                  newSize, KTreemapAuto);
-    canv->addItem(_rootTile);
-    setScene(canv);
+#if VERBOSE_LAYOUT_TIMING
+    qDebug() << "Incremental treemap layout for" << newRoot->debugUrl()
+             << "took" << _layoutTimer.elapsed() << "ms";
+#endif
+    scene()->addItem(_rootTile);
+
+    selectTile(0, false); // might be an old tile that is about to go away
+    delete _oldRootTile;
+    _oldRootTile = 0;
+  } else {
+    clear();
+
+    if (newRoot) {
+      QGraphicsScene *canv = new QGraphicsScene(this);
+      canv->setSceneRect(newSize);
+      _layoutTimer.start();
+      _rootTile = new KTreemapTile(this,    // parentView
+                                   0,       // parentTile
+                                   newRoot, // orig
+                                   newSize, KTreemapAuto);
+#if VERBOSE_LAYOUT_TIMING
+      qDebug() << "Treemap layout for" << newRoot->debugUrl() << "took"
+               << _layoutTimer.elapsed() << "ms";
+#endif
+      canv->addItem(_rootTile);
+      setScene(canv);
+    }
   }
 
   // Synchronize selection with the tree
@@ -322,7 +389,34 @@ void KTreemapView::rebuildTreemap(KFileInfo *newRoot) {
   emit treemapChanged();
 }
 
-void KTreemapView::deleteNotify(KFileInfo *) {
+void KTreemapView::deleteNotify(KFileInfo *node) {
+  if (_rootTile && node && !_rootTile->orig()->isInSubtree(node)) {
+    // Only a part of the treemap is going away: Remove the tiles for it
+    // right now (they would otherwise keep pointers to deleted nodes) and
+    // mark everything above them as changed. All other tiles can be
+    // reused by the rebuildTreemap() call that is triggered by the
+    // childDeleted() signal the tree emits after deleting is done.
+
+    if (_selectedTile && _selectedTile->orig()->isInSubtree(node))
+      selectTile(0, false);
+
+    delete findTile(node);
+
+    for (KFileInfo *parent = node->parent(); parent;
+         parent = parent->parent()) {
+      KTreemapTile *tile = findTile(parent);
+
+      if (tile)
+        tile->setDirty();
+
+      if (tile == _rootTile)
+        break;
+    }
+
+    _incrementalUpdate = true;
+    return;
+  }
+
   if (_rootTile) {
     if (_rootTile->orig() != _tree->root()) {
       // If the user zoomed the treemap in, save the root's URL so the
@@ -389,197 +483,78 @@ void KTreemapView::updateSelection(KDirTree * tree) {
     selectTile(nullptr, false);
 }
 
-KTreemapTile *KTreemapView::findTile(KFileInfo *node) {
-  if (!node)
+void KTreemapView::tileCreated(KTreemapTile *tile) {
+  _tiles.insert(tile->orig(), tile);
+}
+
+void KTreemapView::tileDestroyed(KTreemapTile *tile) {
+  QHash<KFileInfo *, KTreemapTile *>::iterator it = _tiles.find(tile->orig());
+
+  if (it != _tiles.end() && it.value() == tile)
+    _tiles.erase(it);
+
+  int index = tile->pendingIndex();
+
+  if (index >= _firstPendingTile && index < _pendingTiles.size() &&
+      _pendingTiles[index] == tile)
+    _pendingTiles[index] = 0;
+}
+
+KTreemapTile *KTreemapView::reusableTile(KFileInfo *orig, const QRectF &rect,
+                                         const KCushionSurface &surface,
+                                         KOrientation orientation) const {
+  if (!_oldRootTile)
     return 0;
 
-  foreach (QGraphicsItem *i, scene()->items()) {
-    KTreemapTile *tile = dynamic_cast<KTreemapTile *>(i);
-    if (tile && tile->orig() == node)
-      return tile;
-  }
+  KTreemapTile *tile = findTile(orig);
+
+  if (tile && tile->canBeReused(rect, surface, orientation))
+    return tile;
 
   return 0;
 }
 
-QColor KTreemapView::tileColor(KFileInfo *file) {
-  if (file) {
-    if (file->isFile()) {
-      // Find the filename extension: Everything after the first '.'
-      QString ext = file->name().section('.', 1);
-
-      while (!ext.isEmpty()) {
-        QString lowerExt = ext.toLower();
-
-        // Try case sensitive comparisions first
-
-        if (ext == "~")
-          return Qt::red;
-        if (ext == "bak")
-          return Qt::red;
-
-        if (ext == "c")
-          return Qt::blue;
-        if (ext == "cpp")
-          return Qt::blue;
-        if (ext == "cc")
-          return Qt::blue;
-        if (ext == "h")
-          return Qt::blue;
-        if (ext == "hpp")
-          return Qt::blue;
-        if (ext == "el")
-          return Qt::blue;
-
-        if (ext == "o")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "lo")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "Po")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "al")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "moc.cpp")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "moc.cc")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "elc")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "la")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "a")
-          return QColor(0xff, 0xa0, 0x00);
-        if (ext == "rpm")
-          return QColor(0xff, 0xa0, 0x00);
-
-        // archives
-        if (lowerExt == "tar.bz2")
-          return Qt::green;
-        if (lowerExt == "tar.gz")
-          return Qt::green;
-        if (lowerExt == "tar.xz")
-          return Qt::green;
-        if (lowerExt == "tgz")
-          return Qt::green;
-        if (lowerExt == "bz2")
-          return Qt::green;
-        if (lowerExt == "bz")
-          return Qt::green;
-        if (lowerExt == "gz")
-          return Qt::green;
-
-        if (lowerExt == "html")
-          return Qt::blue;
-        if (lowerExt == "htm")
-          return Qt::blue;
-        if (lowerExt == "txt")
-          return Qt::blue;
-        if (lowerExt == "doc")
-          return Qt::blue;
-        if (lowerExt == "php")
-          return Qt::blue;
-        if (lowerExt == "odt")
-          return Qt::blue;
-        if (lowerExt == "ods")
-          return Qt::blue;
-
-        if (lowerExt == "png")
-          return Qt::cyan;
-        if (lowerExt == "jpg")
-          return Qt::cyan;
-        if (lowerExt == "jpeg")
-          return Qt::cyan;
-        if (lowerExt == "gif")
-          return Qt::cyan;
-        if (lowerExt == "tif")
-          return Qt::cyan;
-        if (lowerExt == "tiff")
-          return Qt::cyan;
-        if (lowerExt == "bmp")
-          return Qt::cyan;
-        if (lowerExt == "xpm")
-          return Qt::cyan;
-        if (lowerExt == "tga")
-          return Qt::cyan;
-        if (lowerExt == "xcf")
-          return Qt::cyan;
-
-        if (lowerExt == "wav")
-          return Qt::yellow;
-        if (lowerExt == "mp3")
-          return Qt::yellow;
-
-        if (lowerExt == "avi")
-          return QColor(0xa0, 0xff, 0x00);
-        if (lowerExt == "mov")
-          return QColor(0xa0, 0xff, 0x00);
-        if (lowerExt == "mpg")
-          return QColor(0xa0, 0xff, 0x00);
-        if (lowerExt == "mpeg")
-          return QColor(0xa0, 0xff, 0x00);
-        if (lowerExt == "wmv")
-          return QColor(0xa0, 0xff, 0x00);
-
-        if (lowerExt == "pdf")
-          return Qt::blue;
-        if (lowerExt == "ps")
-          return Qt::cyan;
-
-        // databases
-        if (lowerExt == "db")
-          return QColor(0, 0, 127);
-        if (lowerExt == "sqlite")
-          return QColor(0, 0, 127);
-        if (lowerExt == "sql")
-          return QColor(0, 0, 127);
-
-        // other
-        if (lowerExt == "jar")
-          return QColor(255, 255, 0);
-        if (lowerExt == "cb")
-          return QColor(190, 160, 100);
-        if (lowerExt == "dat")
-          return QColor(255, 255, 255);
-
-        // Some DOS/Windows types
-
-        if (lowerExt == "exe")
-          return Qt::magenta;
-        if (lowerExt == "com")
-          return Qt::magenta;
-        if (lowerExt == "dll")
-          return QColor(0xff, 0xa0, 0x00);
-        if (lowerExt == "zip")
-          return Qt::green;
-        if (lowerExt == "arj")
-          return Qt::green;
-
-        // No match so far? Try the next extension. Some files might have
-        // more than one, e.g., "tar.bz2" - if there is no match for
-        // "tar.bz2", there might be one for just "bz2".
-
-        ext = ext.section('.', 1);
-      }
+void KTreemapView::deferTile(KTreemapTile *tile) {
+  tile->setPendingIndex(_pendingTiles.size());
+  _pendingTiles.append(tile);
 
-      // Shared libs
-      if (QRegExp("lib.*\\.so.*").exactMatch(file->name()))
-        return QColor(0xff, 0xa0, 0x00);
-
-      // Very special, but common: Core dumps
-      if (file->name() == "core")
-        return Qt::red;
-
-      // Special case: Executables
-      if ((file->mode() & S_IXUSR) == S_IXUSR)
-        return Qt::magenta;
-    } else // Directories
-    {
-      // TO DO
-      return Qt::blue;
-    }
+  if (!_refineTimer.isActive())
+    _refineTimer.start(0);
+}
+
+void KTreemapView::refinePendingTiles() {
+  _layoutTimer.start();
+
+  // First come, first served: The tiles deferred first are the shallow
+  // ones, and refining them defers their children behind all others.
+
+  while (_firstPendingTile < _pendingTiles.size() && !layoutBudgetExceeded()) {
+    KTreemapTile *tile = _pendingTiles[_firstPendingTile];
+    _pendingTiles[_firstPendingTile++] = 0;
+
+    if (tile)
+      tile->refine();
+  }
+
+#if VERBOSE_LAYOUT_TIMING
+  qDebug() << "Treemap refinement step took" << _layoutTimer.elapsed()
+           << "ms;" << _pendingTiles.size() - _firstPendingTile
+           << "tiles still pending";
+#endif
+
+  if (_firstPendingTile == _pendingTiles.size()) {
+    _pendingTiles.clear();
+    _firstPendingTile = 0;
+
+    // The tile for the tree's selection might not have existed so far.
+    updateSelection(_tree);
+  } else {
+    _refineTimer.start(0);
   }
+}
 
-  return Qt::white;
+QColor KTreemapView::tileColor(KFileInfo *file) {
+  return KTreemapColorRules::colorRules()->color(file);
 }
 
 KTreemapSelectionRect::KTreemapSelectionRect(const QColor &color) {
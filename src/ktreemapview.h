@@ -5,10 +5,15 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include <QElapsedTimer>
 #include <QGraphicsRectItem>
 #include <QGraphicsView>
+#include <QHash>
+#include <QVector>
 #include <kconfiggroup.h>
 
+#include "ktreemaptile.h"
+
 #define MinAmbientLight 0
 #define MaxAmbientLight 200
 #define DefaultAmbientLight 40
@@ -19,6 +24,7 @@
 #define DefaultHeightScaleFactor (DefaultHeightScalePercent / 100.0)
 
 #define DefaultMinTileSize 3
+#define DefaultLayoutTimeBudget 100 // millisec
 #define CushionHeight 1.0
 
 class QMouseEvent;
@@ -76,15 +82,37 @@ public:
   /**
    * Search the treemap for a tile that corresponds to the specified
    * KFileInfo node. Returns 0 if there is none.
+   **/
+  KTreemapTile *findTile(KFileInfo *node) const { return _tiles.value(node); }
+
+  /**
+   * Notification that 'tile' was created. Called from the tile's
+   * constructor to keep the lookup table for findTile() up to date.
+   **/
+  void tileCreated(KTreemapTile *tile);
+
+  /**
+   * Notification that 'tile' is being destroyed.
+   **/
+  void tileDestroyed(KTreemapTile *tile);
+
+  /**
+   * Returns the tile for 'orig' from the previous layout if it can be
+   * reused unchanged in the layout that is currently being built, i.e.
+   * if it would get the same rectangle, cushion surface and orientation
+   * and nothing below it has changed. Returns 0 otherwise.
    *
-   * Notice: This is an expensive operation since all treemap tiles need
-   * to be searched.
+   * This is only ever the case while rebuilding the treemap after
+   * deleting nodes.
    **/
-  KTreemapTile *findTile(KFileInfo *node);
+  KTreemapTile *reusableTile(KFileInfo *orig, const QRectF &rect,
+                             const KCushionSurface &surface,
+                             KOrientation orientation) const;
 
   /**
-   * Returns a suitable color for 'file' based on a set of internal rules
-   * (according to filename extension, MIME type or permissions).
+   * Returns a suitable color for 'file' based on the configured
+   * @ref KTreemapColorRules (according to filename extension or
+   * permissions).
    **/
   QColor tileColor(KFileInfo *file);
 
@@ -138,7 +166,12 @@ public slots:
   void clear();
 
   /**
-   * Notification that a dir tree node has been deleted.
+   * Notification that a dir tree node is about to be deleted.
+   *
+   * If the node is inside the current treemap, only its tile is removed
+   * and its ancestors are marked as changed. The next rebuildTreemap()
+   * then keeps all tiles that didn't change instead of laying out and
+   * rendering everything again.
    **/
   void deleteNotify(KFileInfo *node);
 
@@ -254,6 +287,42 @@ public:
    **/
   double heightScaleFactor() const { return _heightScaleFactor; }
 
+  /**
+   * Returns the scratch buffers the treemap tiles use for their layout.
+   **/
+  KTreemapLayoutBuffers &layoutBuffers() { return _layoutBuffers; }
+
+  /**
+   * Returns 'true' if level of detail mode is on: Children too small to
+   * be shown are aggregated into one tile, and layouting deep trees is
+   * spread over several steps within a time budget.
+   **/
+  bool levelOfDetail() const { return _levelOfDetail; }
+
+  /**
+   * Returns 'true' if the time budget for the current layout step is
+   * used up. Tiles should then defer creating their children.
+   **/
+  bool layoutBudgetExceeded() const {
+    return _levelOfDetail && _layoutTimeBudget > 0 &&
+           _layoutTimer.isValid() &&
+           _layoutTimer.elapsed() > _layoutTimeBudget;
+  }
+
+  /**
+   * Queue 'tile' for creating its children in a later layout step.
+   **/
+  void deferTile(KTreemapTile *tile);
+
+protected slots:
+
+  /**
+   * Create the children of pending tiles until the time budget for this
+   * layout step is used up. Schedules another step if there are still
+   * pending tiles left.
+   **/
+  void refinePendingTiles();
+
 signals:
   /**
    * Emitted when the treemap changes, e.g. is rebuilt, zoomed in, or
@@ -318,14 +387,18 @@ protected:
   KTreemapTile *_rootTile;
   KTreemapTile *_selectedTile;
   KTreemapSelectionRect *_selectionRect;
+  KTreemapTile *_oldRootTile;
   QString _savedRootUrl;
+  bool _incrementalUpdate;
 
   bool _autoResize;
   bool _squarify;
   bool _doCushionShading;
   bool _forceCushionGrid;
   bool _ensureContrast;
+  bool _levelOfDetail;
   int _minTileSize;
+  int _layoutTimeBudget;
 
   QColor _highlightColor;
   QColor _cushionGridColor;
@@ -341,6 +414,14 @@ protected:
 
   double _heightScaleFactor;
   QTimer _refreshTimer;
+  KTreemapLayoutBuffers _layoutBuffers;
+  QHash<KFileInfo *, KTreemapTile *> _tiles;
+  // Tiles waiting for refinePendingTiles() in the order they were deferred,
+  // i.e. shallow ones first. Destroyed tiles leave a 0 behind.
+  QVector<KTreemapTile *> _pendingTiles;
+  int _firstPendingTile; // the next one to refine
+  QElapsedTimer _layoutTimer;
+  QTimer _refineTimer;
 }; // class KTreemapView
 
 /**
@@ -11,11 +11,16 @@
  */
 
 #include "k4dirstat.h"
+#include "kdirtree.h"
+#include "kexcluderules.h"
 #include <KAboutData>
+#include <KConfigGroup>
 #include <KLocalizedString>
+#include <KSharedConfig>
 #include <QApplication>
 #include <QCommandLineParser>
 #include <QDir>
+#include <QTextStream>
 #include <QUrl>
 
 static const char description[] =
@@ -28,6 +33,49 @@ static const char description[] =
 #define EXPAND(x) STRINGIFY(x)
 static const char version[] = EXPAND(K4DIRSTAT_VERSION);
 
+/**
+ * Read 'url' without any window and print its largest files and
+ * directories to stdout, one "<bytes><TAB><path>" line each. Returns the
+ * exit code.
+ **/
+static int printLargestItems(QApplication &app, const QUrl &url) {
+  KConfigGroup config = KSharedConfig::openConfig()->group("Exclude");
+  QStringList excludeRules = config.readEntry("ExcludeRules", QStringList());
+
+  foreach (const QString &ruleText, excludeRules)
+    KExcludeRules::excludeRules()->add(KExcludeRule::fromText(ruleText));
+
+  KDirTree tree;
+
+  // Queued: Reading might be over before the event loop is entered
+  QObject::connect(&tree, SIGNAL(finished()), &app, SLOT(quit()),
+                   Qt::QueuedConnection);
+  QObject::connect(&tree, SIGNAL(aborted()), &app, SLOT(quit()),
+                   Qt::QueuedConnection);
+
+  tree.startReading(url);
+  app.exec();
+
+  if (!tree.root())
+    return 1;
+
+  QTextStream out(stdout);
+  std::vector<KLargeItem> files = tree.largestFiles();
+  std::vector<KLargeItem> dirs = tree.largestDirs();
+
+  out << "# Largest files" << Qt::endl;
+
+  for (size_t i = 0; i < files.size(); i++)
+    out << files[i].size << '\t' << files[i].itemUrl() << Qt::endl;
+
+  out << "# Largest directories without subdirectories" << Qt::endl;
+
+  for (size_t i = 0; i < dirs.size(); i++)
+    out << dirs[i].size << '\t' << dirs[i].itemUrl() << Qt::endl;
+
+  return 0;
+}
+
 int main(int argc, char **argv) {
   QApplication app(argc, argv);
   KLocalizedString::setApplicationDomain("k4dirstat");
@@ -69,7 +117,25 @@ int main(int argc, char **argv) {
   parser.addHelpOption();
   parser.addVersionOption();
   parser.addPositionalArgument("+[Dir/URL]", "Directory or URL to open");
+  QCommandLineOption largestOption(
+      "largest", i18n("Print the largest files and directories of Dir/URL "
+                      "without opening a window"));
+  parser.addOption(largestOption);
   parser.process(app);
+
+  if (parser.isSet(largestOption)) {
+    QStringList args = parser.positionalArguments();
+
+    if (args.isEmpty())
+      parser.showHelp(1);
+
+    QUrl u = QUrl::fromUserInput(args[0], QDir::currentPath(),
+                                 QUrl::AssumeLocalFile);
+    return printLargestItems(
+        app,
+        u.adjusted(QUrl::StripTrailingSlash | QUrl::NormalizePathSegments));
+  }
+
   k4dirstat *kdirstat = new k4dirstat;
 
   // see if we are starting with session management